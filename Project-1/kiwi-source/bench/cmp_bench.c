@@ -0,0 +1,243 @@
+// Microbenchmark of the key comparisons: string_cmp() against the
+// memcmp() based comparison it replaced, on the kinds of keys we store,
+// then the skiplist of the memtable which compares through the prefixes
+// cached in its nodes, against the uncached comparison it replaced and
+// ordered by every comparator.
+//
+// Usage: ./cmp-bench [count]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../engine/comparator.h"
+#include "../engine/skiplist.h"
+#include "../engine/utils.h"
+
+#define KEYS (1 << 16)
+#define ROUNDS (64)
+
+// The before and after runs alternate, and the best of each is kept: the
+// runs are short enough for the noise of the machine to matter
+#define RUNS (5)
+
+static long long _ustime(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static double _min(double a, double b)
+{
+	return (a < b) ? a : b;
+}
+
+// The comparison before the word at a time one
+static int _memcmp_cmp(const char* s1, const char* s2, size_t ln, size_t lm)
+{
+	int ret = memcmp(s1, s2, ln < lm ? ln : lm);
+
+	if (ln == lm || ret != 0)
+		return ret;
+
+	return (ln < lm) ? -1 : 1;
+}
+
+static char* _keys[KEYS];
+static size_t _lengths[KEYS];
+
+static void _random_key(char* key, int length)
+{
+	const char salt[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+
+	for (int i = 0; i < length; i++)
+		key[i] = salt[rand() % 36];
+}
+
+// Random keys of length bytes, or sequential ones sharing all but their
+// last digits when shared is set
+static void _make_keys(int length, int shared)
+{
+	for (int i = 0; i < KEYS; i++) {
+		free(_keys[i]);
+		_keys[i] = malloc(length + 1);
+
+		if (shared) {
+			char digits[16];
+
+			snprintf(digits, sizeof(digits), "%08d", rand() % 100000000);
+			memset(_keys[i], 'k', length);
+			memcpy(_keys[i] + length - 8, digits, 8);
+		} else
+			_random_key(_keys[i], length);
+
+		_lengths[i] = length;
+	}
+}
+
+// Sorting comparisons of neighbours: most pairs differ early, the sorted
+// ones late
+static double _bench_cmp(int (*volatile cmp)(const char*, const char*, size_t, size_t), int* sink)
+{
+	long long start = _ustime();
+	int sum = 0;
+
+	for (int r = 0; r < ROUNDS; r++)
+		for (int i = 1; i < KEYS; i++)
+			sum += cmp(_keys[i - 1], _keys[i], _lengths[i - 1], _lengths[i]) < 0;
+
+	*sink += sum;
+	return (double)(_ustime() - start) * 1000.0 / ((double)ROUNDS * (KEYS - 1));
+}
+
+static int _string_cmp(const char* s1, const char* s2, size_t ln, size_t lm)
+{
+	return string_cmp(s1, s2, ln, lm);
+}
+
+// The bytewise order again, through a function
+static int _custom_cmp(void* state, const char* a, size_t la, const char* b, size_t lb)
+{
+	return _memcmp_cmp(a, b, la, lb);
+}
+
+// Inserts then looks up every key, in ns per key
+static long _time_skiplist(long count, char** keys, int length, const Comparator* comparator,
+                           double* insert, double* lookup)
+{
+	SkipList* list = skiplist_new(count, comparator);
+	long long start = _ustime();
+	long found = 0;
+
+	for (long i = 0; i < count; i++) {
+		// <varint key-length><key><varint value-length + 1>
+		char* data = malloc(length + 6);
+		char* p = encode_varint32(data, length);
+
+		memcpy(p, keys[i], length);
+		encode_varint32(p + length, 1);
+
+		skiplist_insert(list, p, length, ADD, data);
+	}
+
+	*insert = (double)(_ustime() - start) * 1000.0 / count;
+	start = _ustime();
+
+	for (long i = 0; i < count; i++)
+		found += skiplist_lookup(list, keys[(i * 31) % count], length) != NULL;
+
+	*lookup = (double)(_ustime() - start) * 1000.0 / count;
+
+	SkipNode* node = skiplist_first(list);
+
+	for (size_t i = 0; i < list->count; i++) {
+		free(node->data);
+		node = node->forward[0];
+	}
+	skiplist_free(list);
+	return found;
+}
+
+// With a baseline, the keys go through it first: the custom orders have no
+// prefix, so bench.bytewise compares the keys of the nodes as the skiplist
+// did before caching them, through the memcmp() comparison
+static void _bench_skiplist(long count, int length, int shared, const Comparator* comparator,
+                            const Comparator* baseline)
+{
+	char** keys = malloc(sizeof(char*) * count);
+	double insert, lookup;
+	long found;
+
+	for (long i = 0; i < count; i++) {
+		keys[i] = malloc(length);
+
+		if (shared) {
+			char digits[32];
+
+			snprintf(digits, sizeof(digits), "%08ld", (i * 7919) % count);
+			memset(keys[i], 'k', length);
+			memcpy(keys[i] + length - 8, digits, 8);
+		} else
+			_random_key(keys[i], length);
+	}
+
+	if (baseline) {
+		double before_insert = 1e9, before_lookup = 1e9;
+
+		insert = lookup = 1e9;
+
+		for (int r = 0; r < RUNS; r++) {
+			double i, l;
+
+			_time_skiplist(count, keys, length, baseline, &i, &l);
+			before_insert = _min(before_insert, i);
+			before_lookup = _min(before_lookup, l);
+
+			found = _time_skiplist(count, keys, length, comparator, &i, &l);
+			insert = _min(insert, i);
+			lookup = _min(lookup, l);
+		}
+
+		printf("skiplist %-21s %-8s %3d bytes: insert %7.1f ns -> %7.1f ns (x%.2f) "
+		       "lookup %7.1f ns -> %7.1f ns (x%.2f) (%ld found)\n",
+		       comparator->name, shared ? "shared" : "random", length,
+		       before_insert, insert, before_insert / insert,
+		       before_lookup, lookup, before_lookup / lookup, found);
+	} else {
+		found = _time_skiplist(count, keys, length, comparator, &insert, &lookup);
+
+		printf("skiplist %-21s %-8s %3d bytes: insert %7.1f ns lookup %7.1f ns (%ld found)\n",
+		       comparator->name, shared ? "shared" : "random", length, insert, lookup, found);
+	}
+
+	for (long i = 0; i < count; i++)
+		free(keys[i]);
+	free(keys);
+}
+
+int main(int argc, char** argv)
+{
+	static const int lengths[] = { 8, 16, 32, 100 };
+	long count = (argc > 1) ? atol(argv[1]) : 500000;
+	int sink = 0;
+
+	srand(42);
+
+	for (int shared = 0; shared <= 1; shared++) {
+		for (int i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+			if (shared && lengths[i] < 16)
+				continue;
+
+			_make_keys(lengths[i], shared);
+
+			double before = 1e9, after = 1e9;
+
+			for (int r = 0; r < RUNS; r++) {
+				before = _min(before, _bench_cmp(_memcmp_cmp, &sink));
+				after = _min(after, _bench_cmp(_string_cmp, &sink));
+			}
+
+			printf("string_cmp %-8s %3d bytes: memcmp %5.2f ns word %5.2f ns (x%.2f)\n",
+			       shared ? "shared" : "random", lengths[i], before, after, before / after);
+		}
+	}
+
+	Comparator* custom = comparator_new("bench.bytewise", _custom_cmp, NULL);
+	const Comparator* comparators[] = {
+		comparator_bytewise(), comparator_reverse_bytewise(), comparator_u64(), custom
+	};
+
+	_bench_skiplist(count, 16, 0, comparator_bytewise(), custom);
+	_bench_skiplist(count, 24, 1, comparator_bytewise(), custom);
+	_bench_skiplist(count, 100, 1, comparator_bytewise(), custom);
+
+	for (int i = 0; i < sizeof(comparators) / sizeof(comparators[0]); i++)
+		_bench_skiplist(count, 8, 0, comparators[i], NULL);
+
+	comparator_free(custom);
+
+	return sink == -1;
+}
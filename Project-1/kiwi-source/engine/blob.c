@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <string.h>
+#include "blob.h"
+#include "crc32.h"
+#include "utils.h"
+
+void blob_ref_encode(const BlobRef* self, Buffer* buffer)
+{
+    buffer_putvarint32(buffer, self->filenum);
+    buffer_putvarint64(buffer, self->offset);
+    buffer_putvarint32(buffer, self->size);
+}
+
+int blob_ref_decode(const Variant* ref, BlobRef* self)
+{
+    const char* p = ref->mem;
+    const char* limit = ref->mem + ref->length;
+
+    if (!(p = get_varint32(p, limit, &self->filenum)) ||
+        !(p = get_varint64(p, limit, &self->offset)) ||
+        !(p = get_varint32(p, limit, &self->size)))
+        return 0;
+
+    return 1;
+}
+
+void blob_file_name(char* filename, const char* basedir, uint32_t filenum)
+{
+    snprintf(filename, MAX_FILENAME, "%s/blob/%u.blob", basedir, filenum);
+}
+
+static BlobFile* _blob_file_new(File* file, uint32_t filenum)
+{
+    BlobFile* self = calloc(1, sizeof(BlobFile));
+
+    if (!self)
+        PANIC("NULL allocation");
+
+    self->filenum = filenum;
+    self->file = file;
+
+    if (!mmapped_file_new(file))
+    {
+        ERROR("Unable to mmap the blob file %s", file->filename);
+        blob_file_free(self);
+        return NULL;
+    }
+
+    return self;
+}
+
+BlobFile* blob_file_open(const char* basedir, uint32_t filenum)
+{
+    File* file = file_new();
+    blob_file_name(file->filename, basedir, filenum);
+
+    return _blob_file_new(file, filenum);
+}
+
+void blob_file_free(BlobFile* self)
+{
+    file_free(self->file);
+    free(self);
+}
+
+double blob_file_garbage_ratio(const BlobFile* self)
+{
+    if (self->total_bytes == 0)
+        return 1;
+
+    return (double)self->garbage_bytes / (double)self->total_bytes;
+}
+
+int blob_file_get(BlobFile* self, const BlobRef* ref, Variant* value)
+{
+    if (ref->offset + ref->size + sizeof(uint32_t) > (uint64_t)(self->file->limit - self->file->base))
+    {
+        ERROR("Reference past the end of the blob file %s", self->file->filename);
+        return 0;
+    }
+
+    const char* start = self->file->base + ref->offset;
+
+#ifdef PARANOID_CHECK
+    uint32_t blob_crc32 = get_int32(start + ref->size);
+    uint32_t actual_crc32 = crc32_extend(0, start, ref->size);
+
+    if (actual_crc32 != blob_crc32)
+    {
+        ERROR("Blob seems to be corrupted. Data CRC: %X Blob CRC: %X",
+              actual_crc32, blob_crc32);
+        return 0;
+    }
+#endif
+
+    value->mem = (char*)start;
+    value->length = ref->size;
+
+    return 1;
+}
+
+int blob_file_read(BlobFile* self, const BlobRef* ref, Variant* value)
+{
+    Variant blob;
+
+    if (!blob_file_get(self, ref, &blob))
+        return 0;
+
+    buffer_clear(value);
+    buffer_putnstr(value, blob.mem, blob.length);
+
+    return 1;
+}
+
+BlobWriter* blob_writer_new(const char* basedir, uint32_t filenum, int direct)
+{
+    BlobWriter* self = calloc(1, sizeof(BlobWriter));
+
+    if (!self)
+        PANIC("NULL allocation");
+
+    strncpy(self->basedir, basedir, MAX_FILENAME - 1);
+    self->filenum = filenum;
+    self->direct = direct;
+    self->record = buffer_new(64);
+
+    return self;
+}
+
+int blob_writer_add(BlobWriter* self, const Variant* key, const Variant* value, Buffer* ref)
+{
+    if (!self->file)
+    {
+        char dirname[MAX_FILENAME];
+        snprintf(dirname, MAX_FILENAME, "%s/blob", self->basedir);
+        mkdirp(dirname);
+
+        self->file = file_new();
+        blob_file_name(self->file->filename, self->basedir, self->filenum);
+
+        if (!(self->direct ? direct_file_new(self->file, 0) : writable_file_new(self->file)))
+        {
+            ERROR("Unable to open blob file %s for writing", self->file->filename);
+            file_free(self->file);
+            self->file = NULL;
+            return 0;
+        }
+    }
+
+    buffer_clear(self->record);
+    buffer_putvarint32(self->record, key->length);
+    buffer_putnstr(self->record, key->mem, key->length);
+    buffer_putvarint32(self->record, value->length);
+
+    BlobRef blob;
+    blob.filenum = self->filenum;
+    blob.offset = self->offset + self->record->length;
+    blob.size = value->length;
+
+    buffer_putnstr(self->record, value->mem, value->length);
+    buffer_putint32(self->record, crc32_extend(0, value->mem, value->length));
+
+    if (!file_append(self->file, self->record))
+        return 0;
+
+    blob_ref_encode(&blob, ref);
+    self->offset += self->record->length;
+    self->total_bytes += value->length;
+
+    return 1;
+}
+
+BlobFile* blob_writer_finish(BlobWriter* self)
+{
+    BlobFile* blob = NULL;
+
+    if (self->file)
+    {
+        file_close(self->file);
+
+        if ((blob = _blob_file_new(self->file, self->filenum)))
+            blob->total_bytes = self->total_bytes;
+    }
+
+    buffer_free(self->record);
+    free(self);
+
+    return blob;
+}
@@ -0,0 +1,80 @@
+#ifndef __BLOB_H__
+#define __BLOB_H__
+
+#include <stdint.h>
+#include "file.h"
+#include "variant.h"
+
+/*
+ * Blob files keep the large values out of the sst files, which only store
+ * a reference to them (entries of kind BLOB): compactions move the small
+ * references around instead of rewriting the values every time. A blob
+ * file is written along with every sst file built, holding its values of
+ * at least min_blob_size bytes as records of
+ *   <varint key-length><key><varint value-length><value><crc32 of value>
+ * and a reference
+ *   <varint filenum><varint64 offset><varint size>
+ * points at the value of its record. The blob files live in
+ *   $basedir/si/blob/<filenum>.blob
+ *
+ * The bytes of the references a compaction drops are garbage of their blob
+ * file, which is deleted as soon as all of its bytes are garbage.
+ * Compactions also move the live values out of the files with more than
+ * blob_gc_threshold of garbage, so these eventually go away too.
+ */
+
+typedef struct _blob_ref {
+    uint32_t filenum;
+    uint64_t offset;
+    uint32_t size;
+} BlobRef;
+
+void blob_ref_encode(const BlobRef* self, Buffer* buffer);
+int blob_ref_decode(const Variant* ref, BlobRef* self);
+
+typedef struct _blob_file {
+    uint32_t filenum;
+    uint64_t total_bytes;   // of all the values written
+    uint64_t garbage_bytes; // of the values no longer referenced
+
+    File* file; // mapped for reading
+
+    // Values handed out by sst_get_pinned(): a deleted file stays mapped
+    // until the last of them is released
+    uint32_t pins;
+    unsigned deleted:1;
+    unsigned dirty:1; // see SST.dirty_blobs
+} BlobFile;
+
+BlobFile* blob_file_open(const char* basedir, uint32_t filenum);
+void blob_file_free(BlobFile* self);
+void blob_file_name(char* filename, const char* basedir, uint32_t filenum);
+double blob_file_garbage_ratio(const BlobFile* self);
+
+// Points value at the value ref refers to, inside the mapping
+int blob_file_get(BlobFile* self, const BlobRef* ref, Variant* value);
+
+// Copies the value ref points at into value
+int blob_file_read(BlobFile* self, const BlobRef* ref, Variant* value);
+
+typedef struct _blob_writer {
+    char basedir[MAX_FILENAME];
+    uint32_t filenum;
+    uint64_t offset;
+    uint64_t total_bytes;
+    unsigned direct:1; // see direct_file_new()
+
+    File* file; // created along with the first record
+    Buffer* record;
+} BlobWriter;
+
+BlobWriter* blob_writer_new(const char* basedir, uint32_t filenum, int direct);
+
+// Writes the value and puts its reference into ref
+int blob_writer_add(BlobWriter* self, const Variant* key, const Variant* value, Buffer* ref);
+
+// Closes the file and frees the writer. Returns the blob file ready to be
+// read, or NULL if nothing has been written.
+BlobFile* blob_writer_finish(BlobWriter* self);
+
+#endif
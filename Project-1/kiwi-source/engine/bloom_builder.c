@@ -1,15 +1,16 @@
 #include <assert.h>
+#include <string.h>
 #include <inttypes.h>
 #include "bloom_builder.h"
 #include "hash.h"
 #include "utils.h"
 #include "indexer.h"
 
-static void _update(BloomBuilder* self, SSTBlockBuilder* block)
+static void _update(size_t bits_per_key, SSTBlockBuilder* block, Buffer* out)
 {
     // Let's create our dynamic length bloom filter. According to wikipedia
     // 9.6 bits per key are a reasonable amount of bits
-    size_t bits = block->entries * self->bits_per_key;
+    size_t bits = block->entries * bits_per_key;
 
     if (bits < 64) bits = 64;
 
@@ -17,11 +18,12 @@ static void _update(BloomBuilder* self, SSTBlockBuilder* block)
     bits = bytes * 8;
 
     Buffer* key = buffer_new(1);
-    buffer_extend_by(self->buff, bytes);
+    buffer_extend_by(out, bytes);
 //    DEBUG("%d bytes for %d entries allocated for the bloom filter", bytes, block->entries);
 
-    char* array = self->buff->mem + self->buff->length;
-    self->buff->length += bytes;
+    char* array = out->mem + out->length;
+    memset(array, 0, bytes);
+    out->length += bytes;
 
     char* start = block->buffer->mem;
 
@@ -31,6 +33,7 @@ static void _update(BloomBuilder* self, SSTBlockBuilder* block)
         start = (char *)get_varint32(start, start + 5, &plen);
         start = (char *)get_varint32(start, start + 5, &klen);
         start = (char *)get_varint32(start, start + 5, &vlen);
+        vlen &= ~VALUE_BLOB_BIT;
 
         key->length = plen;
         buffer_putnstr(key, start, klen);
@@ -82,10 +85,22 @@ void bloom_builder_generate(BloomBuilder* self, uint64_t start_off, SSTBlockBuil
 
     uint32_t start = self->buff->length;
     kv_push(uint32_t, self->offsets, start);
-    _update(self, data);
+    _update(self->bits_per_key, data, self->buff);
 //    DEBUG("Filter block %d is %d bytes", index, self->buff->length - start);
 }
 
+void bloom_builder_create_filter(size_t bits_per_key, SSTBlockBuilder* data, Buffer* out)
+{
+    buffer_clear(out);
+    _update(bits_per_key, data, out);
+}
+
+void bloom_builder_add_filter(BloomBuilder* self, Buffer* filter)
+{
+    kv_push(uint32_t, self->offsets, self->buff->length);
+    buffer_putnstr(self->buff, filter->mem, filter->length);
+}
+
 void bloom_builder_finish(BloomBuilder* self)
 {
     for (int i = 0; i < kv_size(self->offsets); i++)
@@ -17,6 +17,11 @@ BloomBuilder* bloom_builder_new(size_t bits_per_key);
 void bloom_builder_free(BloomBuilder* self);
 
 void bloom_builder_generate(BloomBuilder* self, uint64_t start_off, SSTBlockBuilder* data);
+
+// The same in two steps, so the filter of a block can be computed by a
+// thread other than the one assembling the file
+void bloom_builder_create_filter(size_t bits_per_key, SSTBlockBuilder* data, Buffer* out);
+void bloom_builder_add_filter(BloomBuilder* self, Buffer* filter);
 void bloom_builder_finish(BloomBuilder* self);
 
 #endif
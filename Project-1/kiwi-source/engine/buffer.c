@@ -146,6 +146,13 @@ void buffer_putshort(Buffer* self, short val)
     self->mem[self->length++] = (val >> 8) & 0xff;
 }
 
+void buffer_putuint16(Buffer* self, uint16_t val)
+{
+    buffer_extend_by(self, sizeof(uint16_t));
+    self->mem[self->length++] = val & 0xff;
+    self->mem[self->length++] = (val >> 8) & 0xff;
+}
+
 void buffer_putlong(Buffer* self, uint64_t val)
 {
     buffer_extend_by(self, sizeof(uint64_t));
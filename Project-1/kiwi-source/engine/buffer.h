@@ -29,6 +29,7 @@ void buffer_putvarint64(Buffer* self, uint64_t v);
 void buffer_scatf(Buffer* self, const char *fmt, ...);
 void buffer_putlong(Buffer* self, uint64_t val);
 void buffer_putshort(Buffer* self, short val);
+void buffer_putuint16(Buffer* self, uint16_t val);
 
 void buffer_dump(Buffer* self);
 
@@ -0,0 +1,235 @@
+#include <string.h>
+#include "codec.h"
+#include "indexer.h"
+#include "utils.h"
+
+#ifdef WITH_SNAPPY
+#include <snappy-c.h>
+#endif
+
+#ifdef WITH_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#ifdef WITH_SNAPPY
+static int _snappy_compress(const char* in, size_t length, Buffer* out, const CodecDict* dict)
+{
+    size_t output_length = snappy_max_compressed_length(length);
+
+    buffer_clear(out);
+    buffer_extend_by(out, output_length);
+
+    if (snappy_compress(in, length, out->mem, &output_length) != SNAPPY_OK)
+        return 0;
+
+    out->length = output_length;
+    return 1;
+}
+
+static int _snappy_uncompress(const char* in, size_t length, char** out, size_t* out_length, const CodecDict* dict)
+{
+    if (snappy_uncompressed_length(in, length, out_length) != SNAPPY_OK)
+        return 0;
+
+    *out = (char*)malloc(*out_length);
+
+    if (snappy_uncompress(in, length, *out, out_length) != SNAPPY_OK)
+    {
+        free(*out);
+        return 0;
+    }
+
+    return 1;
+}
+#endif
+
+#ifdef WITH_LZ4
+// The lz4 block format does not know the size of the original data, so
+// it is prepended as a varint32
+static int _lz4_compress(const char* in, size_t length, Buffer* out, const CodecDict* dict)
+{
+    int bound = LZ4_compressBound((int)length);
+
+    buffer_clear(out);
+    buffer_putvarint32(out, (uint32_t)length);
+    buffer_extend_by(out, bound);
+
+    int written = LZ4_compress_default(in, out->mem + out->length, (int)length, bound);
+
+    if (written <= 0)
+        return 0;
+
+    out->length += written;
+    return 1;
+}
+
+static int _lz4_uncompress(const char* in, size_t length, char** out, size_t* out_length, const CodecDict* dict)
+{
+    uint32_t raw_length;
+    const char* start = get_varint32(in, in + length, &raw_length);
+
+    if (!start)
+        return 0;
+
+    *out = (char*)malloc(raw_length);
+
+    if (LZ4_decompress_safe(start, *out, (int)(in + length - start), (int)raw_length) != (int)raw_length)
+    {
+        free(*out);
+        return 0;
+    }
+
+    *out_length = raw_length;
+    return 1;
+}
+#endif
+
+#ifdef WITH_ZSTD
+static int _zstd_compress(const char* in, size_t length, Buffer* out, const CodecDict* dict)
+{
+    size_t bound = ZSTD_compressBound(length);
+    size_t written;
+
+    buffer_clear(out);
+    buffer_extend_by(out, bound);
+
+    if (dict && dict->cdict)
+    {
+        // Contexts are cheap compared to the block and the builder may
+        // compress on several threads at once
+        ZSTD_CCtx* ctx = ZSTD_createCCtx();
+        written = ZSTD_compress_usingCDict(ctx, out->mem, bound, in, length, (const ZSTD_CDict*)dict->cdict);
+        ZSTD_freeCCtx(ctx);
+    }
+    else
+        written = ZSTD_compress(out->mem, bound, in, length, ZSTD_LEVEL);
+
+    if (ZSTD_isError(written))
+        return 0;
+
+    out->length = written;
+    return 1;
+}
+
+static int _zstd_uncompress(const char* in, size_t length, char** out, size_t* out_length, const CodecDict* dict)
+{
+    unsigned long long raw_length = ZSTD_getFrameContentSize(in, length);
+    size_t read;
+
+    if (raw_length == ZSTD_CONTENTSIZE_ERROR || raw_length == ZSTD_CONTENTSIZE_UNKNOWN)
+        return 0;
+
+    *out = (char*)malloc(raw_length);
+
+    if (dict && dict->ddict)
+    {
+        ZSTD_DCtx* ctx = ZSTD_createDCtx();
+        read = ZSTD_decompress_usingDDict(ctx, *out, raw_length, in, length, (const ZSTD_DDict*)dict->ddict);
+        ZSTD_freeDCtx(ctx);
+    }
+    else
+        read = ZSTD_decompress(*out, raw_length, in, length);
+
+    if (ZSTD_isError(read) || read != raw_length)
+    {
+        free(*out);
+        return 0;
+    }
+
+    *out_length = read;
+    return 1;
+}
+#endif
+
+static const Codec _codecs[NUM_BLOCK_TYPES] = {
+    { "none", TYPE_NO_COMPRESSION, NULL, NULL },
+#ifdef WITH_SNAPPY
+    { "snappy", TYPE_SNAPPY_COMPRESSION, _snappy_compress, _snappy_uncompress },
+#else
+    { "snappy", TYPE_SNAPPY_COMPRESSION, NULL, NULL },
+#endif
+#ifdef WITH_LZ4
+    { "lz4", TYPE_LZ4_COMPRESSION, _lz4_compress, _lz4_uncompress },
+#else
+    { "lz4", TYPE_LZ4_COMPRESSION, NULL, NULL },
+#endif
+#ifdef WITH_ZSTD
+    { "zstd", TYPE_ZSTD_COMPRESSION, _zstd_compress, _zstd_uncompress },
+#else
+    { "zstd", TYPE_ZSTD_COMPRESSION, NULL, NULL },
+#endif
+};
+
+const Codec* codec_get(uint32_t type)
+{
+    if (type >= NUM_BLOCK_TYPES)
+        return NULL;
+
+    // The uncompressed type is handled by the callers
+    if (type != TYPE_NO_COMPRESSION && !_codecs[type].compress)
+        return NULL;
+
+    return &_codecs[type];
+}
+
+const char* codec_name(uint32_t type)
+{
+    return (type < NUM_BLOCK_TYPES) ? _codecs[type].name : "unknown";
+}
+
+CodecDict* codec_dict_new(const char* mem, size_t length)
+{
+    CodecDict* self = calloc(1, sizeof(CodecDict));
+
+    if (!self)
+        PANIC("NULL allocation");
+
+    self->raw = buffer_new(length);
+    buffer_putnstr(self->raw, mem, length);
+
+#ifdef WITH_ZSTD
+    self->cdict = ZSTD_createCDict(self->raw->mem, self->raw->length, ZSTD_LEVEL);
+    self->ddict = ZSTD_createDDict(self->raw->mem, self->raw->length);
+#endif
+
+    return self;
+}
+
+CodecDict* codec_dict_train(const char* samples, const size_t* sample_sizes, uint32_t num_samples, size_t max_size)
+{
+#ifdef WITH_ZSTD
+    Buffer* dict = buffer_new(max_size);
+    size_t size = ZDICT_trainFromBuffer(dict->mem, max_size, samples, sample_sizes, num_samples);
+
+    if (ZDICT_isError(size))
+    {
+        // Usually too few samples, the file is just compressed without it
+        DEBUG("Unable to train a dictionary: %s", ZDICT_getErrorName(size));
+        buffer_free(dict);
+        return NULL;
+    }
+
+    CodecDict* self = codec_dict_new(dict->mem, size);
+    buffer_free(dict);
+
+    return self;
+#else
+    return NULL;
+#endif
+}
+
+void codec_dict_free(CodecDict* self)
+{
+#ifdef WITH_ZSTD
+    ZSTD_freeCDict((ZSTD_CDict*)self->cdict);
+    ZSTD_freeDDict((ZSTD_DDict*)self->ddict);
+#endif
+
+    buffer_free(self->raw);
+    free(self);
+}
@@ -0,0 +1,42 @@
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "buffer.h"
+
+/*
+ * Registry of the block compression codecs, indexed by the block type
+ * stored in the trailer of every block (see indexer.h). A file may be
+ * written with a different codec per level while its blocks are always
+ * decoded through the type they carry.
+ *
+ * Zstd can also use a dictionary: it is trained by the builder on the first
+ * blocks of the file and stored in its meta block.
+ */
+
+typedef struct _codec_dict {
+    Buffer* raw;
+    void* cdict; // ZSTD_CDict*
+    void* ddict; // ZSTD_DDict*
+} CodecDict;
+
+typedef struct _codec {
+    const char* name;
+    uint32_t type;
+
+    // Both return 1 on success. The output of compress replaces the content
+    // of out, uncompress returns a malloc'ed buffer in *out.
+    int (*compress)(const char* in, size_t length, Buffer* out, const CodecDict* dict);
+    int (*uncompress)(const char* in, size_t length, char** out, size_t* out_length, const CodecDict* dict);
+} Codec;
+
+// NULL when the type is unknown or the codec has not been compiled in
+const Codec* codec_get(uint32_t type);
+const char* codec_name(uint32_t type);
+
+CodecDict* codec_dict_new(const char* mem, size_t length);
+CodecDict* codec_dict_train(const char* samples, const size_t* sample_sizes, uint32_t num_samples, size_t max_size);
+void codec_dict_free(CodecDict* self);
+
+#endif
@@ -1,36 +1,189 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include "compaction.h"
 #include "utils.h"
+#include "range_del.h"
+#include "ttl.h"
 
 void compaction_free(Compaction* self)
 {
     vector_free(self->outputs);
+    vector_free(self->range_dels);
+    if (self->filter_value) buffer_free(self->filter_value);
+
+    for (uint32_t i = 0; i < vector_count(self->blob_garbage); i++)
+        free(vector_get(self->blob_garbage, i));
+
+    vector_free(self->blob_outputs);
+    vector_free(self->blob_garbage);
+    if (self->blob_value) buffer_free(self->blob_value);
+
     file_range_free(self->current_range);
     if (self->parent_range) file_range_free(self->parent_range);
     if (self->grandparent_range) file_range_free(self->grandparent_range);
     free(self);
 }
 
-Compaction* compaction_new(SST *sst, int level)
+static uint64_t _grandparent_overlap(Compaction* self, SSTMetadata* meta)
 {
-    if (!(level + 1 < MAX_LEVELS))
-        return NULL;
+    uint64_t size = 0;
 
-    Compaction* self = calloc(1, sizeof(Compaction));
+    if (self->level + 2 >= MAX_LEVELS)
+        return 0;
 
-    FileRange* current;
-    FileRange* parents;
-    FileRange* missing = NULL;
+    for (uint32_t i = 0; i < self->sst->num_files[self->level + 2]; i++)
+    {
+        SSTMetadata* target = self->sst->files[self->level + 2][i];
 
-    Variant* smallest;
-    Variant* largest;
+        if (range_intersects(self->sst->options.comparator, meta->smallest_key, target->smallest_key,
+                             meta->largest_key, target->largest_key))
+            size += target->filesize;
+    }
+
+    return size;
+}
+
+static int _cmp_by_smallest_key(const SSTMetadata** a, const SSTMetadata** b, const Comparator* comparator)
+{
+    return comparator_variant_cmp(comparator, (*a)->smallest_key, (*b)->smallest_key);
+}
+
+static int _cmp_by_begin(const RangeTombstone** a, const RangeTombstone** b, const Comparator* comparator)
+{
+    return comparator_variant_cmp(comparator, (*a)->begin, (*b)->begin);
+}
+
+static void _compaction_collect_range_dels(Compaction* self, FileRange* range)
+{
+    for (uint32_t i = 0; i < vector_count(range->files); i++)
+    {
+        Vector* tombstones = ((SSTMetadata*)vector_get(range->files, i))->loader->range_dels;
+
+        for (uint32_t j = 0; j < vector_count(tombstones); j++)
+            vector_add(self->range_dels, vector_get(tombstones, j));
+    }
+}
+
+// Checks if some values of the file have expired: it has to be compacted
+// for them to be dropped
+static int _compaction_has_expired(Compaction* self, SSTMetadata* meta)
+{
+    return (meta->loader->min_expiration != TTL_NEVER &&
+            meta->loader->min_expiration <= self->now);
+}
+
+// Called when the inputs do not overlap anything in level + 1. Checks if the
+// inputs can just be renamed into the next level, and if so extends them with
+// the following files of the same level that can be moved as well, so that a
+// sequential load is pushed down with a single manifest update.
+static int _compaction_collect_moves(Compaction* self)
+{
+    SST* sst = self->sst;
+    const Comparator* comparator = sst->options.comparator;
+    FileRange* current = self->current_range;
+    uint32_t count = vector_count(current->files);
+    SSTMetadata** files = (SSTMetadata**)vector_data(current->files);
+
+    // The values of a moved file would skip the compaction filter
+    if (sst->options.compaction_filter)
+        return 0;
+
+    // Files coming from level 0 can be moved together only if they are
+    // disjoint, since the next level must not contain overlapping ranges.
+    qsort_r(files, count, sizeof(SSTMetadata*),
+            (int (*)(const void *, const void *, void *))_cmp_by_smallest_key, (void*)comparator);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (i > 0 && comparator_variant_cmp(comparator, files[i - 1]->largest_key, files[i]->smallest_key) >= 0)
+            return 0;
+
+        if (_grandparent_overlap(self, files[i]) > GRANDPARENT_OVERLAP)
+            return 0;
+
+        // Tombstones reaching the last level would never be dropped
+        if (self->level + 2 >= MAX_LEVELS &&
+            (files[i]->loader->num_deletions > 0 || files[i]->loader->num_range_dels > 0))
+            return 0;
+
+        if (_compaction_has_expired(self, files[i]))
+            return 0;
+    }
+
+    if (self->level == 0)
+        return 1;
+
+    uint32_t pos = sst_find_file(sst, self->level, files[count - 1]->largest_key) + 1;
+
+    while (pos < sst->num_files[self->level])
+    {
+        SSTMetadata* next = sst->files[self->level][pos];
+
+        if (sst_get_overlapping_inputs(sst, self->level + 1,
+                                       next->smallest_key, next->largest_key,
+                                       NULL, NULL, NULL) > 0 ||
+            _grandparent_overlap(self, next) > GRANDPARENT_OVERLAP ||
+            _compaction_has_expired(self, next))
+            break;
+
+        vector_add(current->files, next);
+        current->largest_key = next->largest_key;
+        pos++;
+    }
+
+    return 1;
+}
+
+static Compaction* _compaction_alloc(SST* sst, int level, int output_level)
+{
+    Compaction* self = calloc(1, sizeof(Compaction));
+
+    if (!self)
+        PANIC("NULL allocation");
 
     self->sst = sst;
     self->level = level;
+    self->output_level = output_level;
     self->outputs = vector_new();
+    self->range_dels = vector_new();
+    self->blob_outputs = vector_new();
+    self->blob_garbage = vector_new();
 
     self->overlap_bytes = 0;
     self->overlap_index = 0;
+    self->now = (uint32_t)get_ustime_sec();
+
+    return self;
+}
+
+// Gathers the tombstones of the inputs and the scratch space of the filter,
+// once the compaction is known not to be a move
+static void _compaction_prepare(Compaction* self)
+{
+    _compaction_collect_range_dels(self, self->current_range);
+    _compaction_collect_range_dels(self, self->parent_range);
+
+    qsort_r(vector_data(self->range_dels), vector_count(self->range_dels), sizeof(RangeTombstone*),
+            (int (*)(const void *, const void *, void *))_cmp_by_begin, (void*)self->sst->options.comparator);
+
+    self->filter_value = buffer_new(1024);
+    self->blob_value = buffer_new(1024);
+}
+
+Compaction* compaction_new(SST *sst, int level, SSTMetadata* seed)
+{
+    if (!(level + 1 < MAX_LEVELS))
+        return NULL;
+
+    Compaction* self = _compaction_alloc(sst, level, level + 1);
+
+    FileRange* current;
+    FileRange* parents;
+    FileRange* missing = NULL;
+
+    Variant* smallest;
+    Variant* largest;
+    const Comparator* comparator = sst->options.comparator;
 
     current = self->current_range = file_range_new(level);
     parents = self->parent_range = file_range_new(level + 1);
@@ -38,7 +191,9 @@ Compaction* compaction_new(SST *sst, int level)
 
     current = self->current_range;
 
-    SSTMetadata* meta = *self->sst->files[level];
+    // Compactions triggered by a specific file (e.g. too many tombstones)
+    // start from it, the others just take the first file of the level
+    SSTMetadata* meta = seed ? seed : *self->sst->files[level];
 
     smallest = current->smallest_key = meta->smallest_key;
     largest = current->largest_key = meta->largest_key;
@@ -74,12 +229,12 @@ Compaction* compaction_new(SST *sst, int level)
 
         missing = file_range_new(level);
 
-        if (variant_cmp(current->smallest_key, parents->smallest_key) < 0)
+        if (comparator_variant_cmp(comparator, current->smallest_key, parents->smallest_key) < 0)
             smallest = missing->smallest_key = current->smallest_key;
         else
             smallest = missing->smallest_key = parents->smallest_key;
 
-        if (variant_cmp(current->largest_key, parents->largest_key) > 0)
+        if (comparator_variant_cmp(comparator, current->largest_key, parents->largest_key) > 0)
             largest = missing->largest_key = current->largest_key;
         else
             largest = missing->largest_key = parents->largest_key;
@@ -123,110 +278,106 @@ Compaction* compaction_new(SST *sst, int level)
         }
     }
 
+    // The expansion was not worth it: keep the original inputs since the
+    // parents have been selected for them only.
     if (missing)
+        file_range_free(missing);
+
+    current = self->current_range;
+
+    if (vector_count(parents->files) > 0)
     {
-        file_range_free(self->current_range);
-        self->current_range = missing;
-        missing = NULL;
+        smallest = (comparator_variant_cmp(comparator, current->smallest_key, parents->smallest_key) < 0) ?
+                   current->smallest_key : parents->smallest_key;
+        largest = (comparator_variant_cmp(comparator, current->largest_key, parents->largest_key) > 0) ?
+                  current->largest_key : parents->largest_key;
+    }
+    else
+    {
+        smallest = current->smallest_key;
+        largest = current->largest_key;
     }
 
     if (level + 2 < MAX_LEVELS)
     {
-        sst_get_overlapping_inputs(self->sst, level + 1,
+        // The grandparents are used to cut the output files so that none of
+        // them will overlap too many files when compacted in its turn.
+        sst_get_overlapping_inputs(self->sst, level + 2,
                                    smallest, largest,
                                    self->grandparent_range->files,
                                    &self->grandparent_range->smallest_key,
                                    &self->grandparent_range->largest_key);
-
-        // After finding the overlapping parents we also want to find the first
-        // culprit that overlaps with the first grandparent. Mark it in order
-        // to speed up various checks during the merge.
-
-        int curr_found = 0, par_found = 0;
-        for (uint32_t i = 0; i < vector_count(self->grandparent_range->files); i++)
-        {
-            SSTMetadata* b = *((SSTMetadata **)vector_data(self->grandparent_range->files) + i);
-
-            for (uint32_t j = 0; j < vector_count(self->current_range->files) && !curr_found; j++)
-            {
-                SSTMetadata* a = *((SSTMetadata **)vector_data(self->current_range->files) + j);
-
-                if (range_intersects(a->smallest_key, b->smallest_key, a->largest_key, b->largest_key))
-                {
-                    self->current_range->overlaps_from = j;
-                    curr_found = 1;
-                    break;
-                }
-            }
-
-            for (uint32_t j = 0; i < vector_count(self->parent_range->files) && !par_found; j++)
-            {
-                SSTMetadata* a = *((SSTMetadata **)vector_data(self->parent_range->files) + j);
-
-                if (range_intersects(a->smallest_key, b->smallest_key, a->largest_key, b->largest_key))
-                {
-                    self->parent_range->overlaps_from = j;
-                    par_found = 1;
-                    break;
-                }
-            }
-
-            if (curr_found && par_found)
-                break;
-        }
     }
 
     file_range_debug(self->current_range, "final current");
     file_range_debug(self->parent_range, "final parent");
 
-    if (vector_count(self->current_range->files) == 1 &&
-        vector_count(self->parent_range->files) == 0 &&
-        file_range_size(self->grandparent_range) <= GRANDPARENT_OVERLAP)
+    if (vector_count(parents->files) == 0 && _compaction_collect_moves(self))
     {
-//#ifdef BACKGROUND_MERGE
-//        pthread_mutex_lock(&self->sst->lock);
-//#endif
+        INFO("Moving %d files (%" PRIu64 " bytes) from level %d to level %d",
+             vector_count(current->files), file_range_size(current),
+             level, level + 1);
 
-        SSTMetadata* old_meta = (SSTMetadata*)vector_get(self->current_range->files, 0);
+#ifdef BACKGROUND_MERGE
+        pthread_mutex_lock(&self->sst->lock);
+#endif
 
-        uint32_t new_level = old_meta->level + 1, new_filenum = old_meta->filenum;
+        sst_file_move(self->sst, level,
+                      vector_count(current->files),
+                      (SSTMetadata**)vector_data(current->files));
 
-        File* file = sst_filename_new(self->sst, new_level, new_filenum);
+#ifdef BACKGROUND_MERGE
+        pthread_mutex_unlock(&self->sst->lock);
+#endif
 
-        INFO("Moving %s to %s", old_meta->loader->file->filename, file->filename);
+        compaction_free(self);
+        return NULL;
+    }
 
-        rename(old_meta->loader->file->filename, file->filename);
+    _compaction_prepare(self);
 
-        SSTMetadata* new_meta = sst_metadata_new(new_level, new_filenum);
+    INFO("Compacting %d+%d files (%" PRIu64 "+%" PRIu64 " bytes) in output level %d",
+         vector_count(self->current_range->files),
+         vector_count(self->parent_range->files),
+         file_range_size(self->current_range),
+         file_range_size(self->parent_range), level + 1);
 
-        Buffer* a = new_meta->smallest_key;
-        Buffer* b = new_meta->largest_key;
+    return self;
+}
 
-        new_meta->smallest_key = old_meta->smallest_key;
-        new_meta->largest_key = old_meta->largest_key;
-        old_meta->smallest_key = a;
-        old_meta->largest_key = b;
+Compaction* compaction_new_in_place(SST* sst, SSTMetadata* meta)
+{
+    // The outputs of a level 0 file would be newer than the files it
+    // is older than
+    if (meta->level == 0)
+        return NULL;
 
-        sst_file_delete(self->sst, old_meta->level, 1, (SSTMetadata**)vector_data(self->current_range->files));
+    int level = meta->level;
+    Compaction* self = _compaction_alloc(sst, level, level);
 
-        new_meta->loader = sst_loader_new(self->sst->cache, file, new_level, new_filenum);
-        new_meta->filesize = file_size(file);
+    self->current_range = file_range_new(level);
+    self->current_range->smallest_key = meta->smallest_key;
+    self->current_range->largest_key = meta->largest_key;
+    vector_add(self->current_range->files, meta);
 
-        sst_file_add(self->sst, new_meta);
+    self->parent_range = file_range_new(level);
 
-//#ifdef BACKGROUND_MERGE
-//        pthread_mutex_unlock(&self->sst->lock);
-//#endif
+    // The outputs are cut along the files of the next level, if any
+    if (level + 1 < MAX_LEVELS)
+    {
+        self->grandparent_range = file_range_new(level + 1);
 
-        compaction_free(self);
-        return NULL;
+        sst_get_overlapping_inputs(sst, level + 1,
+                                   meta->smallest_key, meta->largest_key,
+                                   self->grandparent_range->files,
+                                   &self->grandparent_range->smallest_key,
+                                   &self->grandparent_range->largest_key);
     }
 
-    INFO("Compacting %d+%d files (%" PRIu64 "+%" PRIu64 " bytes) in output level %d",
-         vector_count(self->current_range->files),
-         vector_count(self->parent_range->files),
-         file_range_size(self->current_range),
-         file_range_size(self->parent_range), level + 1);
+    _compaction_prepare(self);
+
+    INFO("Rewriting file %d (%" PRIu64 " bytes) in level %d",
+         meta->filenum, meta->filesize, level);
 
     return self;
 }
@@ -235,13 +386,29 @@ static void _compaction_close_pending(Compaction* self)
 {
     if (self->file)
     {
+        // Tombstones may reach past the last key of the file
+        if (self->range_del_end &&
+            comparator_variant_cmp(self->sst->options.comparator, self->range_del_end, self->meta->largest_key) > 0)
+        {
+            buffer_clear(self->meta->largest_key);
+            buffer_putnstr(self->meta->largest_key, self->range_del_end->mem,
+                           self->range_del_end->length);
+        }
+
+        BlobWriter* blob = self->builder->blob;
+        BlobFile* blob_file;
+
         sst_builder_free(self->builder);
         file_close(self->file);
 
+        if (blob && (blob_file = blob_writer_finish(blob)))
+            vector_add(self->blob_outputs, blob_file);
+
         // Now we need to create an sst loader and insert it in the right place
         // and we just reuse the file object we have
         self->meta->filesize = file_size(self->file);
-        self->meta->loader = sst_loader_new(self->sst->cache, self->file, self->meta->level, self->meta->filenum);
+        self->meta->loader = sst_loader_new(self->sst->cache, self->sst->options.comparator, self->file,
+                                           self->meta->level, self->meta->filenum, self->sst->options.pread_reads);
 
         vector_add(self->outputs, (void**)self->meta);
 
@@ -254,21 +421,50 @@ static void _compaction_close_pending(Compaction* self)
 int compaction_new_output_file(Compaction* self)
 {
     _compaction_close_pending(self);
-    return sst_file_new(self->sst, self->level + 1, &self->file, &self->builder, &self->meta);
+    self->range_del_end = NULL;
+    return sst_file_new(self->sst, self->output_level, TARGET_FILE_SIZE, &self->file, &self->builder, &self->meta);
 }
 
 int compaction_exceeds_overlap(Compaction* self, Variant* key)
 {
-    SSTMetadata** files = (SSTMetadata**)vector_data(self->parent_range->files);
+    const Comparator* comparator = self->sst->options.comparator;
+    int crossed = 0;
+    uint32_t count = 0;
+    SSTMetadata** files = NULL;
 
-    while (self->overlap_index < vector_count(self->parent_range->files) &&
-           variant_cmp(key, (*(files + self->overlap_index))->largest_key) > 0)
+    if (self->grandparent_range)
     {
-        self->overlap_bytes += (*(files + self->overlap_index))->filesize;
+        files = (SSTMetadata**)vector_data(self->grandparent_range->files);
+        count = vector_count(self->grandparent_range->files);
+    }
+
+    // Skip the grandparents lying entirely before the key. Each boundary we
+    // cross is a point where the output can be cut without having two output
+    // files sharing the same grandparent.
+    while (self->overlap_index < count &&
+           comparator_variant_cmp(comparator, key, files[self->overlap_index]->largest_key) > 0)
+    {
+        if (self->seen_key)
+            self->overlap_bytes += files[self->overlap_index]->filesize;
+
         self->overlap_index++;
+        crossed = 1;
     }
 
-    if (self->overlap_bytes > GRANDPARENT_OVERLAP)
+    self->seen_key = 1;
+
+    if (!self->builder)
+        return 0;
+
+    // Never split a range tombstone between two files: their ranges would
+    // overlap
+    if (self->range_del_end && comparator_variant_cmp(comparator, self->range_del_end, key) >= 0)
+        return 0;
+
+    if (self->overlap_bytes > GRANDPARENT_OVERLAP ||
+        (self->builder->offset >= TARGET_FILE_SIZE &&
+         (crossed || self->overlap_index >= count)) ||
+        self->builder->offset >= 2 * TARGET_FILE_SIZE)
     {
         self->overlap_bytes = 0;
         return 1;
@@ -279,14 +475,16 @@ int compaction_exceeds_overlap(Compaction* self, Variant* key)
 
 int compaction_is_base_level_for(Compaction* self, Variant* key)
 {
-    for (uint32_t level = self->level + 2; level < MAX_LEVELS; level++)
+    const Comparator* comparator = self->sst->options.comparator;
+
+    for (uint32_t level = self->output_level + 1; level < MAX_LEVELS; level++)
     {
         for (uint32_t i = 0; i < self->sst->num_files[level]; i++)
         {
             SSTMetadata* meta = *(self->sst->files[level] + i);
-            if (variant_cmp(key, meta->largest_key) <= 0)
+            if (comparator_variant_cmp(comparator, key, meta->largest_key) <= 0)
             {
-                if (variant_cmp(key, meta->smallest_key) >= 0)
+                if (comparator_variant_cmp(comparator, key, meta->smallest_key) >= 0)
                     return 0;
                 break;
             }
@@ -295,6 +493,202 @@ int compaction_is_base_level_for(Compaction* self, Variant* key)
     return 1;
 }
 
+static int _compaction_is_base_level_for_range(Compaction* self, Variant* begin, Variant* end)
+{
+    for (uint32_t level = self->output_level + 1; level < MAX_LEVELS; level++)
+    {
+        if (sst_get_overlapping_inputs(self->sst, level, begin, end, NULL, NULL, NULL) > 0)
+            return 0;
+    }
+    return 1;
+}
+
+// Records the blob value of an entry left out of the outputs as garbage
+void compaction_drop(Compaction* self, Variant* value, OPT opt)
+{
+    if (opt != BLOB)
+        return;
+
+    BlobRef* ref = malloc(sizeof(BlobRef));
+
+    if (!ref)
+        PANIC("NULL allocation");
+
+    if (!blob_ref_decode(value, ref))
+    {
+        free(ref);
+        return;
+    }
+
+    vector_add(self->blob_garbage, ref);
+}
+
+// Values of the blob files with too much garbage are written again, so the
+// files can eventually be deleted
+static int _compaction_relocates(Compaction* self, Variant* value)
+{
+    BlobRef ref;
+    BlobFile* blob;
+
+    return blob_ref_decode(value, &ref) && (blob = sst_blob_file(self->sst, ref.filenum)) &&
+           blob_file_garbage_ratio(blob) >= self->sst->options.blob_gc_threshold;
+}
+
+// Runs the expiration check and the user compaction filter on an entry.
+// Returns the value to write (possibly updating opt) or NULL when the entry
+// has to be dropped. The values of the blob entries are only read when the
+// checks need them or the blob file is being collected, and they keep
+// their reference unless they change.
+Variant* compaction_filter(Compaction* self, Variant* key, Variant* value, OPT* opt)
+{
+    Options* options = &self->sst->options;
+    int removed = 0;
+
+    self->expiration = TTL_NEVER;
+
+    if (*opt == DEL)
+        return value;
+
+    if (*opt == BLOB)
+    {
+        int relocate = _compaction_relocates(self, value);
+
+        if (!relocate && !options->with_ttl && !options->compaction_filter)
+            return value;
+
+        buffer_clear(self->blob_value);
+        buffer_putnstr(self->blob_value, value->mem, value->length);
+
+        if (!sst_read_blob(self->sst, self->blob_value))
+            return value;
+
+        Variant* ref = value;
+        OPT kind = ADD;
+
+        if ((value = compaction_filter(self, key, self->blob_value, &kind)) &&
+            kind == ADD && value == self->blob_value && !relocate)
+        {
+            if (options->with_ttl)
+                self->expiration = ttl_value_expiration(self->blob_value);
+
+            return ref;
+        }
+
+        // The old value goes away: dropped, changed or moved to the blob
+        // file of the output
+        compaction_drop(self, ref, BLOB);
+        *opt = kind;
+
+        return value;
+    }
+
+    if (options->with_ttl && ttl_value_expired(value, self->now))
+        removed = 1;
+
+    if (!removed && options->compaction_filter)
+    {
+        // The filter works on the user part of the value
+        Variant user = *value;
+        user.length = options->with_ttl ? ttl_value_length(value) : value->length;
+
+        buffer_clear(self->filter_value);
+
+        switch (options->compaction_filter(options->compaction_filter_state,
+                                           self->level, key, &user, self->filter_value))
+        {
+        case FILTER_REMOVE:
+            removed = 1;
+            break;
+        case FILTER_CHANGE_VALUE:
+            // Keep the expiration of the original value
+            if (options->with_ttl)
+                buffer_putint32(self->filter_value, ttl_value_expiration(value));
+            return self->filter_value;
+        case FILTER_KEEP:
+            break;
+        }
+    }
+
+    if (!removed)
+        return value;
+
+    // Older versions of the key may live below the output level: they must
+    // be shadowed by a deletion, there are no sequence numbers to tell them
+    // apart otherwise.
+    if (compaction_is_base_level_for(self, key))
+        return NULL;
+
+    buffer_clear(self->filter_value);
+    *opt = DEL;
+
+    return self->filter_value;
+}
+
+// Checks if the key coming from source is hidden by a range tombstone of a
+// newer input file
+int compaction_is_range_deleted(Compaction* self, Variant* key, SSTLoader* source)
+{
+    if (vector_count(self->range_dels) == 0)
+        return 0;
+
+    FileRange* ranges[] = { self->current_range, self->parent_range };
+
+    for (int r = 0; r < 2; r++)
+    {
+        for (uint32_t i = 0; i < vector_count(ranges[r]->files); i++)
+        {
+            SSTLoader* loader = ((SSTMetadata*)vector_get(ranges[r]->files, i))->loader;
+
+            if (loader->level > source->level ||
+                (loader->level == source->level && loader->filenum <= source->filenum))
+                continue;
+
+            if (range_del_index_covers(loader->range_del_index, key))
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Hands the tombstones starting before limit (all of them if limit is NULL)
+// to the current output file, creating one if needed. Tombstones that no
+// longer hide anything below the output level are dropped.
+void compaction_add_range_dels(Compaction* self, Variant* limit)
+{
+    const Comparator* comparator = self->sst->options.comparator;
+
+    while (self->range_del_pos < vector_count(self->range_dels))
+    {
+        RangeTombstone* tombstone = vector_get(self->range_dels, self->range_del_pos);
+
+        if (limit && comparator_variant_cmp(comparator, tombstone->begin, limit) >= 0)
+            break;
+
+        self->range_del_pos++;
+
+        if (_compaction_is_base_level_for_range(self, tombstone->begin, tombstone->end))
+            continue;
+
+        if (!self->builder && !compaction_new_output_file(self))
+            PANIC("Unable to create a new output file");
+
+        SSTBuilder* builder = self->builder;
+
+        if ((builder->metadata_num_entries == 0 && builder->metadata_num_range_dels == 0) ||
+            comparator_variant_cmp(comparator, tombstone->begin, self->meta->smallest_key) < 0)
+        {
+            buffer_clear(self->meta->smallest_key);
+            buffer_putnstr(self->meta->smallest_key, tombstone->begin->mem, tombstone->begin->length);
+        }
+
+        if (!self->range_del_end || comparator_variant_cmp(comparator, tombstone->end, self->range_del_end) > 0)
+            self->range_del_end = tombstone->end;
+
+        sst_builder_add_range_del(builder, tombstone);
+    }
+}
+
 void compaction_install(Compaction* self)
 {
     _compaction_close_pending(self);
@@ -319,11 +713,17 @@ void compaction_install(Compaction* self)
         INFO("Smallest: %.*s Largest: %.*s",
              meta->smallest_key->length, meta->smallest_key->mem,
              meta->largest_key->length, meta->largest_key->mem);
-        sst_file_add(self->sst, meta);
     }
 
-    // TODO: without actually writing the manifest at every add just write it
-    // here at the end of the function
+    for (uint32_t i = 0; i < vector_count(self->blob_outputs); i++)
+        sst_blob_add(self->sst, (BlobFile*)vector_get(self->blob_outputs, i));
+
+    for (uint32_t i = 0; i < vector_count(self->blob_garbage); i++)
+        sst_blob_garbage(self->sst, (BlobRef*)vector_get(self->blob_garbage, i));
+
+    // All the outputs are recorded with a single manifest update
+    sst_file_add_many(self->sst, vector_count(self->outputs),
+                      (SSTMetadata**)vector_data(self->outputs));
 
 #ifdef BACKGROUND_MERGE
     pthread_mutex_unlock(&self->sst->lock);
@@ -9,6 +9,7 @@
 
 struct _compaction {
     int level;
+    int output_level; // level + 1, or level when a file is rewritten in place
 
     Vector* outputs; // SSTMetadata**
 
@@ -22,20 +23,54 @@ struct _compaction {
     SSTBuilder* builder;
     SSTMetadata* meta;
 
+    // Position inside the grandparents and bytes overlapped by the output
+    // file being built, see compaction_exceeds_overlap()
     uint32_t overlap_index;
     uint64_t overlap_bytes;
+    unsigned seen_key:1;
+
+    // Range tombstones of all the inputs sorted by their beginning. The ones
+    // before range_del_pos have already been handed to an output file, and
+    // range_del_end is the largest end among those written in the current
+    // output: the file cannot be cut before it.
+    Vector* range_dels;
+    uint32_t range_del_pos;
+    Variant* range_del_end;
+
+    // Scratch space for the values rewritten by compaction_filter() and the
+    // time the expiration of the values is checked against. expiration is
+    // the one of the last blob value compaction_filter() kept as a
+    // reference, for the builder which cannot read it.
+    Variant* filter_value;
+    uint32_t now;
+    uint32_t expiration;
+
+    // Blob files written along with the outputs, references to the values
+    // the compaction dropped or moved (BlobRef*), both applied on install,
+    // and scratch space for the values read from the blob files
+    Vector* blob_outputs;
+    Vector* blob_garbage;
+    Variant* blob_value;
 
     SST* sst;
 };
 
 typedef struct _compaction Compaction;
 
-Compaction* compaction_new(SST* sst, int level);
+Compaction* compaction_new(SST* sst, int level, SSTMetadata* seed);
+
+// Rewrites the file into its own level, dropping what the compaction
+// filter and the expiration of the values would drop on the way down
+Compaction* compaction_new_in_place(SST* sst, SSTMetadata* meta);
 void compaction_free(Compaction* self);
 void compaction_install(Compaction* self);
 int compaction_new_output_file(Compaction* self);
 int compaction_exceeds_overlap(Compaction* self, Variant* key);
 int compaction_is_base_level_for(Compaction* self, Variant* key);
+int compaction_is_range_deleted(Compaction* self, Variant* key, SSTLoader* source);
+void compaction_add_range_dels(Compaction* self, Variant* limit);
+Variant* compaction_filter(Compaction* self, Variant* key, Variant* value, OPT* opt);
+void compaction_drop(Compaction* self, Variant* value, OPT opt);
 
 
 #endif
@@ -0,0 +1,51 @@
+#include <stdlib.h>
+#include <string.h>
+#include "comparator.h"
+#include "indexer.h"
+
+static const Comparator _bytewise = { "kiwi.bytewise", COMPARATOR_BYTEWISE, NULL, NULL };
+static const Comparator _reverse_bytewise = { "kiwi.reverse_bytewise", COMPARATOR_REVERSE_BYTEWISE, NULL, NULL };
+static const Comparator _u64 = { "kiwi.u64", COMPARATOR_U64, NULL, NULL };
+
+const Comparator* comparator_bytewise(void)
+{
+    return &_bytewise;
+}
+
+const Comparator* comparator_reverse_bytewise(void)
+{
+    return &_reverse_bytewise;
+}
+
+const Comparator* comparator_u64(void)
+{
+    return &_u64;
+}
+
+Comparator* comparator_new(const char* name, CompareFunc compare, void* state)
+{
+    Comparator* self = malloc(sizeof(Comparator));
+    size_t length = strlen(name);
+
+    if (!self || !(self->name = malloc(length + 1)))
+        PANIC("NULL allocation");
+
+    memcpy(self->name, name, length + 1);
+    self->type = COMPARATOR_CUSTOM;
+    self->compare = compare;
+    self->state = state;
+
+    return self;
+}
+
+void comparator_free(Comparator* self)
+{
+    free(self->name);
+    free(self);
+}
+
+int range_intersects(const Comparator* self, Variant* astart, Variant* bstart, Variant* astop, Variant* bstop)
+{
+    return !(comparator_variant_cmp(self, bstop, astart) < 0 ||
+             comparator_variant_cmp(self, bstart, astop) > 0);
+}
@@ -0,0 +1,135 @@
+#ifndef __COMPARATOR_H__
+#define __COMPARATOR_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "utils.h"
+#include "variant.h"
+
+/*
+ * The order of the keys, chosen when the database is created. Its name is
+ * recorded in the manifest and the database refuses to open with another
+ * one: the files would be out of order.
+ *
+ * The built-in orders are compared inline. Their type never changes once
+ * the database is open, so the branch on it always goes the same way and
+ * gcc unswitches the search loops on it. Only the custom orders pay for a
+ * call through their function.
+ *
+ * Whatever the order, two keys are equal only when their bytes are: the
+ * bloom filters and the hash indexes of the blocks go by the bytes.
+ */
+
+#define COMPARATOR_BYTEWISE         0 // string_cmp()
+#define COMPARATOR_REVERSE_BYTEWISE 1 // the opposite of string_cmp()
+#define COMPARATOR_U64              2 // 8-byte big-endian integers, see below
+#define COMPARATOR_CUSTOM           3 // compare()
+
+// The fixed-width integers are stored big-endian, so that they sort as
+// bytes do: COMPARATOR_U64 is the bytewise order, with a single load for
+// two 8-byte keys. Keys of any other length are compared as bytes.
+
+typedef int (*CompareFunc)(void* state, const char* a, size_t la, const char* b, size_t lb);
+
+typedef struct _comparator {
+    char* name;
+    int type;
+    CompareFunc compare; // COMPARATOR_CUSTOM only
+    void* state;         // passed back to compare as is
+} Comparator;
+
+const Comparator* comparator_bytewise(void);
+const Comparator* comparator_reverse_bytewise(void);
+const Comparator* comparator_u64(void);
+
+// A custom order. Like the compaction filter, it must outlive the
+// databases opened with it.
+Comparator* comparator_new(const char* name, CompareFunc compare, void* state);
+void comparator_free(Comparator* self);
+
+// Whether the keys sort as bytes, which some encodings rely on
+static inline int comparator_is_bytewise(const Comparator* self)
+{
+    return self->type == COMPARATOR_BYTEWISE || self->type == COMPARATOR_U64;
+}
+
+static inline int comparator_cmp(const Comparator* self, const char* a, size_t la, const char* b, size_t lb)
+{
+    switch (self->type)
+    {
+    case COMPARATOR_BYTEWISE:
+        return string_cmp(a, b, la, lb);
+
+    case COMPARATOR_REVERSE_BYTEWISE:
+        return string_cmp(b, a, lb, la);
+
+    case COMPARATOR_U64:
+        if (la == 8 && lb == 8)
+        {
+            uint64_t x = key_prefix(a, 8);
+            uint64_t y = key_prefix(b, 8);
+
+            return (x > y) - (x < y);
+        }
+
+        return string_cmp(a, b, la, lb);
+
+    default:
+        return self->compare(self->state, a, la, b, lb);
+    }
+}
+
+static inline int comparator_variant_cmp(const Comparator* self, const Variant* a, const Variant* b)
+{
+    return comparator_cmp(self, a->mem, a->length, b->mem, b->length);
+}
+
+// The key_prefix() of the key turned to sort like the keys: keys with
+// different prefixes compare like them, equal prefixes tell nothing. The
+// custom orders have no prefix.
+static inline uint64_t comparator_prefix(const Comparator* self, const char* key, size_t length)
+{
+    switch (self->type)
+    {
+    case COMPARATOR_BYTEWISE:
+    case COMPARATOR_U64:
+        return key_prefix(key, length);
+
+    case COMPARATOR_REVERSE_BYTEWISE:
+        return ~key_prefix(key, length);
+
+    default:
+        return 0;
+    }
+}
+
+// Same as comparator_cmp() for keys whose comparator_prefix() is known
+static inline int comparator_prefix_cmp(const Comparator* self, uint64_t pa, const char* a, size_t la,
+                                        uint64_t pb, const char* b, size_t lb)
+{
+    if (pa != pb)
+        return (pa < pb) ? -1 : 1;
+
+    switch (self->type)
+    {
+    case COMPARATOR_BYTEWISE:
+        return prefix_cmp(pa, a, la, pb, b, lb);
+
+    case COMPARATOR_REVERSE_BYTEWISE:
+        return prefix_cmp(pb, b, lb, pa, a, la);
+
+    case COMPARATOR_U64:
+        if (la == 8 && lb == 8)
+            return 0;
+
+        return prefix_cmp(pa, a, la, pb, b, lb);
+
+    default:
+        return self->compare(self->state, a, la, b, lb);
+    }
+}
+
+// Whether [astart, astop] and [bstart, bstop] share some keys
+int range_intersects(const Comparator* self, Variant* astart, Variant* bstart, Variant* astop, Variant* bstop);
+
+#endif
@@ -11,6 +11,7 @@
 #define LEVEL_WARNING 2
 #define LEVEL_ERROR   3
 
+// Defaults of the per level options, see options.h
 #define RESTART_INTERVAL 16
 
 #define SKIPLIST_SIZE 1000000
@@ -18,6 +19,7 @@
 
 #define POOL_SIZE 1024 * 8
 #define BLOCK_SIZE 4096
+#define MIN_BLOCK_SIZE 256
 #define START_MAP_SIZE 1024
 
 #define START_DIRECTORY "/tmp"
@@ -26,14 +28,87 @@
 #define IS_LITTLE_ENDIAN 1
 #define FOOTER_SIZE 40
 
+// Version of the sst files written, recorded in their meta block. Files
+// written before it was introduced are version 0: their meta block ends
+// earlier and they rely on the compile time block options.
+//   1: format version and block options in the meta block
+//   2: data blocks may have a hash index
+//   3: partitioned index
+//   4: earliest expiration of the values
+#define SST_FORMAT_VERSION 4
+
+// The manifest is a log of the files each flush and compaction adds and
+// deletes (see sst.c). It is rewritten as a snapshot of all the files when
+// opened, when closed, and once it outgrows both MANIFEST_SNAPSHOT_SIZE
+// bytes and twice the size of its last snapshot.
+#define MANIFEST_MAGIC "kiwiedit"
+#define MANIFEST_SNAPSHOT_SIZE (1 << 20)
+
 #define MAX_LEVELS 7
 #define MAX_FILES_LEVEL0 4
 #define MAX_FILES 100
 
+// Default level sizing, see options.h
+#define LEVEL_BASE_SIZE (10 * 1048576)
+#define LEVEL_MULTIPLIER 10
+#define DYNAMIC_LEVEL_BYTES 1
+
 #define EXPANSION_LIMIT (25 * 2 * 1048576)
 #define GRANDPARENT_OVERLAP (10 * 2 * 1048576)
+#define TARGET_FILE_SIZE (2 * 1048576)
 #define MAX_MEM_COMPACT_LEVEL 2
 
+// Flush and compaction outputs are written with pwrite() through aligned
+// buffers, bypassing the page cache (see direct_file_new()). Without
+// DIRECT_WRITES they are built through the mmap regions instead.
+#define DIRECT_WRITES 1
+#define DIRECT_IO_ALIGNMENT 4096
+#define DIRECT_IO_BUFFER_SIZE (1024 * 1024)
+
+// The sst files are read with pread() instead of being mapped in full: the
+// blocks are copied into the cache rather than faulted in, and reads of
+// several blocks overlap through sst_loader_prefetch()
+#define PREAD_READS 0
+
+// An iterator reading this many blocks in a row starts to read ahead of
+// them, the window doubling from ITER_READAHEAD_MIN to ITER_READAHEAD_MAX
+// bytes as the scan goes on
+#define ITER_READAHEAD_TRIGGER 2
+#define ITER_READAHEAD_MIN (8 * 1024)
+#define ITER_READAHEAD_MAX (256 * 1024)
+
+// Files whose point deletions exceed this fraction of their entries, or
+// whose range tombstones cover files of the next level bigger than
+// themselves, are compacted when no level is over its target
+#define TOMBSTONE_COMPACTION_RATIO 0.5
+#define TOMBSTONE_COMPACTION_MIN_ENTRIES 1000
+
+// A file is allowed one useless probe every SEEK_COMPACTION_BYTES of its size
+// (and at least MIN_ALLOWED_SEEKS) before being compacted for its seeks
+#define SEEK_COMPACTION_BYTES 16384
+#define MIN_ALLOWED_SEEKS 100
+
+// Threads compressing the data blocks of the files being built, 0 to do it
+// on the merge thread itself. A builder keeps at most MAX_PENDING_BLOCKS
+// blocks waiting to be written.
+#define BUILDER_THREADS 2
+#define MAX_PENDING_BLOCKS 16
+
+// Data blocks end with a hash index mapping the keys to their restart
+// point, so point lookups skip the binary search. BLOCK_HASH_UTIL_RATIO is
+// the number of keys per bucket.
+#define BLOCK_HASH_INDEX 1
+#define BLOCK_HASH_UTIL_RATIO 0.75
+
+// Files whose index outgrows INDEX_PARTITION_SIZE bytes (0 to disable) get
+// a two level index: only the top level stays in memory, the partitions are
+// read like data blocks and cached in the LRU
+#define INDEX_PARTITION_SIZE 4096
+
+// Key-value separation, disabled by default (see blob.h)
+#define MIN_BLOB_SIZE 0
+#define BLOB_GC_THRESHOLD 0.5
+
 #define WITH_BLOOM_FILTER
 #define BITS_PER_KEY 10
 #define NUM_PROBES 7
@@ -51,4 +126,24 @@
 #define BACKGROUND_MERGE
 #define WITH_SNAPPY
 
+// Optional codecs, they need to be linked with -llz4 and -lzstd
+//#define WITH_LZ4
+//#define WITH_ZSTD
+
+// Codec used by default on every level and the largest compressed/raw
+// ratio a block may have to be stored compressed
+#ifdef WITH_SNAPPY
+#define DEFAULT_COMPRESSION TYPE_SNAPPY_COMPRESSION
+#else
+#define DEFAULT_COMPRESSION TYPE_NO_COMPRESSION
+#endif
+#define COMPRESSION_RATIO_LIMIT 0.8
+
+// Zstd dictionaries: files compressed with zstd get their own dictionary
+// of ZSTD_DICT_SIZE bytes (0 to disable), trained on their first blocks
+// until ZSTD_DICT_SAMPLES_SIZE bytes have been seen
+#define ZSTD_DICT_SIZE (16 * 1024)
+#define ZSTD_DICT_SAMPLES_SIZE (100 * ZSTD_DICT_SIZE)
+#define ZSTD_LEVEL 3
+
 #endif
@@ -1,9 +1,12 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <assert.h>
 #include "db.h"
 #include "indexer.h"
 #include "utils.h"
 #include "log.h"
+#include "range_del.h"
+#include "ttl.h"
 #include <pthread.h>
 
 // In order for the readers-writers algorithm to execute
@@ -38,7 +41,7 @@ int read_enabled =0;
 // or no writer is inside the library
 int write_enabled =0;
 
-DB* db_open_ex(const char* basedir, uint64_t cache_size)
+DB* db_open_options(const char* basedir, const Options* options)
 {
     DB* self = calloc(1, sizeof(DB));
 
@@ -46,14 +49,25 @@ DB* db_open_ex(const char* basedir, uint64_t cache_size)
         PANIC("NULL allocation");
 
     strncpy(self->basedir, basedir, MAX_FILENAME);
-    self->sst = sst_new(basedir, cache_size);
+    self->sst = sst_new(basedir, options);
 
     Log* log = log_new(self->sst->basedir);
-    self->memtable = memtable_new(log);
+    self->memtable = memtable_new(log, self->sst->options.comparator);
 
     return self;
 }
 
+DB* db_open_ex(const char* basedir, uint64_t cache_size)
+{
+    Options* options = options_new();
+    options->cache_size = cache_size;
+
+    DB* self = db_open_options(basedir, options);
+
+    options_free(options);
+    return self;
+}
+
 DB* db_open(const char* basedir)
 {
     return db_open_ex(basedir, LRU_CACHE_SIZE);
@@ -63,7 +77,8 @@ void db_close(DB *self)
 {
     INFO("Closing database %d", self->memtable->add_count);
 
-    if (self->memtable->list->count > 0)
+    if (self->memtable->list->count > 0 ||
+        vector_count(self->memtable->list->range_dels) > 0)
     {
         sst_merge(self->sst, self->memtable);
         skiplist_release(self->memtable->list);
@@ -77,8 +92,10 @@ void db_close(DB *self)
     free(self);
 }
 
-int db_add(DB* self, Variant* key, Variant* value)
-{    
+// A writer enters the DB once no reader is inside, and makes room in the
+// memtable for its edit
+static void _writer_enter(DB* self)
+{
     // As explained above, wait()/brodcast() system calls
     // are surrounded by lock()/unlock() system calls
     pthread_mutex_lock(&writers_mutex);
@@ -108,13 +125,6 @@ int db_add(DB* self, Variant* key, Variant* value)
         printf(" WRITER STARTED read_enabled %d write_enabled %d\n\n",read_enabled,write_enabled);
     #endif
 
-    // The return value of memtable_add() function is now stored in 
-    // the value_added variable
-    // Originally, it was returned directly by the function
-    // Returning it before a mutex is unlocked can cause problems
-    // to the system, so it has to be returned after the mutex is unlocked
-    int value_added;
-
     if (memtable_needs_compaction(self->memtable))
     {
         INFO("Starting compaction of the memtable after %d insertions and %d deletions",
@@ -123,11 +133,11 @@ int db_add(DB* self, Variant* key, Variant* value)
 
         memtable_reset(self->memtable);
     }
+}
 
-    //The return value of memtable_add() function stored in
-    // the value_added variable once the writer finishes 
-    value_added = memtable_add(self->memtable, key, value);
-
+// A writer leaves the DB and wakes up the readers waiting for it
+static void _writer_exit(void)
+{
     // The writer has finished so it decrease the value of
     // write_enabled variable to 0
     write_enabled --;
@@ -140,14 +150,57 @@ int db_add(DB* self, Variant* key, Variant* value)
     // and unlocks the mutex that goes along with the condition variable of the readers
     pthread_cond_broadcast(&cond_var_readers);
     pthread_mutex_unlock(&writers_mutex);
+}
+
+static int _db_add(DB* self, Variant* key, Variant* value)
+{    
+    _writer_enter(self);
+
+    // The return value of memtable_add() function is now stored in 
+    // the value_added variable
+    // Originally, it was returned directly by the function
+    // Returning it before a mutex is unlocked can cause problems
+    // to the system, so it has to be returned after the mutex is unlocked
+    int value_added = memtable_add(self->memtable, key, value);
+
+    _writer_exit();
 
     // The return value of memtable_add() function can now be returned
     // since there is no locked mutex and causes no problem to the system
     return value_added;
 }
 
-int db_get(DB* self, Variant* key, Variant* value)
-{   
+int db_add(DB* self, Variant* key, Variant* value)
+{
+    if (self->sst->options.with_ttl)
+        return db_add_ttl(self, key, value, 0);
+
+    return _db_add(self, key, value);
+}
+
+// Adds a value expiring after ttl seconds (0 means never). Requires the
+// database to be opened with the with_ttl option.
+int db_add_ttl(DB* self, Variant* key, Variant* value, uint32_t ttl)
+{
+    if (!self->sst->options.with_ttl)
+    {
+        ERROR("The database has not been opened with TTL support");
+        return 0;
+    }
+
+    uint32_t expiration = ttl ? (uint32_t)get_ustime_sec() + ttl : TTL_NEVER;
+    Variant* stored = buffer_new(value->length + TTL_SUFFIX_SIZE);
+
+    ttl_value_encode(stored, value, expiration);
+    int ret = _db_add(self, key, stored);
+
+    buffer_free(stored);
+    return ret;
+}
+
+// A reader enters the DB once no writer is inside
+static void _reader_enter(void)
+{
     // As explained above, wait()/brodcast() system calls
     // are surrounded by lock()/unlock() system calls
     pthread_mutex_lock(&writers_mutex);
@@ -168,6 +221,48 @@ int db_get(DB* self, Variant* key, Variant* value)
 
     // Once the writer is no longer inside the DB, the readers may now proceed
     pthread_mutex_unlock(&writers_mutex);
+}
+
+// A reader leaves the DB and wakes up the writers waiting for it
+static void _reader_exit(void)
+{
+    pthread_mutex_lock(&writers_mutex);
+
+    // One of the readers finished and the number of readers decreases
+
+    read_enabled--;
+
+    #if DEBUGGING_PRINTS_ENABLED == 1
+        printf("READERS FINISHED read_enabled %d write_enabled %d\n\n",read_enabled,write_enabled);
+    #endif
+
+    // Once a reader finishes searching a value, it will notify the writers
+    // The writers will then check their condition, meaning if there are no readers
+    // inside the DB and enter once there is no reader
+    // If there is at least one reader inside, they will wait
+    
+    pthread_cond_broadcast(&cond_var_writers);
+    
+    pthread_mutex_unlock(&writers_mutex);
+}
+
+// Strips the expiration of a value read with the with_ttl option, returns
+// 0 if the value has expired
+static int _db_unwrap_ttl(DB* self, Variant* value)
+{
+    if (!self->sst->options.with_ttl)
+        return 1;
+
+    if (ttl_value_expired(value, (uint32_t)get_ustime_sec()))
+        return 0;
+
+    value->length = ttl_value_length(value);
+    return 1;
+}
+
+int db_get(DB* self, Variant* key, Variant* value)
+{   
+    _reader_enter();
 
     // Unlike the writer, the reader does not have to lock the reading section
     // as there can be multiple readers in the DB, as long there is no writer
@@ -182,60 +277,306 @@ int db_get(DB* self, Variant* key, Variant* value)
     // the value was found in the memtable
     // Its use is more to make the code easier to read and be understood
     int found_in_memtable;
+    OPT opt;
 
     #if DEBUGGING_PRINTS_ENABLED == 1
         printf("READERS STARTED read_enabled %d write_enabled %d\n\n",read_enabled,write_enabled);
     #endif
 
-    found_in_memtable = memtable_get(self->memtable->list, key, value);
+    found_in_memtable = memtable_get(self->memtable->list, key, value, &opt);
 
+    // A deletion in the memtable hides whatever is stored in the sst
     if (found_in_memtable == 1){
-        return_value =1;
+        return_value = (opt == ADD);
     }
     else{
         return_value = sst_get(self->sst, key, value);
     }
 
-    pthread_mutex_lock(&writers_mutex);
+    // Expired values are gone even if no compaction dropped them yet
+    if (return_value)
+        return_value = _db_unwrap_ttl(self, value);
 
-    // One of the readers finished and the number of readers decreases
-
-    read_enabled--;
-
-    #if DEBUGGING_PRINTS_ENABLED == 1
-        printf("READERS FINISHED read_enabled %d write_enabled %d\n\n",read_enabled,write_enabled);
-    #endif
-
-    // Once a reader finishes searching a value, it will notify the writers
-    // The writers will then check their condition, meaning if there are no readers
-    // inside the DB and enter once there is no reader
-    // If there is at least one reader inside, they will wait
-    
-    pthread_cond_broadcast(&cond_var_writers);
-    
-    pthread_mutex_unlock(&writers_mutex);
+    _reader_exit();
 
     // The value of return_value variable can now be returned
     // since there is no locked mutex and causes no problem to the system
     return return_value;
 }
 
+PinnedValue* pinned_value_new(void)
+{
+    PinnedValue* self = calloc(1, sizeof(PinnedValue));
+
+    if (!self)
+        PANIC("NULL allocation");
+
+    self->buffer = buffer_new(32);
+    return self;
+}
+
+void pinned_value_free(PinnedValue* self)
+{
+    buffer_free(self->buffer);
+    free(self);
+}
+
+int db_get_pinned(DB* self, Variant* key, PinnedValue* value)
+{
+    OPT opt;
+    int ret;
+
+    db_release_pinned(self, value);
+    _reader_enter();
+
+    buffer_clear(value->buffer);
+
+    if (memtable_get(self->memtable->list, key, value->buffer, &opt))
+    {
+        value->value.mem = value->buffer->mem;
+        value->value.length = value->buffer->length;
+        ret = (opt == ADD);
+    }
+    else
+        ret = sst_get_pinned(self->sst, key, &value->value, value->buffer, &value->pin);
+
+    if (ret)
+        ret = _db_unwrap_ttl(self, &value->value);
+
+    _reader_exit();
+
+    if (!ret)
+        db_release_pinned(self, value);
+
+    return ret;
+}
+
+void db_release_pinned(DB* self, PinnedValue* value)
+{
+    sst_unpin(self->sst, &value->pin);
+
+    value->value.mem = NULL;
+    value->value.length = 0;
+}
+
+typedef struct _sorted_key {
+    Variant* key;
+    uint32_t pos; // in the arrays given to db_multi_get()
+} SortedKey;
+
+static int _compare_sorted_keys(const SortedKey* a, const SortedKey* b, const Comparator* comparator)
+{
+    return comparator_variant_cmp(comparator, a->key, b->key);
+}
+
+int db_multi_get(DB* self, uint32_t num_keys, Variant** keys, Variant** values, int* statuses)
+{
+    SortedKey* sorted = malloc(sizeof(SortedKey) * num_keys);
+    Variant** sst_keys = malloc(sizeof(Variant*) * num_keys);
+    Variant** sst_values = malloc(sizeof(Variant*) * num_keys);
+    uint32_t* sst_pos = malloc(sizeof(uint32_t) * num_keys);
+    int* sst_found = malloc(sizeof(int) * num_keys);
+    uint32_t sst_count = 0;
+    int num_found = 0;
+
+    if (!sorted || !sst_keys || !sst_values || !sst_pos || !sst_found)
+        PANIC("NULL allocation");
+
+    for (uint32_t i = 0; i < num_keys; i++)
+    {
+        sorted[i].key = keys[i];
+        sorted[i].pos = i;
+    }
+
+    qsort_r(sorted, num_keys, sizeof(SortedKey), (int(*)(const void*, const void*, void*))_compare_sorted_keys,
+            (void*)self->sst->options.comparator);
+
+    _reader_enter();
+
+    // The keys not in the memtable go to the sst in a single batch, sorted
+    for (uint32_t k = 0; k < num_keys; k++)
+    {
+        uint32_t i = sorted[k].pos;
+        OPT opt;
+
+        if (memtable_get(self->memtable->list, keys[i], values[i], &opt))
+        {
+            statuses[i] = (opt == ADD);
+            continue;
+        }
+
+        sst_keys[sst_count] = keys[i];
+        sst_values[sst_count] = values[i];
+        sst_pos[sst_count++] = i;
+    }
+
+    if (sst_count > 0)
+        sst_multi_get(self->sst, sst_count, sst_keys, sst_values, sst_found);
+
+    for (uint32_t k = 0; k < sst_count; k++)
+        statuses[sst_pos[k]] = sst_found[k];
+
+    for (uint32_t i = 0; i < num_keys; i++)
+    {
+        if (statuses[i])
+            statuses[i] = _db_unwrap_ttl(self, values[i]);
+
+        num_found += statuses[i];
+    }
+
+    _reader_exit();
+
+    free(sorted);
+    free(sst_keys);
+    free(sst_values);
+    free(sst_pos);
+    free(sst_found);
+
+    return num_found;
+}
+
+// The deletions go through the writers path as the additions do: they
+// change the list the readers are walking
 int db_remove(DB* self, Variant* key)
 {
-    return memtable_remove(self->memtable, key);
+    _writer_enter(self);
+    int ret = memtable_remove(self->memtable, key);
+    _writer_exit();
+
+    return ret;
 }
 
-DBIterator* db_iterator_new(DB* db)
+// Deletes every key in [begin, end] with a single range tombstone
+int db_delete_range(DB* self, Variant* begin, Variant* end)
+{
+    _writer_enter(self);
+    int ret = memtable_remove_range(self->memtable, begin, end);
+    _writer_exit();
+
+    return ret;
+}
+
+// Checks if the keys of a file may fall inside the bounds
+static int _db_iterator_overlaps(DBIterator* self, SSTMetadata* meta)
+{
+    if (self->upper_bound && comparator_variant_cmp(self->comparator, meta->smallest_key, self->upper_bound) >= 0)
+        return 0;
+
+    if (self->lower_bound && comparator_variant_cmp(self->comparator, meta->largest_key, self->lower_bound) < 0)
+        return 0;
+
+    return 1;
+}
+
+// Gathers the files of every level overlapping the bounds: the files of
+// level 0 may overlap and get an iterator each, the ones of the other
+// levels are chained. The range tombstones of a file may reach out of its
+// keys, so all the files holding them are kept as well. They are pinned,
+// so that compactions do not free them under the iterator.
+static void _db_iterator_add_files(DBIterator* self)
+{
+    SST* sst = self->db->sst;
+
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_lock(&sst->lock);
+#endif
+
+    for (int level = 0; level < MAX_LEVELS; level++)
+    {
+        uint32_t num_files = sst->num_files[level];
+        uint32_t count = 0;
+        SSTMetadata** files = malloc(sizeof(SSTMetadata*) * (num_files + 1));
+
+        if (!files)
+            PANIC("NULL allocation");
+
+        for (uint32_t i = 0; i < num_files; i++)
+        {
+            SSTMetadata* meta = sst->files[level][i];
+            int overlaps = _db_iterator_overlaps(self, meta);
+
+            if (!overlaps && meta->loader->num_range_dels == 0)
+                continue;
+
+            meta->pins++;
+            vector_add(self->files, meta);
+
+            if (meta->loader->num_range_dels > 0)
+                vector_add(self->range_del_files, meta);
+
+            if (!overlaps)
+                continue;
+
+            if (level > 0)
+            {
+                files[count++] = meta;
+                continue;
+            }
+
+            SSTMetadata** file = malloc(sizeof(SSTMetadata*));
+
+            if (!file)
+                PANIC("NULL allocation");
+
+            *file = meta;
+            vector_add(self->iterators, chained_iterator_new(1, file));
+        }
+
+        if (count > 0)
+            vector_add(self->iterators, chained_iterator_new(count, files));
+        else
+            free(files);
+    }
+
+    // The values of the files are read from the blob files as the
+    // iteration goes on, while compactions may delete them
+    sst_pin_blobs(sst, self->blobs);
+
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_unlock(&sst->lock);
+#endif
+
+    for (uint32_t i = 0; i < vector_count(self->iterators); i++)
+    {
+        ChainedIterator* iter = (ChainedIterator*)vector_get(self->iterators, i);
+
+        iter->lower_bound = self->lower_bound;
+        iter->upper_bound = self->upper_bound;
+    }
+}
+
+static Variant* _db_iterator_bound(const Variant* bound)
+{
+    if (!bound)
+        return NULL;
+
+    Variant* copy = buffer_new(bound->length + 1);
+    buffer_putnstr(copy, bound->mem, bound->length);
+
+    return copy;
+}
+
+DBIterator* db_iterator_new_options(DB* db, const IteratorOptions* options)
 {
     DBIterator* self = calloc(1, sizeof(DBIterator));
+    self->files = vector_new();
     self->iterators = vector_new();
+    self->range_del_files = vector_new();
+    self->blobs = vector_new();
     self->db = db;
+    self->comparator = db->sst->options.comparator;
+
+    if (options)
+    {
+        self->lower_bound = _db_iterator_bound(options->iterate_lower_bound);
+        self->upper_bound = _db_iterator_bound(options->iterate_upper_bound);
+    }
 
-    self->sl_key = buffer_new(1);
-    self->sl_value = buffer_new(1);
+    self->key = buffer_new(1);
+    self->value = buffer_new(1);
 
     self->list = db->memtable->list;
-    self->prev = self->node = self->list->hdr;
+    self->node = self->list->hdr;
 
     skiplist_acquire(self->list);
 
@@ -247,7 +588,7 @@ DBIterator* db_iterator_new(DB* db)
         skiplist_acquire(self->db->sst->immutable_list);
 
         self->imm_list = self->db->sst->immutable_list;
-        self->imm_prev = self->imm_node = self->imm_list->hdr;
+        self->imm_node = self->imm_list->hdr;
         self->has_imm = 1;
     }
 
@@ -256,30 +597,38 @@ DBIterator* db_iterator_new(DB* db)
     // TODO: At this point we should get the current sequence of the active
     // SkipList in order to avoid polluting the iteration
 
-    self->use_memtable = 1;
-    self->use_files = 1;
-
-    self->advance = ADV_MEM | ADV_MEM;
+    _db_iterator_add_files(self);
 
     return self;
 }
 
+DBIterator* db_iterator_new(DB* db)
+{
+    return db_iterator_new_options(db, NULL);
+}
+
 void db_iterator_free(DBIterator* self)
 {
     for (int i = 0; i < vector_count(self->iterators); i++)
         chained_iterator_free((ChainedIterator *)vector_get(self->iterators, i));
 
-    heap_free(self->minheap);
+    sst_unpin_files(self->db->sst, vector_count(self->files), (SSTMetadata**)vector_data(self->files));
+    sst_unpin_blobs(self->db->sst, self->blobs);
+
+    loser_tree_free(self->tree);
+    vector_free(self->files);
     vector_free(self->iterators);
+    vector_free(self->range_del_files);
+    vector_free(self->blobs);
 
-    buffer_free(self->sl_key);
-    buffer_free(self->sl_value);
+    if (self->lower_bound)
+        buffer_free(self->lower_bound);
 
-    if (self->has_imm)
-    {
-        buffer_free(self->isl_key);
-        buffer_free(self->isl_value);
-    }
+    if (self->upper_bound)
+        buffer_free(self->upper_bound);
+
+    buffer_free(self->key);
+    buffer_free(self->value);
 
     skiplist_release(self->list);
 
@@ -289,304 +638,324 @@ void db_iterator_free(DBIterator* self)
     free(self);
 }
 
-static void _db_iterator_add_level0(DBIterator* self, Variant* key)
+// Points key at the key of a memtable node
+static void _db_iterator_node_key(SkipNode* node, Variant* key)
 {
-    // Createa all iterators for scanning level0. If is it possible
-    // try to create a chained iterator for non overlapping sequences.
+    uint32_t length = 0;
 
-    int i = 0;
-    SST* sst = self->db->sst;
+    key->mem = (char*)get_varint32(node->data, node->data + 5, &length);
+    key->length = length;
+}
 
-    while (i < sst->num_files[0])
-    {
-        INFO("Comparing %.*s %.*s", key->length, key->mem, sst->files[0][i]->smallest_key->length, sst->files[0][i]->smallest_key->mem);
-        if (variant_cmp(key, sst->files[0][i]->smallest_key) < 0)
-        {
-            i++;
-            continue;
-        }
-        break;
-    }
+static SkipNode* _db_iterator_seek_node(SkipList* list, Variant* key, int reverse)
+{
+    SkipNode* node;
 
-    i -= 1;
+    if (!reverse)
+        node = key ? skiplist_lookup_prev(list, key->mem, key->length) : skiplist_first(list);
+    else
+        node = key ? skiplist_lookup_floor(list, key->mem, key->length) : skiplist_last(list);
 
-    if (i < 0 || i >= sst->num_files[0])
-        return;
+    return node ? node : list->hdr;
+}
 
-    int j = i + 1;
-    Vector* files = vector_new();
-    vector_add(files, sst->files[0][i]);
+// Positions every source on the first key >= key or, going backwards, on
+// the last key <= key. A NULL key stands for the first or the last key.
+static void _db_iterator_position(DBIterator* self, Variant* key, int reverse)
+{
+    self->reverse = reverse;
+    self->node = _db_iterator_seek_node(self->list, key, reverse);
 
-    INFO("%s", sst->files[0][0]->loader->file->filename);
+    if (self->has_imm)
+        self->imm_node = _db_iterator_seek_node(self->imm_list, key, reverse);
 
-    while ((i < sst->num_files[0]) && (j < sst->num_files[0]))
+    for (uint32_t i = 0; i < vector_count(self->iterators); i++)
     {
-        if (!range_intersects(sst->files[0][i]->smallest_key,
-                            sst->files[0][i]->largest_key,
-                            sst->files[0][j]->smallest_key,
-                            sst->files[0][j]->largest_key))
-            vector_add(files, sst->files[0][j]);
+        ChainedIterator* iter = (ChainedIterator*)vector_get(self->iterators, i);
+
+        if (reverse)
+            chained_iterator_seek_for_prev(iter, key);
         else
-        {
-            size_t num_files = vector_count(files);
-            SSTMetadata** arr = vector_release(files);
+            chained_iterator_seek(iter, key);
+    }
 
-            vector_add(self->iterators,
-                       chained_iterator_new_seek(num_files, arr, key));
+    if (!self->tree)
+        self->tree = loser_tree_new(vector_count(self->iterators), (ChainedIterator**)vector_data(self->iterators),
+                                    self->comparator);
 
-            i = j;
-            vector_add(files, sst->files[0][i]);
-        }
+    loser_tree_rebuild(self->tree, reverse);
+}
 
-        j++;
-    }
+// Checks if a key read from source is hidden by a deletion in the memtables
+// or by the range tombstones of a newer file
+static int _db_iterator_is_deleted(DBIterator* self, Variant* key, SSTLoader* source)
+{
+    if (memtable_is_deleted(self->list, key))
+        return 1;
 
-    if (vector_count(files) > 0)
+    if (self->has_imm && memtable_is_deleted(self->imm_list, key))
+        return 1;
+
+    for (uint32_t i = 0; i < vector_count(self->range_del_files); i++)
     {
-        vector_add(self->iterators,
-                   chained_iterator_new_seek(vector_count(files),
-                                             (SSTMetadata **)files->data, key));
+        SSTLoader* loader = ((SSTMetadata*)vector_get(self->range_del_files, i))->loader;
 
-        files->data = NULL;
+        if (loader->level > source->level ||
+            (loader->level == source->level && loader->filenum <= source->filenum))
+            continue;
+
+        if (range_del_index_covers(loader->range_del_index, key))
+            return 1;
     }
 
-    vector_free(files);
+    return 0;
 }
 
-void db_iterator_seek(DBIterator* self, Variant* key)
+// Moves every source positioned on the current key past it
+static void _db_iterator_skip(DBIterator* self)
 {
-#ifdef BACKGROUND_MERGE
-    pthread_mutex_lock(&self->db->sst->lock);
-#endif
+    Variant key;
+    ChainedIterator* iter;
 
-    _db_iterator_add_level0(self, key);
+    if (self->node != self->list->hdr)
+    {
+        _db_iterator_node_key(self->node, &key);
 
-    int i = 0;
-    SST* sst = self->db->sst;
-    Vector* files = vector_new();
+        if (comparator_variant_cmp(self->comparator, &key, self->key) == 0)
+            self->node = self->reverse ? self->node->backward : self->node->forward[0];
+    }
 
-    for (int level = 1; level < MAX_LEVELS; level++)
+    if (self->has_imm && self->imm_node != self->imm_list->hdr)
     {
-        i = sst_find_file(sst, level, key);
+        _db_iterator_node_key(self->imm_node, &key);
 
-        if (i >= sst->num_files[level])
-            continue;
-
-        for (; i < sst->num_files[level]; i++)
-        {
-            DEBUG("Iterator will include: %d [%.*s, %.*s]",
-                  sst->files[level][i]->filenum,
-                  sst->files[level][i]->smallest_key->length,
-                  sst->files[level][i]->smallest_key->mem,
-                  sst->files[level][i]->largest_key->length,
-                  sst->files[level][i]->largest_key->mem);
-            vector_add(files, (void*)sst->files[level][i]);
-        }
+        if (comparator_variant_cmp(self->comparator, &key, self->key) == 0)
+            self->imm_node = self->reverse ? self->imm_node->backward : self->imm_node->forward[0];
+    }
 
-        size_t num_files = vector_count(files);
-        SSTMetadata** arr = vector_release(files);
+    // The older versions of the key as well
+    while ((iter = loser_tree_top(self->tree)) != NULL &&
+           comparator_variant_cmp(self->comparator, iter->current->key, self->key) == 0)
+    {
+        if (self->reverse)
+            chained_iterator_prev(iter);
+        else
+            chained_iterator_next(iter);
 
-        vector_add(self->iterators,
-                   chained_iterator_new_seek(num_files, arr, key));
+        loser_tree_replay(self->tree);
     }
+}
 
-#ifdef BACKGROUND_MERGE
-    pthread_mutex_unlock(&self->db->sst->lock);
-#endif
-    vector_free(files);
+static Variant* _db_iterator_raw_value(DBIterator* self)
+{
+    if (self->source == SOURCE_FILES)
+    {
+        SSTLoaderIterator* current = self->current->current;
 
-    self->minheap = heap_new(vector_count(self->iterators), (comparator)chained_iterator_comp);
+        // Blob values are only read when asked for
+        if (current->opt == BLOB)
+        {
+            if (!sst_read_pinned_blob(self->blobs, current->value))
+                buffer_clear(current->value);
 
-    for (i = 0; i < vector_count(self->iterators); i++)
-        heap_insert(self->minheap, (ChainedIterator*)vector_get(self->iterators, i));
+            current->opt = ADD;
+        }
 
-    self->node = skiplist_lookup_prev(self->db->memtable->list, key->mem, key->length);
+        return current->value;
+    }
+    return self->value;
+}
 
-    if (!self->node)
-        self->node = self->db->memtable->list->hdr;
+// Returns 1 if a comes before b in the direction of the iteration
+static inline int _db_iterator_before(DBIterator* self, Variant* a, Variant* b)
+{
+    int ret = comparator_variant_cmp(self->comparator, a, b);
+    return self->reverse ? ret >= 0 : ret <= 0;
+}
 
-    self->prev = self->node;
+// Checks if a key is at or above the upper bound or, going backwards,
+// below the lower one: there is nothing left in this direction
+static int _db_iterator_past_bound(DBIterator* self, Variant* key)
+{
+    if (self->reverse)
+        return self->lower_bound && comparator_variant_cmp(self->comparator, key, self->lower_bound) < 0;
 
-    db_iterator_next(self);
+    return self->upper_bound && comparator_variant_cmp(self->comparator, key, self->upper_bound) >= 0;
 }
 
-static void _db_iterator_next(DBIterator* self)
+// Settles on the nearest key the sources are positioned on whose newest
+// version is neither deleted nor expired
+static void _db_iterator_find(DBIterator* self)
 {
-    ChainedIterator* iter;
-
-start:
+    int with_ttl = self->db->sst->options.with_ttl;
+    uint32_t now = with_ttl ? (uint32_t)get_ustime_sec() : 0;
 
-    if (self->current != NULL)
+    while (1)
     {
-        iter = self->current;
-        sst_loader_iterator_next(iter->current);
+        Variant mem_key, imm_key;
+        Variant* key = NULL;
+        ChainedIterator* iter = loser_tree_top(self->tree);
 
-        if (iter->current->valid)
+        // On a tie the newer source wins, so they are compared oldest first
+        if (iter)
         {
-            iter->skip = 0;
-            heap_insert(self->minheap, iter);
+            key = iter->current->key;
+            self->source = SOURCE_FILES;
         }
-        else
+
+        if (self->has_imm && self->imm_node != self->imm_list->hdr)
         {
-            // Let's see if we can go on with the chained iterator
-            if (iter->pos < iter->num_files)
+            _db_iterator_node_key(self->imm_node, &imm_key);
+
+            if (!key || _db_iterator_before(self, &imm_key, key))
             {
-                // TODO: Maybe a reinitialization would be better
-                sst_loader_iterator_free(iter->current);
-                iter->current = sst_loader_iterator((*(iter->files + iter->pos++))->loader);
+                key = &imm_key;
+                self->source = SOURCE_IMM;
+            }
+        }
+
+        if (self->node != self->list->hdr)
+        {
+            _db_iterator_node_key(self->node, &mem_key);
 
-                assert(iter->current->valid);
-                heap_insert(self->minheap, iter);
+            if (!key || _db_iterator_before(self, &mem_key, key))
+            {
+                key = &mem_key;
+                self->source = SOURCE_MEM;
             }
-            else
-                sst_loader_iterator_free(iter->current);
         }
-    }
 
-    if (heap_pop(self->minheap, (void**)&iter))
-    {
-        assert(iter->current->valid);
+        if (!key)
+        {
+            self->valid = 0;
+            return;
+        }
 
-        self->current = iter;
-        self->valid = 1;
+        if (_db_iterator_past_bound(self, key))
+        {
+            self->valid = 0;
+            return;
+        }
 
-        if (iter->skip == 1)
-            goto start;
+        // The seeks start inside the bounds, but for the upper bound itself
+        // when going backwards
+        if (self->reverse && self->upper_bound && comparator_variant_cmp(self->comparator, key, self->upper_bound) >= 0)
+        {
+            buffer_clear(self->key);
+            buffer_putnstr(self->key, key->mem, key->length);
 
-        if (iter->current->opt == DEL)
-            goto start;
-    }
-    else
-        self->valid = 0;
-}
+            _db_iterator_skip(self);
+            continue;
+        }
 
-static void _db_iterator_advance_mem(DBIterator* self)
-{
-    while (1)
-    {
-        self->prev = self->node;
-        self->list_end = self->node == self->list->hdr;
+        int visible;
 
-        if (self->list_end)
-            return;
+        if (self->source == SOURCE_FILES)
+        {
+            buffer_clear(self->key);
+            buffer_putnstr(self->key, key->mem, key->length);
 
-        OPT opt;
-        memtable_extract_node(self->node, self->sl_key, self->sl_value, &opt);
-        self->node = self->node->forward[0];
+            self->current = iter;
+            visible = (iter->current->opt != DEL &&
+                       !_db_iterator_is_deleted(self, self->key, iter->current->loader));
+        }
+        else
+        {
+            OPT opt;
+            memtable_extract_node(self->source == SOURCE_MEM ? self->node : self->imm_node,
+                                  self->key, self->value, &opt);
+
+            // Deletions in the active memtable hide the older keys
+            visible = (opt == ADD &&
+                       (self->source == SOURCE_MEM || !memtable_is_deleted(self->list, self->key)));
+        }
 
-        if (opt == ADD)
-            break;
+        if (visible && with_ttl && ttl_value_expired(_db_iterator_raw_value(self), now))
+            visible = 0;
 
-        buffer_clear(self->sl_key);
-        buffer_clear(self->sl_value);
+        if (visible)
+        {
+            self->valid = 1;
+            return;
+        }
+
+        _db_iterator_skip(self);
     }
 }
 
-static void _db_iterator_advance_imm(DBIterator* self)
+void db_iterator_seek(DBIterator* self, Variant* key)
 {
-    while (self->has_imm)
-    {
-        self->imm_prev = self->imm_node;
-        self->imm_list_end = self->imm_node == self->imm_list->hdr;
+    if (self->lower_bound && (!key || comparator_variant_cmp(self->comparator, key, self->lower_bound) < 0))
+        key = self->lower_bound;
 
-        if (self->imm_list_end)
-            return;
+    _db_iterator_position(self, key, 0);
+    _db_iterator_find(self);
+}
 
-        OPT opt;
-        memtable_extract_node(self->imm_node, self->isl_key, self->isl_value, &opt);
-        self->imm_node = self->imm_node->forward[0];
+void db_iterator_seek_to_first(DBIterator* self)
+{
+    db_iterator_seek(self, NULL);
+}
 
-        if (opt == ADD)
-            break;
+void db_iterator_seek_for_prev(DBIterator* self, Variant* key)
+{
+    // The upper bound itself is skipped by _db_iterator_find()
+    if (self->upper_bound && (!key || comparator_variant_cmp(self->comparator, key, self->upper_bound) >= 0))
+        key = self->upper_bound;
 
-        buffer_clear(self->isl_key);
-        buffer_clear(self->isl_value);
-    }
+    _db_iterator_position(self, key, 1);
+    _db_iterator_find(self);
 }
 
-static void _db_iterator_next_mem(DBIterator* self)
+void db_iterator_seek_to_last(DBIterator* self)
 {
-    if (self->advance & ADV_MEM) _db_iterator_advance_mem(self);
-    if (self->advance & ADV_IMM) _db_iterator_advance_imm(self);
-
-    // Here we need to compare the two keys
-    if (self->sl_key && !self->isl_key)
-    {
-        self->advance = ADV_MEM;
-        self->key = self->sl_key;
-        self->value = self->sl_value;
-    }
-    else if (!self->sl_key && self->isl_key)
-    {
-        self->advance = ADV_IMM;
-        self->key = self->isl_key;
-        self->value = self->isl_value;
-    }
-    else
-    {
-        if (variant_cmp(self->sl_key, self->isl_key) <= 0)
-        {
-            self->advance = ADV_MEM;
-            self->key = self->sl_key;
-            self->value = self->sl_value;
-        }
-        else
-        {
-            self->advance = ADV_IMM;
-            self->key = self->isl_key;
-            self->value = self->isl_value;
-        }
-    }
+    db_iterator_seek_for_prev(self, NULL);
 }
 
 void db_iterator_next(DBIterator* self)
 {
-    if (self->use_files)
-        _db_iterator_next(self);
-    if (self->use_memtable)
-        _db_iterator_next_mem(self);
+    if (!self->valid)
+        return;
 
-    int ret = (self->list_end) ? 1 : -1;
+    if (self->reverse)
+        _db_iterator_position(self, self->key, 0);
 
-    while (self->valid && !self->list_end)
-    {
-        ret = variant_cmp(self->key, self->current->current->key);
-        //INFO("COMPARING: %.*s %.*s", self->key->length, self->key->mem, self->current->current->key->length,self->current->current->key->mem );
+    _db_iterator_skip(self);
+    _db_iterator_find(self);
+}
 
-        // Advance the iterator from disk until it's greater than the memtable key
-        if (ret == 0)
-            _db_iterator_next(self);
-        else
-            break;
-    }
+void db_iterator_prev(DBIterator* self)
+{
+    if (!self->valid)
+        return;
 
-    if (ret <= 0)
-    {
-        self->use_memtable = 1;
-        self->use_files = 0;
-    }
-    else
-    {
-        self->use_memtable = 0;
-        self->use_files = 1;
-    }
+    if (!self->reverse)
+        _db_iterator_position(self, self->key, 1);
+
+    _db_iterator_skip(self);
+    _db_iterator_find(self);
 }
 
 int db_iterator_valid(DBIterator* self)
 {
-    return (self->valid || !self->list_end || (self->has_imm && !self->imm_list_end));
+    return self->valid;
 }
 
 Variant* db_iterator_key(DBIterator* self)
 {
-    if (self->use_files)
-        return self->current->current->key;
     return self->key;
 }
 
 Variant* db_iterator_value(DBIterator* self)
 {
-    if (self->use_files)
-        return self->current->current->value;
-    return self->value;
+    Variant* value = _db_iterator_raw_value(self);
+
+    if (!self->db->sst->options.with_ttl)
+        return value;
+
+    // A view on the user part of the value
+    self->ttl_value = *value;
+    self->ttl_value.length = ttl_value_length(value);
+
+    return &self->ttl_value;
 }
@@ -6,6 +6,7 @@
 #include "variant.h"
 #include "memtable.h"
 #include "merger.h"
+#include "options.h"
 
 
 // the following macro allows the user to
@@ -61,55 +62,100 @@ typedef struct _db {
 
 DB* db_open(const char *basedir);
 DB* db_open_ex(const char *basedir, uint64_t cache_size);
+DB* db_open_options(const char *basedir, const Options* options);
 
 void db_close(DB* self);
 int db_add(DB* self, Variant* key, Variant* value);
+int db_add_ttl(DB* self, Variant* key, Variant* value, uint32_t ttl);
 int db_get(DB* self, Variant* key, Variant* value);
-int db_remove(DB* self, Variant* key);
 
+// Looks up many keys at once, sharing the work of finding them in the sst
+// files. statuses[i] is set to what db_get() would return for keys[i], and
+// values[i] to its value; the number of keys found is returned.
+int db_multi_get(DB* self, uint32_t num_keys, Variant** keys, Variant** values, int* statuses);
+
+// A value returned by db_get_pinned(). value is read-only and points
+// either into the sst block or blob file holding it, kept alive until
+// db_release_pinned(), or into buffer for the values of the memtables,
+// which are freed as soon as they are overwritten. Reusing the same
+// PinnedValue for many gets also reuses buffer, so they do not allocate.
+typedef struct _pinned_value {
+    Variant value;
+    Variant* buffer;
+    SSTPin pin;
+} PinnedValue;
+
+PinnedValue* pinned_value_new(void);
+void pinned_value_free(PinnedValue* self); // must have been released
+
+// Same as db_get() without copying the value. A previous value still
+// pinned by value is released first.
+int db_get_pinned(DB* self, Variant* key, PinnedValue* value);
+void db_release_pinned(DB* self, PinnedValue* value);
+int db_remove(DB* self, Variant* key);
+int db_delete_range(DB* self, Variant* begin, Variant* end);
+
+/*
+ * The iterator merges the memtable, the immutable memtable and the files
+ * of every level, each of them positioned on the first key >= the current
+ * one, or on the last key <= it when going backwards. The newest version
+ * of a key wins: the one of the memtable, then of the immutable memtable,
+ * then of the files (see LoserTree). Turning around repositions all the
+ * sources around the current key.
+ *
+ * With bounds (see IteratorOptions) only the files overlapping them are
+ * gone through, and their blocks only up to the bounds.
+ */
 typedef struct _db_iterator {
     DB* db;
+    const Comparator* comparator;
     unsigned valid:1;
-
-    unsigned use_memtable:1;
-    unsigned use_files:1;
+    unsigned reverse:1;
     unsigned has_imm:1;
 
-    Heap* minheap;
-    Vector* iterators;
+    LoserTree* tree;
+    Vector* files;           // SSTMetadata* pinned by the iterator
+    Vector* iterators;       // ChainedIterator* over the files of the levels
+    Vector* range_del_files; // SSTMetadata* holding range tombstones
+    Vector* blobs;           // BlobFile* the files may refer to, pinned as well
 
-    SkipNode* node;
-    SkipNode* imm_node;
-    SkipNode* prev;
-    SkipNode* imm_prev;
+    Variant* lower_bound;
+    Variant* upper_bound;
 
     SkipList* list;
     SkipList* imm_list;
 
-    unsigned list_end:1;
-    unsigned imm_list_end:1;
-    unsigned advance;
-
-#define ADV_MEM 1
-#define ADV_IMM 2
+    // The header of the list once there is no key left in the direction
+    // of the iteration
+    SkipNode* node;
+    SkipNode* imm_node;
 
-    Variant* sl_key;
-    Variant* sl_value;
+    int source;
 
-    Variant* isl_key;
-    Variant* isl_value;
+#define SOURCE_MEM   0
+#define SOURCE_IMM   1
+#define SOURCE_FILES 2
 
     Variant* key;
-    Variant* value;
+    Variant* value;    // read from one of the memtables
+    Variant ttl_value; // returned by db_iterator_value() with with_ttl
 
-    ChainedIterator* current;
+    ChainedIterator* current; // holding the key when read from the files
 } DBIterator;
 
 DBIterator* db_iterator_new(DB* self);
+DBIterator* db_iterator_new_options(DB* self, const IteratorOptions* options);
 void db_iterator_free(DBIterator* self);
 
 void db_iterator_seek(DBIterator* self, Variant* key);
+void db_iterator_seek_to_first(DBIterator* self);
+
+// Positions on the last key <= key
+void db_iterator_seek_for_prev(DBIterator* self, Variant* key);
+void db_iterator_seek_to_last(DBIterator* self);
+
 void db_iterator_next(DBIterator* self);
+void db_iterator_prev(DBIterator* self);
 int db_iterator_valid(DBIterator* self);
 
 Variant* db_iterator_key(DBIterator* self);
@@ -1,10 +1,13 @@
+#define _GNU_SOURCE
 #define _BSD_SOURCE
+#include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <sys/mman.h>
 #include "indexer.h"
 #include "file.h"
@@ -15,6 +18,9 @@ File* file_new(void)
     self->fd = -1;
     self->offset = self->map_size = 0;
     self->base = self->limit = self->current = NULL;
+    self->buffer = NULL;
+    self->buffered = 0;
+    self->direct = 0;
     return self;
 }
 
@@ -45,9 +51,48 @@ int sequential_file_new(File* self)
     if ((self->fd = open(self->filename, O_RDONLY)) < 0)
         return 0;
 
+    self->map_size = file_size(self);
+    return 1;
+}
+
+int file_read_at(File* self, uint64_t offset, size_t length, char* data)
+{
+    while (length > 0)
+    {
+        ssize_t ret = pread(self->fd, data, length, offset);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0)
+        {
+            ERROR("Unable to read %zu bytes at %" PRIu64 " of %s: %s", length, offset,
+                  self->filename, ret < 0 ? strerror(errno) : "end of file");
+            return 0;
+        }
+
+        data += ret;
+        offset += ret;
+        length -= ret;
+    }
+
     return 1;
 }
 
+void file_prefetch(File* self, uint64_t offset, size_t length)
+{
+    if (self->base)
+    {
+        // madvise() wants the address aligned to a page
+        uintptr_t pagesize = sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t)(self->base + offset) & ~(pagesize - 1);
+
+        madvise((void*)start, (uintptr_t)(self->base + offset) - start + length, MADV_WILLNEED);
+    }
+    else if (self->fd != -1)
+        posix_fadvise(self->fd, offset, length, POSIX_FADV_WILLNEED);
+}
+
 int mmapped_file_new(File* self)
 {
     if ((self->fd = open(self->filename, O_RDONLY)) < 0)
@@ -69,6 +114,166 @@ int mmapped_file_new(File* self)
     return 1;
 }
 
+int direct_file_new(File* self, uint64_t expected_size)
+{
+    int flags = O_CREAT | O_WRONLY | O_TRUNC;
+
+    // Not every filesystem supports O_DIRECT (e.g. tmpfs)
+    self->direct = 1;
+
+    if ((self->fd = open(self->filename, flags | O_DIRECT, 0644)) < 0)
+    {
+        self->direct = 0;
+
+        if ((self->fd = open(self->filename, flags, 0644)) < 0)
+            return 0;
+    }
+
+    if (posix_memalign((void**)&self->buffer, DIRECT_IO_ALIGNMENT, DIRECT_IO_BUFFER_SIZE) != 0)
+        PANIC("NULL allocation");
+
+    self->offset = self->map_size = 0;
+    self->buffered = 0;
+    self->base = self->limit = self->current = NULL;
+
+    // The size is kept so a crash leaves no garbage at the end of the file
+    if (expected_size > 0 &&
+        fallocate(self->fd, FALLOC_FL_KEEP_SIZE, 0, expected_size) < 0)
+        DEBUG("Unable to preallocate %s: %s", self->filename, strerror(errno));
+
+    return 1;
+}
+
+int appendable_file_new(File* self)
+{
+    if ((self->fd = open(self->filename, O_CREAT | O_WRONLY | O_APPEND, 0644)) < 0)
+        return 0;
+
+    self->offset = file_size(self);
+    self->map_size = 0;
+    self->base = self->limit = self->current = NULL;
+
+    return 1;
+}
+
+int file_append_sync(File* self, const char* src, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(self->fd, src, length);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+        {
+            ERROR("Unable to write %s: %s", self->filename, strerror(errno));
+            return 0;
+        }
+
+        self->offset += n;
+        src += n;
+        length -= n;
+    }
+
+    if (fdatasync(self->fd) < 0)
+    {
+        ERROR("Unable to sync %s: %s", self->filename, strerror(errno));
+        return 0;
+    }
+
+    return 1;
+}
+
+// Writes the buffer at the end of the file. The last write of a direct file
+// is padded to the alignment, file_close() truncates the padding.
+static int _flush_buffer(File* self)
+{
+    size_t length = self->buffered;
+
+    if (self->direct)
+    {
+        length = (length + DIRECT_IO_ALIGNMENT - 1) & ~((size_t)DIRECT_IO_ALIGNMENT - 1);
+        memset(self->buffer + self->buffered, 0, length - self->buffered);
+    }
+
+    size_t written = 0;
+
+    while (written < length)
+    {
+        ssize_t n = pwrite(self->fd, self->buffer + written, length - written, self->offset + written);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        // Some filesystems only refuse O_DIRECT when writing
+        if (n < 0 && errno == EINVAL && self->direct)
+        {
+            INFO("Direct writes not supported for %s", self->filename);
+            fcntl(self->fd, F_SETFL, fcntl(self->fd, F_GETFL) & ~O_DIRECT);
+            self->direct = 0;
+            length = self->buffered;
+            continue;
+        }
+
+        if (n <= 0)
+        {
+            ERROR("Unable to write %s: %s", self->filename, strerror(errno));
+            return 0;
+        }
+
+        written += n;
+    }
+
+    self->offset += self->buffered;
+    self->buffered = 0;
+
+    return 1;
+}
+
+static int _direct_append(File* self, const char* src, size_t length)
+{
+    while (length > 0)
+    {
+        size_t n = DIRECT_IO_BUFFER_SIZE - self->buffered;
+
+        if (n > length)
+            n = length;
+
+        memcpy(self->buffer + self->buffered, src, n);
+        self->buffered += n;
+        src += n;
+        length -= n;
+
+        if (self->buffered == DIRECT_IO_BUFFER_SIZE && !_flush_buffer(self))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int _direct_close(File* self)
+{
+    int ret = _flush_buffer(self);
+
+    // Drop the padding of the last write and the unused preallocation
+    if (ftruncate(self->fd, self->offset) < 0)
+        ret = 0;
+
+    fdatasync(self->fd);
+
+    if (close(self->fd) < 0)
+        ret = 0;
+
+    free(self->buffer);
+
+    self->fd = -1;
+    self->buffer = NULL;
+    self->direct = 0;
+
+    return ret;
+}
+
 uint64_t file_size(File* self)
 {
     struct stat s;
@@ -129,6 +334,9 @@ int _map_new_region(File* self)
 
 int file_append_raw(File* self, const char* src, size_t length)
 {
+    if (self->buffer)
+        return _direct_append(self, src, length);
+
     size_t left = length;
 
     while (left > 0)
@@ -158,6 +366,9 @@ int file_append(File* self, Buffer* data)
 
 int file_close(File* self)
 {
+    if (self->buffer)
+        return _direct_close(self);
+
     int ret = 1;
     size_t unused = self->limit - self->current;
 
@@ -15,6 +15,13 @@ typedef struct _file {
     char *current;
 
     size_t map_size;
+
+    // Output files of direct_file_new(): the data goes through an aligned
+    // buffer of DIRECT_IO_BUFFER_SIZE bytes, offset being what has already
+    // been written. direct is set when the page cache is bypassed.
+    char *buffer;
+    size_t buffered;
+    unsigned direct:1;
 } File;
 
 File* file_new(void);
@@ -23,6 +30,26 @@ void file_free(File* self);
 int writable_file_new(File* self);
 int mmapped_file_new(File* self);
 
+// Opens the file for the reads of file_read_at(), map_size being its size
+int sequential_file_new(File* self);
+int file_read_at(File* self, uint64_t offset, size_t length, char* data);
+
+// Starts reading the given range in the background, for the file_read_at()
+// calls or page faults expected soon to find it in the page cache
+void file_prefetch(File* self, uint64_t offset, size_t length);
+
+// Opens an output file written with pwrite() instead of the mmap regions,
+// with O_DIRECT when the filesystem supports it, and preallocates
+// expected_size bytes (0 if unknown)
+int direct_file_new(File* self, uint64_t expected_size);
+
+// Opens the file for file_append_sync(), keeping what it already holds:
+// offset is its size
+int appendable_file_new(File* self);
+
+// Writes the data at the end of the file and waits for it to be on disk
+int file_append_sync(File* self, const char* data, size_t length);
+
 int file_append(File* self, Buffer* data);
 int file_append_raw(File* self, const char* data, size_t length);
 int file_close(File* self);
@@ -10,8 +10,12 @@
 #define STRINGIZE2(x) #x
 #define LINE_STRING STRINGIZE(__LINE__)
 
+// Block types, stored in the trailer of every block. See codec.h
 #define TYPE_NO_COMPRESSION     0
 #define TYPE_SNAPPY_COMPRESSION 1
+#define TYPE_LZ4_COMPRESSION    2
+#define TYPE_ZSTD_COMPRESSION   3
+#define NUM_BLOCK_TYPES         4
 
 #define PRINT
 
@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include "interval_index.h"
+#include "indexer.h"
+#include "utils.h"
+
+IntervalIndex* interval_index_new(const Comparator* comparator)
+{
+    IntervalIndex* self = calloc(1, sizeof(IntervalIndex));
+
+    if (!self)
+        PANIC("NULL allocation");
+
+    self->comparator = comparator;
+
+    return self;
+}
+
+void interval_index_free(IntervalIndex* self)
+{
+    free(self->bounds);
+    free(self->starts);
+    free(self->entries);
+    free(self);
+}
+
+static int _cmp_bounds(const Variant** a, const Variant** b, const Comparator* comparator)
+{
+    return comparator_variant_cmp(comparator, *a, *b);
+}
+
+// Position of the first bound not smaller than key
+static uint32_t _lower_bound(const IntervalIndex* self, const Variant* key)
+{
+    uint32_t left = 0, right = self->num_bounds;
+
+    while (left < right)
+    {
+        uint32_t mid = (left + right) / 2;
+
+        if (comparator_variant_cmp(self->comparator, self->bounds[mid], key) < 0)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+
+    return left;
+}
+
+void interval_index_build(IntervalIndex* self, uint32_t count, Variant** smallest, Variant** largest)
+{
+    uint32_t num_bounds = 0;
+
+    if (2 * count > self->max_bounds)
+    {
+        self->max_bounds = 2 * count;
+        self->bounds = realloc(self->bounds, sizeof(Variant*) * self->max_bounds);
+        self->starts = realloc(self->starts, sizeof(uint32_t) * 2 * self->max_bounds);
+
+        if (!self->bounds || !self->starts)
+            PANIC("NULL allocation");
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        self->bounds[num_bounds++] = smallest[i];
+        self->bounds[num_bounds++] = largest[i];
+    }
+
+    qsort_r(self->bounds, num_bounds, sizeof(Variant*),
+            (int (*)(const void*, const void*, void*))_cmp_bounds, (void*)self->comparator);
+
+    self->num_bounds = 0;
+
+    for (uint32_t i = 0; i < num_bounds; i++)
+    {
+        if (self->num_bounds == 0 ||
+            comparator_variant_cmp(self->comparator, self->bounds[self->num_bounds - 1], self->bounds[i]) != 0)
+            self->bounds[self->num_bounds++] = self->bounds[i];
+    }
+
+    if (self->num_bounds == 0)
+        return;
+
+    // A range covers the slots from the one of its smallest key to the one
+    // of its largest key. They first count their ranges, then point at the
+    // start of their entries.
+    uint32_t num_slots = 2 * self->num_bounds - 1;
+    uint32_t num_entries = 0;
+
+    memset(self->starts, 0, sizeof(uint32_t) * (num_slots + 1));
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t last = 2 * _lower_bound(self, largest[i]);
+
+        for (uint32_t slot = 2 * _lower_bound(self, smallest[i]); slot <= last; slot++)
+            self->starts[slot]++;
+    }
+
+    for (uint32_t slot = 0; slot < num_slots; slot++)
+    {
+        uint32_t n = self->starts[slot];
+        self->starts[slot] = num_entries;
+        num_entries += n;
+    }
+
+    if (num_entries > self->max_entries)
+    {
+        self->max_entries = num_entries;
+        self->entries = realloc(self->entries, sizeof(uint32_t) * self->max_entries);
+
+        if (!self->entries)
+            PANIC("NULL allocation");
+    }
+
+    // Filling the slots moves every start to the end of its slot, which is
+    // where the next one starts
+    for (uint32_t i = count; i-- > 0;)
+    {
+        uint32_t last = 2 * _lower_bound(self, largest[i]);
+
+        for (uint32_t slot = 2 * _lower_bound(self, smallest[i]); slot <= last; slot++)
+            self->entries[self->starts[slot]++] = i;
+    }
+
+    memmove(self->starts + 1, self->starts, sizeof(uint32_t) * num_slots);
+    self->starts[0] = 0;
+}
+
+uint32_t interval_index_find(const IntervalIndex* self, const Variant* key, const uint32_t** positions)
+{
+    uint32_t pos = _lower_bound(self, key);
+    uint32_t slot;
+
+    if (pos < self->num_bounds && comparator_variant_cmp(self->comparator, self->bounds[pos], key) == 0)
+        slot = 2 * pos;
+    else if (pos == 0 || pos == self->num_bounds)
+        return 0;
+    else
+        slot = 2 * pos - 1;
+
+    *positions = self->entries + self->starts[slot];
+    return self->starts[slot + 1] - self->starts[slot];
+}
@@ -0,0 +1,45 @@
+#ifndef __INTERVAL_INDEX_H__
+#define __INTERVAL_INDEX_H__
+
+#include <stdint.h>
+#include "comparator.h"
+#include "variant.h"
+
+/*
+ * Index of closed key ranges [smallest, largest] that may overlap, as the
+ * files of level 0 do. The distinct bounds of the ranges split the keys
+ * into slots: each bound on its own and the gap between two consecutive
+ * ones. Every slot lists the ranges covering it, so finding the ones that
+ * hold a key is a binary search over the bounds and the ranges come out
+ * of the list as they are.
+ *
+ * The index refers to the keys it is built from, and is built again
+ * whenever the ranges change.
+ */
+
+typedef struct _interval_index {
+    const Comparator* comparator;
+
+    uint32_t num_bounds;
+    Variant** bounds;   // ascending
+
+    // Slot 2i is bounds[i], slot 2i+1 the keys between bounds[i] and
+    // bounds[i+1]: its ranges are entries[starts[slot], starts[slot+1]]
+    uint32_t* starts;
+    uint32_t* entries;
+
+    uint32_t max_bounds;
+    uint32_t max_entries;
+} IntervalIndex;
+
+IntervalIndex* interval_index_new(const Comparator* comparator);
+void interval_index_free(IntervalIndex* self);
+
+// Indexes the count ranges of smallest[i], largest[i]. The entries are
+// their positions i, listed from the last range to the first one.
+void interval_index_build(IntervalIndex* self, uint32_t count, Variant** smallest, Variant** largest);
+
+// Points positions at the ranges holding key and returns how many they are
+uint32_t interval_index_find(const IntervalIndex* self, const Variant* key, const uint32_t** positions);
+
+#endif
@@ -12,6 +12,8 @@
 #include "log.h"
 #include "indexer.h"
 #include "skiplist.h"
+#include "memtable.h"
+#include "range_del.h"
 #include "utils.h"
 
 Log* log_new(const char *basedir)
@@ -74,17 +76,43 @@ static void _load_from(const char* filename, SkipList* list)
         uint32_t klen, vlen;
         const char *key, *value, *encode_start;
 
+        if (stop - start >= LOG_RANGE_DEL_TAG_SIZE &&
+            memcmp(start, LOG_RANGE_DEL_TAG, LOG_RANGE_DEL_TAG_SIZE) == 0)
+        {
+            RangeTombstone* tombstone = NULL;
+            const char* next = range_tombstone_decode(start + LOG_RANGE_DEL_TAG_SIZE, stop, &tombstone);
+
+            if (!next)
+                break;
+
+            start = next;
+            memtable_apply_range_del(list, tombstone);
+            deletions++;
+            continue;
+        }
+
+        // A crash may leave the last record cut short: the ones before
+        // it are recovered
         encode_start = start;
-        key = start = get_varint32(start, start + 5, &klen);
+        key = start = get_varint32(start, stop, &klen);
+
+        if (!start || (size_t)(stop - start) <= klen)
+            break;
+
         start += klen;
+        value = start = get_varint32(start, stop, &vlen);
 
-        value = start = get_varint32(start, start + 5, &vlen);
+        if (!start)
+            break;
 
         if (vlen == 0)
             opt = DEL;
         else
             vlen -= 1;
 
+        if ((size_t)(stop - start) < vlen)
+            break;
+
         start += vlen;
 
         if (opt == ADD) additions++;
@@ -108,6 +136,9 @@ static void _load_from(const char* filename, SkipList* list)
     if (unlink(filename) != 0)
         PANIC("Unable to remove log file %s after recovery", filename);
 
+    if (start < stop)
+        ERROR("Log file %s ends with a record cut short", filename);
+
     INFO("%d operations [%d additions, %d deletions] recovered from %s",
          additions + deletions, additions, deletions, filename);
 }
@@ -5,6 +5,12 @@
 #include "config.h"
 #include "skiplist.h"
 
+// Records are encoded as the memtable nodes: <varint klen><key><varint vlen><value>.
+// Range deletions are logged as the non canonical varint encoding of a zero
+// klen, which no point operation produces, followed by the encoded tombstone.
+#define LOG_RANGE_DEL_TAG "\x80\x00"
+#define LOG_RANGE_DEL_TAG_SIZE 2
+
 typedef struct _log {
     File* file;
     size_t file_length;
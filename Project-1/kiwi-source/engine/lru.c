@@ -31,6 +31,18 @@ void lru_free(LRU* self)
     free(self);
 }
 
+static inline void _lru_free_entry(CacheEntry* entry)
+{
+    if (entry->pins > 0)
+    {
+        entry->evicted = 1;
+        return;
+    }
+
+    free(entry->start);
+    free(entry);
+}
+
 static inline void _lru_cleanup(LRU* self)
 {
     CacheEntry *entry, *iterator;
@@ -44,8 +56,7 @@ static inline void _lru_cleanup(LRU* self)
         self->curr_size -= (char*)entry->stop - (char*)entry->start;
         self->num_entries--;
 
-        free(entry->start);
-        free(entry);
+        _lru_free_entry(entry);
 
 
         //if (self->curr_size < (self->max_size * 0.95) && self->num_entries < self->max_entries)
@@ -104,7 +115,17 @@ void lru_release(LRU* self, const LookupKey* key)
         self->curr_size -= (char*)entry->stop - (char*)entry->start;
         self->num_entries--;
 
-        free(entry->start);
-        free(entry);
+        _lru_free_entry(entry);
     }
 }
+
+void lru_pin(LRU* self, CacheEntry* entry)
+{
+    entry->pins++;
+}
+
+void lru_unpin(LRU* self, CacheEntry* entry)
+{
+    if (--entry->pins == 0 && entry->evicted)
+        _lru_free_entry(entry);
+}
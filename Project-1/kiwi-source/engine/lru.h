@@ -20,6 +20,10 @@ typedef struct _cache_entry {
     void *start; // Value
     void *stop;  // Value
 
+    // A pinned entry evicted from the cache is freed by its last unpin
+    uint32_t pins;
+    unsigned evicted:1;
+
     UT_hash_handle hh;
 } CacheEntry;
 
@@ -39,4 +43,8 @@ void lru_set(LRU* self, CacheEntry* entry);
 CacheEntry* lru_get(LRU* self, const LookupKey* key);
 void lru_release(LRU* self, const LookupKey* key);
 
+// Keeps the block of the entry alive until lru_unpin(), even if evicted
+void lru_pin(LRU* self, CacheEntry* entry);
+void lru_unpin(LRU* self, CacheEntry* entry);
+
 #endif
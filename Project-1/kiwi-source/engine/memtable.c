@@ -5,14 +5,15 @@
 #include "utils.h"
 #include "indexer.h"
 
-MemTable* memtable_new(Log* log)
+MemTable* memtable_new(Log* log, const Comparator* comparator)
 {
     MemTable* self = malloc(sizeof(MemTable));
 
     if (!self)
         PANIC("NULL allocation");
 
-    self->list = skiplist_new(SKIPLIST_SIZE);
+    self->comparator = comparator;
+    self->list = skiplist_new(SKIPLIST_SIZE, comparator);
     skiplist_acquire(self->list);
 
     self->needs_compaction = 0;
@@ -32,7 +33,7 @@ void memtable_reset(MemTable* self)
     if (self->list)
         skiplist_release(self->list);
 
-    self->list = skiplist_new(SKIPLIST_SIZE);
+    self->list = skiplist_new(SKIPLIST_SIZE, self->comparator);
     skiplist_acquire(self->list);
 
     log_next(self->log, ++self->lsn);
@@ -107,12 +108,59 @@ int memtable_remove(MemTable* self, const Variant* key)
     return _memtable_edit(self, key, &value, DEL);
 }
 
-int memtable_get(SkipList* list, const Variant *key, Variant* value)
+int memtable_remove_range(MemTable* self, const Variant* begin, const Variant* end)
+{
+    if (comparator_variant_cmp(self->comparator, begin, end) > 0)
+        return 0;
+
+    RangeTombstone* tombstone = range_tombstone_new(begin, end);
+
+    Buffer* record = buffer_new(LOG_RANGE_DEL_TAG_SIZE + begin->length + end->length + 10);
+    buffer_putnstr(record, LOG_RANGE_DEL_TAG, LOG_RANGE_DEL_TAG_SIZE);
+    range_tombstone_encode(tombstone, record);
+
+    self->needs_compaction = log_append(self->log, record->mem, record->length);
+    buffer_free(record);
+
+    memtable_apply_range_del(self->list, tombstone);
+    self->del_count++;
+
+    return 1;
+}
+
+// Returns 1 if one of the range tombstones of the list covers the key
+static int _memtable_range_deleted(SkipList* list, const Variant* key)
+{
+    // Most lists never see a range deletion
+    if (vector_count(list->range_dels) == 0)
+        return 0;
+
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_lock(&list->range_del_lock);
+#endif
+    int ret = range_del_index_covers(list->range_del_index, key);
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_unlock(&list->range_del_lock);
+#endif
+
+    return ret;
+}
+
+// Returns 1 if the memtable knows about the key, storing in opt whether it
+// is still there or it has been deleted. In the latter case the search must
+// not go on in the older sources.
+int memtable_get(SkipList* list, const Variant *key, Variant* value, OPT* opt)
 {
     SkipNode* node = skiplist_lookup(list, key->mem, key->length);
 
     if (!node)
-        return 0;
+    {
+        if (!_memtable_range_deleted(list, key))
+            return 0;
+
+        *opt = DEL;
+        return 1;
+    }
 
     const char* encoded = node->data;
     encoded += varint_length(key->length) + key->length;
@@ -120,14 +168,32 @@ int memtable_get(SkipList* list, const Variant *key, Variant* value)
     uint32_t encoded_len = 0;
     encoded = get_varint32(encoded, encoded + 5, &encoded_len);
 
-    if (encoded_len > 1)
+    if (encoded_len > 0)
+    {
         buffer_putnstr(value, encoded, encoded_len - 1);
+        *opt = ADD;
+    }
     else
-        return 0;
+        *opt = DEL;
 
     return 1;
 }
 
+// Returns 1 if the list holds a point or range deletion for the key
+int memtable_is_deleted(SkipList* list, const Variant* key)
+{
+    SkipNode* node = skiplist_lookup(list, key->mem, key->length);
+
+    if (!node)
+        return _memtable_range_deleted(list, key);
+
+    uint32_t encoded_len = 0;
+    const char* encoded = node->data + varint_length(key->length) + key->length;
+    get_varint32(encoded, encoded + 5, &encoded_len);
+
+    return encoded_len == 0;
+}
+
 int memtable_needs_compaction(MemTable *self)
 {
     return (self->needs_compaction ||
@@ -164,3 +230,51 @@ void memtable_extract_node(SkipNode* node, Variant* key, Variant* value, OPT* op
 //        DEBUG("memtable_extract_node: %.*s %.*s opt: %d", key->length, key->mem, value->length, value->mem, *opt);
     }
 }
+
+// Turns the keys of the list falling inside the tombstone into point
+// deletions and records the tombstone, which from now on hides the keys
+// stored in the older memtables and sst files. The list takes ownership of
+// the tombstone.
+void memtable_apply_range_del(SkipList* list, RangeTombstone* tombstone)
+{
+    SkipNode* node = skiplist_lookup_prev(list, tombstone->begin->mem, tombstone->begin->length);
+
+    while (node && node != list->hdr)
+    {
+        uint32_t klen = 0, vlen = 0;
+        const char* key = get_varint32(node->data, node->data + 5, &klen);
+        get_varint32(key + klen, key + klen + 5, &vlen);
+
+        if (comparator_cmp(list->comparator, key, klen, tombstone->end->mem, tombstone->end->length) > 0)
+            break;
+
+        SkipNode* next = node->forward[0];
+
+        if (vlen > 0)
+        {
+            size_t length = varint_length(klen) + klen + 1;
+            char *mem = malloc(length);
+
+            char *node_key = encode_varint32(mem, klen);
+            memcpy(node_key, key, klen);
+            encode_varint32(node_key + klen, 0);
+
+            // The old data is released by the skiplist, so the key must
+            // point to the new copy
+            if (skiplist_insert(list, node_key, klen, DEL, mem) == STATUS_OK_DEALLOC)
+                free(mem);
+        }
+
+        node = next;
+    }
+
+    // Growing the index may move it under the iterators
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_lock(&list->range_del_lock);
+#endif
+    vector_add(list->range_dels, tombstone);
+    range_del_index_add(list->range_del_index, tombstone);
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_unlock(&list->range_del_lock);
+#endif
+}
@@ -4,9 +4,11 @@
 #include "skiplist.h"
 #include "variant.h"
 #include "log.h"
+#include "range_del.h"
 
 typedef struct _memtable {
     SkipList* list;
+    const Comparator* comparator; // of the lists
 
     int lsn;
     Log* log;
@@ -16,17 +18,20 @@ typedef struct _memtable {
     uint32_t add_count;
 } MemTable;
 
-MemTable* memtable_new(Log* log);
+MemTable* memtable_new(Log* log, const Comparator* comparator);
 void memtable_reset(MemTable* self);
 void memtable_free(MemTable* self);
 
 int memtable_add(MemTable* self, const Variant *key, const Variant *value);
 int memtable_remove(MemTable* self, const Variant* key);
-int memtable_get(SkipList* list, const Variant *key, Variant* value);
+int memtable_remove_range(MemTable* self, const Variant* begin, const Variant* end);
+int memtable_get(SkipList* list, const Variant *key, Variant* value, OPT* opt);
+int memtable_is_deleted(SkipList* list, const Variant* key);
 
 
 // Utility function
 int memtable_needs_compaction(MemTable* self);
 void memtable_extract_node(SkipNode* node, Variant* key, Variant* value, OPT* opt);
+void memtable_apply_range_del(SkipList* list, RangeTombstone* tombstone);
 
 #endif
@@ -1,5 +1,4 @@
 #include <assert.h>
-#include <limits.h>
 #include "compaction.h"
 #include "merger.h"
 #include "vector.h"
@@ -13,7 +12,6 @@ FileRange* file_range_new(uint32_t level)
     FileRange* self = calloc(1, sizeof(FileRange));
     self->files = vector_new();
     self->level = level;
-    self->overlaps_from = UINT_MAX;
     return self;
 }
 
@@ -43,80 +41,241 @@ uint64_t file_range_size(FileRange* self)
     return size;
 }
 
-int chained_iterator_comp(ChainedIterator* a, ChainedIterator* b)
+void chained_iterator_init(ChainedIterator* iterator, FileRange* inputs)
+{
+    iterator->files = (SSTMetadata**)vector_data(inputs->files);
+    iterator->num_files = vector_count(inputs->files);
+    iterator->pos = 0;
+    iterator->current = sst_loader_iterator((*(iterator->files + iterator->pos++))->loader);
+
+    while (!iterator->current->valid && iterator->pos < iterator->num_files)
+    {
+        sst_loader_iterator_free(iterator->current);
+        iterator->current = sst_loader_iterator((*(iterator->files + iterator->pos++))->loader);
+    }
+}
+
+ChainedIterator* chained_iterator_new(uint32_t num_files, SSTMetadata** files)
+{
+    ChainedIterator* iterator = calloc(1, sizeof(ChainedIterator));
+
+    if (!iterator)
+        PANIC("NULL allocation");
+
+    iterator->files = files;
+    iterator->num_files = num_files;
+    return iterator;
+}
+
+void chained_iterator_free(ChainedIterator* iterator)
+{
+    if (iterator->current)
+        sst_loader_iterator_free(iterator->current);
+
+    free(iterator->files);
+    free(iterator);
+}
+
+// Replaces the current iterator with the one of the file at index
+static void _chained_iterator_set(ChainedIterator* iterator, uint32_t index, SSTLoaderIterator* current)
 {
-    assert(a->current->valid && b->current->valid);
+    if (iterator->current)
+        sst_loader_iterator_free(iterator->current);
 
-    int ret = string_cmp(a->current->key->mem, b->current->key->mem,
-                         a->current->key->length, b->current->key->length);
+    iterator->current = current;
+    iterator->pos = index + 1;
+
+    current->lower_bound = iterator->lower_bound;
+    current->upper_bound = iterator->upper_bound;
+}
+
+void chained_iterator_seek(ChainedIterator* iterator, Variant* key)
+{
+    uint32_t left = 0, right = iterator->num_files - 1;
 
-    // If equals sort by level
-    if (ret == 0)
+    // The first file whose keys are not all smaller than key
+    while (key && left < right)
     {
-        ret = a->current->loader->level - b->current->loader->level;
+        uint32_t mid = (left + right) / 2;
 
-        if (ret == 0)
-            ret = b->current->loader->filenum - a->current->loader->filenum;
+        if (comparator_variant_cmp(iterator->files[mid]->loader->comparator, iterator->files[mid]->largest_key, key) < 0)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+
+    _chained_iterator_set(iterator, left, sst_loader_iterator_seek(iterator->files[left]->loader, key));
+
+    while (!iterator->current->valid && iterator->pos < iterator->num_files)
+        _chained_iterator_set(iterator, iterator->pos, sst_loader_iterator(iterator->files[iterator->pos]->loader));
+}
+
+void chained_iterator_seek_for_prev(ChainedIterator* iterator, Variant* key)
+{
+    uint32_t left = 0, right = iterator->num_files - 1;
+
+    // The last file whose keys are not all larger than key
+    while (key && left < right)
+    {
+        uint32_t mid = (left + right + 1) / 2;
 
-        if (ret < 0)
-            b->skip = 1;
+        if (comparator_variant_cmp(iterator->files[mid]->loader->comparator, iterator->files[mid]->smallest_key, key) <= 0)
+            left = mid;
         else
-            a->skip = 1;
+            right = mid - 1;
     }
 
-    return ret;
+    if (!key)
+        left = iterator->num_files - 1;
+
+    _chained_iterator_set(iterator, left, sst_loader_iterator_seek_for_prev(iterator->files[left]->loader, key));
+
+    while (!iterator->current->valid && iterator->pos > 1)
+        _chained_iterator_set(iterator, iterator->pos - 2,
+                              sst_loader_iterator_seek_to_last(iterator->files[iterator->pos - 2]->loader));
 }
 
-void chained_iterator_init(ChainedIterator* iterator, FileRange* inputs)
+void chained_iterator_next(ChainedIterator* iterator)
 {
-    iterator->files = (SSTMetadata**)vector_data(inputs->files);
-    iterator->num_files = vector_count(inputs->files);
-    iterator->pos = 0;
-    iterator->skip = 0;
-    iterator->overlaps_from = inputs->overlaps_from;
-    iterator->current = sst_loader_iterator((*(iterator->files + iterator->pos++))->loader);
+    sst_loader_iterator_next(iterator->current);
+
+    while (!iterator->current->valid && iterator->pos < iterator->num_files)
+        _chained_iterator_set(iterator, iterator->pos, sst_loader_iterator(iterator->files[iterator->pos]->loader));
 }
 
-ChainedIterator* chained_iterator_new(uint32_t num_files, SSTMetadata** files)
+void chained_iterator_prev(ChainedIterator* iterator)
 {
-    ChainedIterator* iterator = calloc(1, sizeof(ChainedIterator));
-    iterator->files = files;
-    iterator->num_files = num_files;
-    iterator->current = sst_loader_iterator((*(iterator->files + iterator->pos++))->loader);
-    return iterator;
+    sst_loader_iterator_prev(iterator->current);
+
+    // pos - 1 is the file of the current iterator
+    while (!iterator->current->valid && iterator->pos > 1)
+        _chained_iterator_set(iterator, iterator->pos - 2,
+                              sst_loader_iterator_seek_to_last(iterator->files[iterator->pos - 2]->loader));
 }
 
-ChainedIterator* chained_iterator_new_seek(uint32_t num_files, SSTMetadata** files, Variant* key)
+// Returns 1 if leaf a wins its match against leaf b
+static inline int _loser_tree_beats(LoserTree* self, uint32_t a, uint32_t b)
 {
-    ChainedIterator* iterator = calloc(1, sizeof(ChainedIterator));
-    iterator->files = files;
-    iterator->num_files = num_files;
-    iterator->current = sst_loader_iterator_seek((*(iterator->files + iterator->pos++))->loader, key);
+    SSTLoaderIterator* x = self->leaves[a]->current;
+    SSTLoaderIterator* y = self->leaves[b]->current;
 
-    DEBUG("Creating a chained iterator of %d files (seek: %.*s)", num_files, key->length, key->mem);
-    for (int i = 0; i < num_files; i++)
-        DEBUG("  => %d", files[i]->filenum);
-    return iterator;
+    if (!y->valid)
+        return 1;
+
+    if (!x->valid)
+        return 0;
+
+    int ret = comparator_variant_cmp(self->comparator, x->key, y->key);
+
+    if (ret != 0)
+        return self->reverse ? ret > 0 : ret < 0;
+
+    // The newest version of a key comes first
+    if (x->loader->level != y->loader->level)
+        return x->loader->level < y->loader->level;
+
+    return x->loader->filenum > y->loader->filenum;
 }
 
-void chained_iterator_free(ChainedIterator* iterator)
+// Plays the matches of the subtree below node, returns its winner. The
+// leaves are the nodes k to 2k - 1.
+static uint32_t _loser_tree_build(LoserTree* self, uint32_t node)
 {
-    free(iterator->files);
-    free(iterator);
+    if (node >= self->k)
+        return node - self->k;
+
+    uint32_t a = _loser_tree_build(self, node * 2);
+    uint32_t b = _loser_tree_build(self, node * 2 + 1);
+
+    if (_loser_tree_beats(self, a, b))
+    {
+        self->nodes[node] = b;
+        return a;
+    }
+
+    self->nodes[node] = a;
+    return b;
+}
+
+LoserTree* loser_tree_new(uint32_t k, ChainedIterator** leaves, const Comparator* comparator)
+{
+    LoserTree* self = malloc(sizeof(LoserTree));
+
+    if (!self)
+        PANIC("NULL allocation");
+
+    self->k = k;
+    self->reverse = 0;
+    self->comparator = comparator;
+    self->leaves = leaves;
+    self->nodes = malloc(sizeof(uint32_t) * (k > 0 ? k : 1));
+
+    if (!self->nodes)
+        PANIC("NULL allocation");
+
+    if (k > 0)
+        self->nodes[0] = _loser_tree_build(self, 1);
+
+    return self;
+}
+
+void loser_tree_rebuild(LoserTree* self, int reverse)
+{
+    self->reverse = reverse;
+
+    if (self->k > 0)
+        self->nodes[0] = _loser_tree_build(self, 1);
+}
+
+void loser_tree_free(LoserTree* self)
+{
+    if (!self)
+        return;
+
+    free(self->nodes);
+    free(self);
+}
+
+ChainedIterator* loser_tree_top(LoserTree* self)
+{
+    if (self->k == 0)
+        return NULL;
+
+    ChainedIterator* winner = self->leaves[self->nodes[0]];
+    return winner->current->valid ? winner : NULL;
+}
+
+void loser_tree_replay(LoserTree* self)
+{
+    uint32_t winner = self->nodes[0];
+
+    for (uint32_t node = (winner + self->k) / 2; node > 0; node /= 2)
+    {
+        if (_loser_tree_beats(self, self->nodes[node], winner))
+        {
+            uint32_t loser = winner;
+            winner = self->nodes[node];
+            self->nodes[node] = loser;
+        }
+    }
+
+    self->nodes[0] = winner;
 }
 
 void merge_iterator_free(MergeIterator *self)
 {
     ChainedIterator* curr = self->iterators;
 
-    while (curr < self->iterators + self->minheap->allocated)
+    while (curr < self->iterators + self->num_inputs)
     {
         sst_loader_iterator_free(curr->current);
         curr++;
     }
 
     free(self->iterators);
-    heap_free(self->minheap);
+    free(self->tree->leaves);
+    loser_tree_free(self->tree);
+    buffer_free(self->last_key);
     free(self);
 }
 
@@ -124,8 +283,6 @@ MergeIterator* merge_iterator_new(struct _compaction* comp)
 {
     MergeIterator* self = malloc(sizeof(MergeIterator));
 
-    self->overlap_check = 0;
-
     FileRange* inputs1 = comp->current_range;
     FileRange* inputs2 = comp->parent_range;
 
@@ -161,13 +318,6 @@ MergeIterator* merge_iterator_new(struct _compaction* comp)
             curr->files = (SSTMetadata**)vector_data(inputs1->files) + i;
             curr->num_files = 1;
             curr->pos = 0;
-            curr->skip = 0;
-
-            if (i >= inputs1->overlaps_from)
-                curr->overlaps_from = 0;
-            else
-                curr->overlaps_from = UINT_MAX;
-
             curr->current = sst_loader_iterator((*(curr->files + curr->pos++))->loader);
             curr++;
             i++;
@@ -176,14 +326,23 @@ MergeIterator* merge_iterator_new(struct _compaction* comp)
     else
         chained_iterator_init(curr++, inputs1);
 
-    self->minheap = heap_new(num_inputs, (comparator)chained_iterator_comp);
+    ChainedIterator** leaves = malloc(sizeof(ChainedIterator*) * num_inputs);
+
+    if (!leaves)
+        PANIC("NULL allocation");
 
+    // Files holding only range tombstones have no keys to merge, they just
+    // lose every match
     for (uint32_t i = 0; i < num_inputs; i++)
     {
         INFO("Inputs %d for merge %s", i, (self->iterators + i)->current->loader->file->filename);
-        heap_insert(self->minheap, self->iterators + i);
+        leaves[i] = self->iterators + i;
     }
 
+    self->num_inputs = num_inputs;
+    self->tree = loser_tree_new(num_inputs, leaves, self->compaction->sst->options.comparator);
+    self->last_key = buffer_new(32);
+
     merge_iterator_next(self);
     return self;
 }
@@ -192,56 +351,43 @@ void merge_iterator_next(MergeIterator* self)
 {
     ChainedIterator* iter;
 
-start:
-
     // Let's advance our stalled current chained iterator
-    if (self->current != NULL)
+    if (self->current != NULL && self->valid)
     {
-        iter = self->current;
-        sst_loader_iterator_next(iter->current);
+        Variant* key = self->current->current->key;
 
-        if (iter->current->valid)
-        {
-            iter->skip = 0;
-            heap_insert(self->minheap, iter);
-        }
-        else
-        {
-            // Let's see if we can go on with the chained iterator
-            if (iter->pos < iter->num_files)
-            {
-                // TODO: Maybe a reinitialization would be better
-                sst_loader_iterator_free(iter->current);
-                iter->current = sst_loader_iterator((*(iter->files + iter->pos++))->loader);
-
-                if (iter->pos >= iter->overlaps_from)
-                    self->overlap_check = 1;
-
-                assert(iter->current->valid);
-                heap_insert(self->minheap, iter);
-            }
-        }
+        buffer_clear(self->last_key);
+        buffer_putnstr(self->last_key, key->mem, key->length);
+
+        chained_iterator_next(self->current);
+        loser_tree_replay(self->tree);
     }
 
-    if (heap_pop(self->minheap, (void**)&iter))
+    while ((iter = loser_tree_top(self->tree)) != NULL)
     {
-        assert(iter->current->valid);
+        // The newest version of a key wins first: the ones following it
+        // are shadowed
+        if (self->current != NULL &&
+            comparator_variant_cmp(self->compaction->sst->options.comparator, iter->current->key, self->last_key) == 0)
+        {
+            compaction_drop(self->compaction, iter->current->value, iter->current->opt);
+            chained_iterator_next(iter);
+            loser_tree_replay(self->tree);
+            continue;
+        }
 
         self->current = iter;
         self->valid = 1;
-
-        if (iter->skip == 1)
-            goto start;
+        return;
     }
-    else
-        self->valid = 0;
+
+    self->valid = 0;
 }
 
 int merge_iterator_exceeds_overlap(MergeIterator* self, Variant* key)
 {
     assert(self->current);
-    return (self->overlap_check &&
-            compaction_exceeds_overlap(self->compaction, key));
+    return compaction_exceeds_overlap(self->compaction, key);
 }
 
 int merge_iterator_valid(MergeIterator* self)
@@ -249,6 +395,11 @@ int merge_iterator_valid(MergeIterator* self)
     return self->valid;
 }
 
+SSTLoader* merge_iterator_loader(MergeIterator* self)
+{
+    return self->current->current->loader;
+}
+
 Variant* merge_iterator_key(MergeIterator* self)
 {
     return self->current->current->key;
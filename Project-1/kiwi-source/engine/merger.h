@@ -1,7 +1,6 @@
 #ifndef __MERGER_H__
 #define __MERGER_H__
 
-#include "heap.h"
 #include "sst.h"
 #include "sst_loader.h"
 
@@ -10,7 +9,6 @@ typedef struct _file_range {
     Variant* largest_key;
     Vector* files;
     uint32_t level;
-    uint32_t overlaps_from;
 } FileRange;
 
 FileRange* file_range_new(uint32_t level);
@@ -21,25 +19,68 @@ uint64_t file_range_size(FileRange* self);
 typedef struct _chained_iterator {
     uint32_t num_files;
     uint32_t pos;
-    uint32_t overlaps_from;
-    unsigned skip:1;
     SSTMetadata** files;
     SSTLoaderIterator* current;
+
+    // Handed to the iterators of the files, see SSTLoaderIterator
+    Variant* lower_bound;
+    Variant* upper_bound;
 } ChainedIterator;
 
-int chained_iterator_comp(ChainedIterator* a, ChainedIterator* b);
+// Iterates over files sorted by key and not overlapping, taking ownership
+// of the array. It has to be positioned with one of the seeks first.
 ChainedIterator* chained_iterator_new(uint32_t num_files, SSTMetadata** files);
-ChainedIterator* chained_iterator_new_seek(uint32_t num_files, SSTMetadata** files, Variant* key);
 void chained_iterator_free(ChainedIterator* iterator);
 
+// Positions on the first key >= key, or on the first key with a NULL key
+void chained_iterator_seek(ChainedIterator* iterator, Variant* key);
+
+// Positions on the last key <= key, or on the last key with a NULL key
+void chained_iterator_seek_for_prev(ChainedIterator* iterator, Variant* key);
+
+// Moves to the next key, going on with the next files once the current
+// one is over. The iterator is exhausted when current is no longer valid.
+void chained_iterator_next(ChainedIterator* iterator);
+void chained_iterator_prev(ChainedIterator* iterator);
+
+/*
+ * Tournament tree merging k chained iterators. The leaves are the
+ * iterators, every inner node keeps the loser of the match played there
+ * and nodes[0] the overall winner: the iterator with the smallest key,
+ * the newest one (lowest level, then highest filenum) among equal keys.
+ * Exhausted iterators lose every match. A reverse tree merges iterators
+ * going backwards: the largest key wins.
+ *
+ * Once the winner has been advanced loser_tree_replay() only replays the
+ * matches on its path to the root, one comparison per level.
+ */
+typedef struct _loser_tree {
+    uint32_t k;
+    unsigned reverse:1;
+    const Comparator* comparator;
+    uint32_t* nodes;
+    ChainedIterator** leaves;
+} LoserTree;
+
+LoserTree* loser_tree_new(uint32_t k, ChainedIterator** leaves, const Comparator* comparator);
+void loser_tree_free(LoserTree* self);
+
+// Plays every match again once all the iterators have been repositioned
+void loser_tree_rebuild(LoserTree* self, int reverse);
+
+// Returns the winner, or NULL once every iterator is exhausted
+ChainedIterator* loser_tree_top(LoserTree* self);
+void loser_tree_replay(LoserTree* self);
+
 struct _compaction;
 
 typedef struct _merge_iterator {
     unsigned valid:1;
-    unsigned overlap_check:1;
-    Heap* minheap;
+    uint32_t num_inputs;
+    LoserTree* tree;
     ChainedIterator* iterators; //array of iterators
     ChainedIterator* current;
+    Variant* last_key; // of current, to drop the older versions of it
     struct _compaction* compaction;
 } MergeIterator;
 
@@ -52,5 +93,6 @@ int merge_iterator_exceeds_overlap(MergeIterator* self, Variant *key);
 Variant* merge_iterator_key(MergeIterator* self);
 Variant* merge_iterator_value(MergeIterator* self);
 OPT merge_iterator_opt(MergeIterator* self);
+SSTLoader* merge_iterator_loader(MergeIterator* self);
 
 #endif
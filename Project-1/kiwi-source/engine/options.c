@@ -0,0 +1,45 @@
+#include <stdlib.h>
+#include "options.h"
+#include "indexer.h"
+
+Options* options_new(void)
+{
+    Options* self = calloc(1, sizeof(Options));
+
+    if (!self)
+        PANIC("NULL allocation");
+
+    self->comparator = comparator_bytewise();
+    self->cache_size = LRU_CACHE_SIZE;
+
+    self->level_base_size = LEVEL_BASE_SIZE;
+    self->level_multiplier = LEVEL_MULTIPLIER;
+    self->dynamic_level_bytes = DYNAMIC_LEVEL_BYTES;
+    self->builder_threads = BUILDER_THREADS;
+    self->direct_writes = DIRECT_WRITES;
+    self->pread_reads = PREAD_READS;
+    self->block_hash_index = BLOCK_HASH_INDEX;
+    self->index_partition_size = INDEX_PARTITION_SIZE;
+    self->min_blob_size = MIN_BLOB_SIZE;
+    self->blob_gc_threshold = BLOB_GC_THRESHOLD;
+
+    for (int level = 0; level < MAX_LEVELS; level++)
+    {
+        self->block_size[level] = BLOCK_SIZE;
+        self->restart_interval[level] = RESTART_INTERVAL;
+        self->compression[level] = DEFAULT_COMPRESSION;
+    }
+
+    self->zstd_dict_size = ZSTD_DICT_SIZE;
+
+    self->compaction_filter = NULL;
+    self->compaction_filter_state = NULL;
+    self->with_ttl = 0;
+
+    return self;
+}
+
+void options_free(Options* self)
+{
+    free(self);
+}
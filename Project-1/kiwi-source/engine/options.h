@@ -0,0 +1,83 @@
+#ifndef __OPTIONS_H__
+#define __OPTIONS_H__
+
+#include <stdint.h>
+#include "comparator.h"
+#include "config.h"
+#include "variant.h"
+
+// A compaction filter is called for every value surviving a compaction
+// (deletions are not shown) with the level the compaction started from. It
+// may keep the value, remove it or replace it with the one written into
+// new_value. With with_ttl the filter only sees the user part of the value,
+// and the expired values never reach it.
+
+typedef enum {
+    FILTER_KEEP,
+    FILTER_REMOVE,
+    FILTER_CHANGE_VALUE
+} FilterDecision;
+
+typedef FilterDecision (*CompactionFilter)(void* state, int level, const Variant* key,
+                                           const Variant* value, Variant* new_value);
+
+// Tunables that can be chosen when the database is opened. A copy of the
+// structure is kept by the SST so the caller can free its own instance as
+// soon as db_open_options() returns.
+
+typedef struct _options {
+    // Order of the keys, see comparator.h. It is fixed when the database
+    // is created.
+    const Comparator* comparator;
+
+    uint64_t cache_size;        // bytes of uncompressed blocks kept in the LRU
+
+    // Level sizing. With dynamic_level_bytes the targets are derived from the
+    // size of the last level, otherwise level 1 is level_base_size bytes and
+    // every following level is level_multiplier times bigger.
+    uint64_t level_base_size;
+    double level_multiplier;
+    unsigned dynamic_level_bytes:1;
+
+    int builder_threads;        // see BUILDER_THREADS
+    unsigned direct_writes:1;   // see DIRECT_WRITES
+    unsigned pread_reads:1;     // see PREAD_READS
+
+    // Data blocks of the files written in every level: bigger blocks suit
+    // scans, smaller ones point lookups
+    uint32_t block_size[MAX_LEVELS];
+    uint32_t restart_interval[MAX_LEVELS];
+    unsigned block_hash_index:1; // see BLOCK_HASH_INDEX
+    uint32_t index_partition_size; // see INDEX_PARTITION_SIZE
+
+    // Key-value separation, see blob.h: values of at least min_blob_size
+    // bytes (0 disables it) are stored in blob files, and compactions move
+    // the values out of the blob files with more than blob_gc_threshold of
+    // garbage
+    uint32_t min_blob_size;
+    double blob_gc_threshold;
+
+    // Block codec (TYPE_*_COMPRESSION) of the files written in every level,
+    // and size of the dictionaries of the zstd ones (0 disables them)
+    uint32_t compression[MAX_LEVELS];
+    size_t zstd_dict_size;
+
+    CompactionFilter compaction_filter; // NULL to keep everything
+    void* compaction_filter_state;      // passed back to the filter as is
+
+    // Values carry an expiration time, see ttl.h
+    unsigned with_ttl:1;
+} Options;
+
+// Bounds of the keys an iterator goes through, see db_iterator_new_options():
+// the lower bound is inclusive, the upper one exclusive and NULL leaves
+// the side open. The iterator keeps a copy of them.
+typedef struct _iterator_options {
+    Variant* iterate_lower_bound;
+    Variant* iterate_upper_bound;
+} IteratorOptions;
+
+Options* options_new(void);
+void options_free(Options* self);
+
+#endif
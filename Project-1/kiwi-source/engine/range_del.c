@@ -0,0 +1,168 @@
+#include <string.h>
+#include "range_del.h"
+#include "indexer.h"
+#include "utils.h"
+
+RangeTombstone* range_tombstone_new(const Variant* begin, const Variant* end)
+{
+    RangeTombstone* self = malloc(sizeof(RangeTombstone));
+
+    if (!self)
+        PANIC("NULL allocation");
+
+    self->begin = buffer_new(begin->length + 1);
+    self->end = buffer_new(end->length + 1);
+
+    buffer_putnstr(self->begin, begin->mem, begin->length);
+    buffer_putnstr(self->end, end->mem, end->length);
+
+    return self;
+}
+
+void range_tombstone_free(RangeTombstone* self)
+{
+    buffer_free(self->begin);
+    buffer_free(self->end);
+    free(self);
+}
+
+int range_tombstone_covers(const RangeTombstone* self, const Comparator* comparator, const Variant* key)
+{
+    return (comparator_variant_cmp(comparator, key, self->begin) >= 0 &&
+            comparator_variant_cmp(comparator, key, self->end) <= 0);
+}
+
+void range_tombstone_encode(const RangeTombstone* self, Buffer* buffer)
+{
+    buffer_putvarint32(buffer, self->begin->length);
+    buffer_putnstr(buffer, self->begin->mem, self->begin->length);
+    buffer_putvarint32(buffer, self->end->length);
+    buffer_putnstr(buffer, self->end->mem, self->end->length);
+}
+
+const char* range_tombstone_decode(const char* p, const char* limit, RangeTombstone** tombstone)
+{
+    Variant begin, end;
+    uint32_t length = 0;
+
+    if (p >= limit)
+        return NULL;
+
+    p = get_varint32(p, limit, &length);
+    if (!p || p + length >= limit)
+        return NULL;
+
+    begin.mem = (char*)p;
+    begin.length = length;
+    p += length;
+
+    p = get_varint32(p, limit, &length);
+    if (!p || p + length > limit)
+        return NULL;
+
+    end.mem = (char*)p;
+    end.length = length;
+    p += length;
+
+    *tombstone = range_tombstone_new(&begin, &end);
+    return p;
+}
+
+void range_del_free(Vector* tombstones)
+{
+    for (uint32_t i = 0; i < vector_count(tombstones); i++)
+        range_tombstone_free((RangeTombstone*)vector_get(tombstones, i));
+
+    vector_free(tombstones);
+}
+
+RangeDelIndex* range_del_index_new(const Comparator* comparator)
+{
+    RangeDelIndex* self = calloc(1, sizeof(RangeDelIndex));
+
+    if (!self)
+        PANIC("NULL allocation");
+
+    self->comparator = comparator;
+    return self;
+}
+
+void range_del_index_free(RangeDelIndex* self)
+{
+    free(self->fragments);
+    free(self);
+}
+
+// Returns the number of ranges starting at or before key
+static uint32_t _range_del_index_upper(const RangeDelIndex* self, const Variant* key)
+{
+    uint32_t lo = 0, hi = self->count;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (comparator_variant_cmp(self->comparator, self->fragments[mid].begin, key) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+void range_del_index_add(RangeDelIndex* self, const RangeTombstone* tombstone)
+{
+    const Comparator* comparator = self->comparator;
+
+    // The ranges overlapping the tombstone are [first, last): the ones not
+    // ending before it and not starting after it
+    uint32_t lo = 0, hi = self->count;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (comparator_variant_cmp(comparator, self->fragments[mid].end, tombstone->begin) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    uint32_t first = lo;
+    uint32_t last = _range_del_index_upper(self, tombstone->end);
+
+    RangeFragment fragment = { tombstone->begin, tombstone->end };
+
+    if (first < last)
+    {
+        if (comparator_variant_cmp(comparator, self->fragments[first].begin, fragment.begin) < 0)
+            fragment.begin = self->fragments[first].begin;
+
+        if (comparator_variant_cmp(comparator, self->fragments[last - 1].end, fragment.end) > 0)
+            fragment.end = self->fragments[last - 1].end;
+    }
+    else if (self->count == self->size)
+    {
+        self->size = self->size ? self->size * 2 : 4;
+        self->fragments = realloc(self->fragments, self->size * sizeof(RangeFragment));
+
+        if (!self->fragments)
+            PANIC("NULL allocation");
+    }
+
+    // The overlapped ranges, if any, are replaced by the merged one
+    memmove(self->fragments + first + 1, self->fragments + last,
+            (self->count - last) * sizeof(RangeFragment));
+
+    self->fragments[first] = fragment;
+    self->count = self->count + 1 - (last - first);
+}
+
+int range_del_index_covers(const RangeDelIndex* self, const Variant* key)
+{
+    uint32_t upper = _range_del_index_upper(self, key);
+
+    return (upper > 0 &&
+            comparator_variant_cmp(self->comparator, key, self->fragments[upper - 1].end) <= 0);
+}
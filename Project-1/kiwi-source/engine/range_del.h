@@ -0,0 +1,59 @@
+#ifndef __RANGE_DEL_H__
+#define __RANGE_DEL_H__
+
+#include "comparator.h"
+#include "variant.h"
+#include "vector.h"
+
+/*
+ * A range tombstone deletes every key in [begin, end] (both inclusive).
+ *
+ * There are no sequence numbers in kiwi, so a tombstone only hides keys
+ * stored in older sources: the memtable converts the keys it already holds
+ * inside the range into point deletions, while an sst file never hides its
+ * own keys, only the ones stored in the files it is newer than (lower
+ * levels, or level 0 files with a smaller filenum).
+ */
+
+typedef struct _range_tombstone {
+    Variant* begin;
+    Variant* end;
+} RangeTombstone;
+
+RangeTombstone* range_tombstone_new(const Variant* begin, const Variant* end);
+void range_tombstone_free(RangeTombstone* self);
+int range_tombstone_covers(const RangeTombstone* self, const Comparator* comparator, const Variant* key);
+
+// Encoding used both by the log and by the meta block of the sst files:
+// <varint begin-length><begin><varint end-length><end>
+void range_tombstone_encode(const RangeTombstone* self, Buffer* buffer);
+const char* range_tombstone_decode(const char* p, const char* limit, RangeTombstone** tombstone);
+
+// Helpers for a Vector of RangeTombstone*
+void range_del_free(Vector* tombstones);
+
+/*
+ * The union of a set of tombstones, kept as sorted and disjoint ranges: the
+ * tombstones covering a key are looked up with a binary search. The ranges
+ * point into the tombstones added, which must outlive the index.
+ */
+typedef struct _range_fragment {
+    const Variant* begin;
+    const Variant* end;
+} RangeFragment;
+
+typedef struct _range_del_index {
+    const Comparator* comparator;
+    RangeFragment* fragments;
+    uint32_t count;
+    uint32_t size;
+} RangeDelIndex;
+
+RangeDelIndex* range_del_index_new(const Comparator* comparator);
+void range_del_index_free(RangeDelIndex* self);
+
+// Merges the tombstone with the ranges it overlaps
+void range_del_index_add(RangeDelIndex* self, const RangeTombstone* tombstone);
+int range_del_index_covers(const RangeDelIndex* self, const Variant* key);
+
+#endif
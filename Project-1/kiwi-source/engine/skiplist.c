@@ -5,13 +5,15 @@
 #include <assert.h>
 #include "skiplist.h"
 #include "config.h"
+#include "comparator.h"
 #include "utils.h"
 #include "indexer.h"
+#include "range_del.h"
 
-#define cmp_lt(node, key, klen) (comparator((const char *)node, key, klen) < 0)
-#define cmp_eq(node, key, klen) (comparator((const char *)node, key, klen) == 0)
+#define cmp_lt(list, node, key, klen, prefix) (_node_cmp(list, node, key, klen, prefix) < 0)
+#define cmp_eq(list, node, key, klen, prefix) (_node_cmp(list, node, key, klen, prefix) == 0)
 
-SkipList* skiplist_new(size_t max_count)
+SkipList* skiplist_new(size_t max_count, const Comparator* comparator)
 {
     int i;
     SkipList* self = calloc(1, sizeof(SkipList));
@@ -20,20 +22,26 @@ SkipList* skiplist_new(size_t max_count)
         PANIC("NULL allocation");
 
     self->max_count = max_count;
+    self->comparator = comparator;
     self->arena = arena_new();
     self->allocated = 0;
+    self->range_dels = vector_new();
+    self->range_del_index = range_del_index_new(comparator);
 
     self->hdr = arena_alloc(self->arena, SKIPNODE_SIZE + SKIPLIST_MAXLEVEL * sizeof(SkipNode*));
     self->level = 0;
 
 #ifdef BACKGROUND_MERGE
     pthread_mutex_init(&self->lock, NULL);
+    pthread_mutex_init(&self->range_del_lock, NULL);
     self->refcount = 0;
 #endif
 
     for (i = 0; i <= SKIPLIST_MAXLEVEL; i++)
         self->hdr->forward[i] = self->hdr;
 
+    self->hdr->backward = self->hdr;
+
     return self;
 }
 
@@ -50,9 +58,11 @@ void skiplist_release(SkipList* self)
 {
 #ifdef BACKGROUND_MERGE
     pthread_mutex_lock(&self->lock);
-    self->refcount--;
+    int refcount = --self->refcount;
+    pthread_mutex_unlock(&self->lock);
 
-    if (self->refcount == 0)
+    // Unlocked first: the lock goes away with the list
+    if (refcount == 0)
     {
         INFO("SkipList refcount is at 0. Freeing up the structure");
 
@@ -65,22 +75,32 @@ void skiplist_release(SkipList* self)
         }
         skiplist_free(self);
     }
-    pthread_mutex_unlock(&self->lock);
 #endif
 }
 
 void skiplist_free(SkipList* self)
 {
     arena_free(self->arena);
+    range_del_free(self->range_dels);
+    range_del_index_free(self->range_del_index);
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_destroy(&self->lock);
+    pthread_mutex_destroy(&self->range_del_lock);
+#endif
     //free(self->hdr);
     free(self);
 }
 
-static inline int comparator(const char *encoded, const char *key, size_t klen)
+// The prefix of the key settles most comparisons without decoding the
+// key of the node
+static inline int _node_cmp(const SkipList* self, const SkipNode* node, const char *key, size_t klen, uint64_t prefix)
 {
+    if (node->prefix != prefix)
+        return (node->prefix < prefix) ? -1 : 1;
+
     uint32_t encoded_len = 0;
-    encoded = get_varint32(encoded, encoded + 5, &encoded_len);
-    return string_cmp(encoded, key, encoded_len, klen);
+    const char* encoded = get_varint32(node->data, node->data + 5, &encoded_len);
+    return comparator_prefix_cmp(self->comparator, prefix, encoded, encoded_len, prefix, key, klen);
 }
 
 static size_t skipnode_size(SkipNode* node)
@@ -98,6 +118,7 @@ static size_t skipnode_size(SkipNode* node)
 
 int skiplist_insert(SkipList* self, const char *key, size_t klen, OPT opt, char *data)
 {
+    uint64_t prefix = comparator_prefix(self->comparator, key, klen);
     int i, new_level;
     SkipNode* update[SKIPLIST_MAXLEVEL];
     SkipNode* x;
@@ -106,14 +127,14 @@ int skiplist_insert(SkipList* self, const char *key, size_t klen, OPT opt, char
     for (i = self->level; i >= 0; i--)
     {
         while (x->forward[i] != self->hdr &&
-               cmp_lt(x->forward[i]->data, key, klen))
+               cmp_lt(self, x->forward[i], key, klen, prefix))
             x = x->forward[i];
         update[i] = x;
     }
 
     x = x->forward[0];
 
-    if (x != self->hdr && cmp_eq(x->data, key, klen))
+    if (x != self->hdr && cmp_eq(self, x, key, klen, prefix))
     {
         void* tmp = x->data;
         self->allocated -= skipnode_size(x);
@@ -143,6 +164,7 @@ int skiplist_insert(SkipList* self, const char *key, size_t klen, OPT opt, char
         PANIC("NULL allocation");
 
     x->data = data;
+    x->prefix = prefix;
     self->allocated += skipnode_size(x);
 
     for (i = 0; i <= new_level; i++)
@@ -151,60 +173,74 @@ int skiplist_insert(SkipList* self, const char *key, size_t klen, OPT opt, char
         update[i]->forward[i] = x;
     }
 
+    x->backward = update[0];
+    x->forward[0]->backward = x;
+
     return STATUS_OK;
 }
 
 SkipNode* skiplist_last(SkipList* self)
 {
+    return self->hdr->backward;
+}
+
+SkipNode* skiplist_first(SkipList* self)
+{
+    return self->hdr->forward[0];
+}
+
+SkipNode* skiplist_lookup_prev(SkipList* self, char* key, size_t klen)
+{
+    uint64_t prefix = comparator_prefix(self->comparator, key, klen);
     int i;
     SkipNode* x = self->hdr;
 
     for (i = self->level; i >= 0; i--)
     {
-        while (x->forward[i] != self->hdr)
+        while (x->forward[i] != self->hdr &&
+               cmp_lt(self, x->forward[i], key, klen, prefix))
             x = x->forward[i];
     }
 
-    return x;
-}
-
-SkipNode* skiplist_first(SkipList* self)
-{
-    return self->hdr->forward[0];
+    x = x->forward[0];
+    if (x != self->hdr/* && cmp_eq(self, x, key, klen, prefix)*/)
+        return x;
+    return NULL;
 }
 
-SkipNode* skiplist_lookup_prev(SkipList* self, char* key, size_t klen)
+SkipNode* skiplist_lookup_floor(SkipList* self, char* key, size_t klen)
 {
+    uint64_t prefix = comparator_prefix(self->comparator, key, klen);
     int i;
     SkipNode* x = self->hdr;
 
     for (i = self->level; i >= 0; i--)
     {
         while (x->forward[i] != self->hdr &&
-               cmp_lt(x->forward[i]->data, key, klen))
+               _node_cmp(self, x->forward[i], key, klen, prefix) <= 0)
             x = x->forward[i];
     }
 
-    x = x->forward[0];
-    if (x != self->hdr/* && cmp_eq(x->data, key, klen)*/)
+    if (x != self->hdr)
         return x;
     return NULL;
 }
 
 SkipNode* skiplist_lookup(SkipList* self, char* key, size_t klen)
 {
+    uint64_t prefix = comparator_prefix(self->comparator, key, klen);
     int i;
     SkipNode* x = self->hdr;
 
     for (i = self->level; i >= 0; i--)
     {
         while (x->forward[i] != self->hdr &&
-               cmp_lt(x->forward[i]->data, key, klen))
+               cmp_lt(self, x->forward[i], key, klen, prefix))
             x = x->forward[i];
     }
 
     x = x->forward[0];
-    if (x != self->hdr && cmp_eq(x->data, key, klen))
+    if (x != self->hdr && cmp_eq(self, x, key, klen, prefix))
         return x;
     return NULL;
 }
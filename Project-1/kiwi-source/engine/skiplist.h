@@ -5,8 +5,11 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include "arena.h"
+#include "comparator.h"
 #include "config.h"
+#include "range_del.h"
 #include "variant.h"
+#include "vector.h"
 
 #define SKIPLIST_MAXLEVEL (15)
 #define SKIPNODE_SIZE (sizeof(SkipNode))
@@ -17,6 +20,8 @@
 
 typedef struct _skipnode {
     char* data;
+    struct _skipnode* backward; // the header for the first node
+    uint64_t prefix;            // comparator_prefix() of the key
     struct _skipnode* forward[1];
 } SkipNode;
 
@@ -34,19 +39,34 @@ typedef struct _skiplist {
     int refcount;
 #endif
 
+    const Comparator* comparator;
+
     // the data structure
     SkipNode* hdr;
     Arena* arena;
+
+    // Range tombstones (RangeTombstone*) hiding keys older than the list,
+    // looked up through their index
+    Vector* range_dels;
+    RangeDelIndex* range_del_index;
+
+#ifdef BACKGROUND_MERGE
+    // The iterators look the tombstones up outside of the writers path
+    pthread_mutex_t range_del_lock;
+#endif
 } SkipList;
 
 #define STATUS_OK         0
 #define STATUS_OK_DEALLOC 1
 
-SkipList* skiplist_new(size_t size);
+SkipList* skiplist_new(size_t size, const Comparator* comparator);
 int skiplist_insert(SkipList* self, const char *key, size_t klen, OPT opt, char *data);
 SkipNode* skiplist_lookup(SkipList* self, char* key, size_t klen);
 SkipNode* skiplist_lookup_prev(SkipList* self, char* key, size_t klen);
 
+// Returns the last node whose key is <= key, or NULL
+SkipNode* skiplist_lookup_floor(SkipList* self, char* key, size_t klen);
+
 
 void skiplist_free(SkipList* self);
 
@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <time.h>
 #include <errno.h>
+#include <dirent.h>
 #include "sst.h"
 #include "memtable.h"
 #include "sst_builder.h"
@@ -16,6 +17,11 @@
 #include "heap.h"
 #include "vector.h"
 #include "compaction.h"
+#include "range_del.h"
+#include "codec.h"
+#include "ttl.h"
+#include "blob.h"
+#include "crc32.h"
 
 static uint64_t _size_for_level(SST* self, uint32_t level)
 {
@@ -62,23 +68,311 @@ static void _print_summary(SST* self)
     }
 }
 
-static double _max_size_for_level(uint32_t level)
+static void _update_level_targets(SST* self)
 {
-    double result = 10 * 1048576.0;
-    while (level > 1)
+    double base = (double)self->options.level_base_size;
+    double multiplier = self->options.level_multiplier;
+
+    if (!self->options.dynamic_level_bytes)
+    {
+        double target = base;
+
+        for (uint32_t level = 1; level < MAX_LEVELS; level++)
+        {
+            self->level_target[level] = target;
+            target *= multiplier;
+        }
+        return;
+    }
+
+    // The last level is the one holding most of the data. Walk upwards from
+    // its actual size dividing by the multiplier until we reach the base
+    // size: that is the first level L0 data should settle in. Every level
+    // above it is kept empty, so its target is 0 and any byte in there makes
+    // the level eligible for a (mostly trivial) compaction downwards.
+    uint32_t base_level = MAX_LEVELS - 1;
+    double size = (double)_size_for_level(self, MAX_LEVELS - 1);
+
+    while (base_level > 1 && size > base)
+    {
+        size /= multiplier;
+        base_level--;
+    }
+
+    for (uint32_t level = 1; level < base_level; level++)
+        self->level_target[level] = 0;
+
+    for (uint32_t level = base_level; level < MAX_LEVELS; level++)
+    {
+        self->level_target[level] = MAX(size, base);
+        size *= multiplier;
+    }
+}
+
+// The range deletions are weighted by the bytes of the next level they are
+// sure to drop, those of the files they cover entirely: one deleting a
+// handful of keys no longer sends the file through every level.
+static double _range_del_density(SST* self, SSTMetadata* meta)
+{
+    const Comparator* comparator = self->options.comparator;
+    SSTLoader* loader = meta->loader;
+    uint64_t covered = 0;
+    Vector* inputs = vector_new();
+
+    for (uint32_t i = 0; i < vector_count(loader->range_dels); i++)
+    {
+        RangeTombstone* tombstone = (RangeTombstone*)vector_get(loader->range_dels, i);
+
+        sst_get_overlapping_inputs(self, meta->level + 1, tombstone->begin,
+                                   tombstone->end, inputs, NULL, NULL);
+
+        for (uint32_t j = 0; j < vector_count(inputs); j++)
+        {
+            SSTMetadata* target = (SSTMetadata*)vector_get(inputs, j);
+
+            if (comparator_variant_cmp(comparator, tombstone->begin, target->smallest_key) <= 0 &&
+                comparator_variant_cmp(comparator, tombstone->end, target->largest_key) >= 0)
+                covered += target->filesize;
+        }
+    }
+
+    vector_free(inputs);
+
+    if (covered == 0)
+        return 0;
+
+    return (double)covered / (double)(covered + meta->filesize);
+}
+
+static double _tombstone_density(SST* self, SSTMetadata* meta)
+{
+    SSTLoader* loader = meta->loader;
+    double density = 0;
+
+    if (loader->num_range_dels > 0)
+        density = _range_del_density(self, meta);
+
+    if (loader->num_entries >= TOMBSTONE_COMPACTION_MIN_ENTRIES)
+        density = MAX(density, (double)loader->num_deletions / (double)loader->num_entries);
+
+    return density;
+}
+
+static void _pick_tombstone_compaction(SST* self)
+{
+    double max_density = TOMBSTONE_COMPACTION_RATIO;
+
+    for (int level = 0; level < MAX_LEVELS - 1; level++)
+    {
+        for (uint32_t i = 0; i < self->num_files[level]; i++)
+        {
+            SSTMetadata* meta = self->files[level][i];
+            double density = _tombstone_density(self, meta);
+
+            if (density >= max_density)
+            {
+                max_density = density;
+                self->comp_file = meta;
+                self->comp_level = level;
+            }
+        }
+    }
+
+    if (self->comp_file)
+    {
+        INFO("Compacting file %d in level %d for its tombstones",
+             self->comp_file->filenum, self->comp_level);
+        self->comp_score = 1;
+    }
+}
+
+// Picks the file holding the values that expired first. Level 0 aside,
+// it is rewritten into its own level: the moves leave such files to the
+// compactions, but nothing ever compacts the last level.
+static void _pick_expired_compaction(SST* self)
+{
+    if (!self->options.with_ttl)
+        return;
+
+    uint64_t now = (uint64_t)get_ustime_sec();
+    uint64_t first = TTL_NEVER;
+
+    for (int level = 1; level < MAX_LEVELS; level++)
+    {
+        for (uint32_t i = 0; i < self->num_files[level]; i++)
+        {
+            SSTMetadata* meta = self->files[level][i];
+            uint64_t expiration = meta->loader->min_expiration;
+
+            if (expiration != TTL_NEVER && expiration <= now &&
+                (first == TTL_NEVER || expiration < first))
+            {
+                first = expiration;
+                self->comp_file = meta;
+                self->comp_level = level;
+            }
+        }
+    }
+
+    if (self->comp_file)
+    {
+        INFO("Rewriting file %d in level %d for its expired values",
+             self->comp_file->filenum, self->comp_level);
+        self->comp_in_place = 1;
+        self->comp_score = 1;
+    }
+}
+
+#ifdef BACKGROUND_MERGE
+// Compacts the file with the most tombstones, if any has enough of them,
+// whatever the scores of the levels
+static void _compact_tombstones(SST* self)
+{
+    self->comp_score = -1;
+    self->comp_file = NULL;
+
+    _pick_tombstone_compaction(self);
+
+    if (self->comp_file)
+        sst_compact(self);
+}
+
+// Same for the file whose values expired first
+static void _compact_expired(SST* self)
+{
+    self->comp_score = -1;
+    self->comp_file = NULL;
+
+    _pick_expired_compaction(self);
+
+    if (self->comp_file)
+        sst_compact(self);
+}
+#endif
+
+static int _allowed_seeks_for(uint64_t filesize)
+{
+    // A probe costs roughly as much as compacting SEEK_COMPACTION_BYTES, so
+    // after that many useless probes merging the file down is cheaper than
+    // keep reading it
+    int seeks = (int)(filesize / SEEK_COMPACTION_BYTES);
+
+    return (seeks < MIN_ALLOWED_SEEKS) ? MIN_ALLOWED_SEEKS : seeks;
+}
+
+// Charges a useless probe to the file. Returns 1 when the file has just
+// run out of seeks and has been queued for a compaction.
+static int _charge_seek(SST* self, SSTMetadata* meta)
+{
+    // Nothing to push the last level into
+    if (meta->level + 1 >= MAX_LEVELS)
+        return 0;
+
+    if (__sync_sub_and_fetch(&meta->allowed_seeks, 1) > 0)
+        return 0;
+
+    // Only the reader reaching zero first queues the file
+    if (!__sync_bool_compare_and_swap(&meta->seek_queued, 0, 1))
+        return 0;
+
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_lock(&self->seek_lock);
+#endif
+    vector_add(self->seek_queue, meta);
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_unlock(&self->seek_lock);
+#endif
+
+    return 1;
+}
+
+static void _unqueue_seek(SST* self, SSTMetadata* meta)
+{
+    if (!meta->seek_queued)
+        return;
+
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_lock(&self->seek_lock);
+#endif
+    for (uint32_t i = 0; i < vector_count(self->seek_queue); i++)
+    {
+        if (vector_get(self->seek_queue, i) == meta)
+        {
+            vector_remove(self->seek_queue, i);
+            break;
+        }
+    }
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_unlock(&self->seek_lock);
+#endif
+}
+
+// Returns 1 if a file was picked
+static int _pick_seek_compaction(SST* self)
+{
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_lock(&self->seek_lock);
+#endif
+    while (vector_count(self->seek_queue) > 0)
+    {
+        SSTMetadata* meta = (SSTMetadata*)vector_remove(self->seek_queue, 0);
+
+        // Give the file a new budget: if the compaction ends up moving it
+        // as is it may be queued again later
+        __sync_lock_test_and_set(&meta->allowed_seeks, _allowed_seeks_for(meta->filesize));
+        __sync_lock_release(&meta->seek_queued);
+
+        // It may have been moved down to the last level in the meanwhile
+        if (meta->level + 1 < MAX_LEVELS)
+        {
+            self->comp_file = meta;
+            self->comp_level = meta->level;
+            break;
+        }
+    }
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_unlock(&self->seek_lock);
+#endif
+
+    if (self->comp_file)
+    {
+        INFO("Compacting file %d in level %d after too many seeks",
+             self->comp_file->filenum, self->comp_level);
+        self->comp_score = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+#ifdef BACKGROUND_MERGE
+// Compacts the files queued for their seeks, the queue being checked
+// under its lock
+static void _compact_seeks(SST* self)
+{
+    self->comp_file = NULL;
+    self->comp_score = -1;
+
+    while (_pick_seek_compaction(self))
     {
-        result *= 10;
-        level--;
+        sst_compact(self);
+
+        self->comp_file = NULL;
+        self->comp_score = -1;
     }
-    return result;
 }
+#endif
 
 static void _evaluate_compaction(SST* self)
 {
     int comp_level = -1;
     double comp_score = -1;
 
-    for (int level = 0; level < MAX_LEVELS; level++)
+    _update_level_targets(self);
+
+    // The last level is never compacted since there is no level to push its
+    // data into.
+    for (int level = 0; level < MAX_LEVELS - 1; level++)
     {
         double score;
 
@@ -94,7 +388,15 @@ static void _evaluate_compaction(SST* self)
             //}
         }
         else
-            score = (double)_size_for_level(self, level) / _max_size_for_level(level);
+        {
+            uint64_t size = _size_for_level(self, level);
+
+            if (self->level_target[level] > 0)
+                score = (double)size / self->level_target[level];
+            else
+                // Levels above the base level have to be drained
+                score = (size > 0) ? 1 + (double)size / self->options.level_base_size : 0;
+        }
 
         //DEBUG("Score for level %d is %.3f", level, (float)score);
 
@@ -107,12 +409,21 @@ static void _evaluate_compaction(SST* self)
 
     self->comp_score = comp_score;
     self->comp_level = comp_level;
+    self->comp_file = NULL;
+    self->comp_in_place = 0;
+
+    if (self->comp_score < 1)
+        _pick_seek_compaction(self);
+
+    if (self->comp_score < 1)
+        _pick_tombstone_compaction(self);
+
+    if (self->comp_score < 1)
+        _pick_expired_compaction(self);
 }
 
-static void _schedule_compaction(SST* self)
+static void _run_compaction(SST* self)
 {
-    _evaluate_compaction(self);
-
     if (self->comp_score >= 1)
     {
 #ifndef BACKGROUND_MERGE
@@ -126,6 +437,26 @@ static void _schedule_compaction(SST* self)
     }
 }
 
+static void _schedule_compaction(SST* self)
+{
+    _evaluate_compaction(self);
+    _run_compaction(self);
+}
+
+static void _schedule_seek_compaction(SST* self)
+{
+#ifndef BACKGROUND_MERGE
+    _schedule_compaction(self);
+#else
+    // Leave the evaluation to the merge thread, it picks the queued file
+    // unless a level needs to be compacted first
+    pthread_mutex_lock(&self->cv_lock);
+    self->merge_state |= MERGE_STATUS_SEEK;
+    pthread_cond_signal(&self->cv);
+    pthread_mutex_unlock(&self->cv_lock);
+#endif
+}
+
 #ifdef BACKGROUND_MERGE
 void sst_merge_real(SST* self, SkipList* list);
 
@@ -167,8 +498,19 @@ static void merge_thread(void* data)
 
             sst_merge_real(sst, sst->immutable_list);
 
+            // Its keys are in the files now. The list is unpublished before
+            // the release, which may free it: the iterators acquire it under
+            // the immutable lock while the compactions below run.
+            pthread_mutex_lock(&sst->immutable_lock);
+
+            SkipList* list = sst->immutable_list;
+            sst->immutable = NULL;
+            sst->immutable_list = NULL;
+
+            pthread_mutex_unlock(&sst->immutable_lock);
+
             INFO("Merge successfully completed. Releasing the skiplist");
-            skiplist_release(sst->immutable_list);
+            skiplist_release(list);
         }
 
         if ((sst->merge_state & MERGE_STATUS_EXIT) == MERGE_STATUS_EXIT)
@@ -193,14 +535,36 @@ static void merge_thread(void* data)
             DEBUG("Compactiong due to many files in level 0");
             _evaluate_compaction(sst);
             sst_compact(sst);
+            compacted = 1;
         }
 
-        pthread_mutex_lock(&sst->immutable_lock);
+        if (!compacted)
+        {
+            // Nothing urgent to do: use the spare time to bring a level
+            // back under its target or, when none is over it, to get rid
+            // of the tombstones (or of the files still queued for their
+            // seeks). Without it the levels would only be compacted once
+            // level 0 piles up.
+            _evaluate_compaction(sst);
 
-        sst->immutable = NULL;
-        sst->immutable_list = NULL;
+            if (sst->comp_score >= 1 && !sst->comp_file)
+            {
+                // Under a steady load some level is always over its target
+                // and the tombstones would never get their turn: they get
+                // a compaction of their own after the level one, as do the
+                // expired values
+                sst_compact(sst);
+                _compact_tombstones(sst);
+                _compact_expired(sst);
+            }
+            else if (sst->comp_score >= 1)
+                sst_compact(sst);
+        }
 
-        pthread_mutex_unlock(&sst->immutable_lock);
+        // The readers keep probing the queued files for nothing: they are
+        // pushed down whatever the other jobs were, as the SEEK job is
+        // cleared with them
+        _compact_seeks(sst);
 
         sst->merge_state = 0;
 
@@ -209,168 +573,674 @@ static void merge_thread(void* data)
 }
 #endif
 
-static int _compare_by_latest(const SSTMetadata** a, const SSTMetadata** b)
+// Puts meta in its place among the files of its level, see SST.files
+static void _sst_file_place(SST* self, SSTMetadata* meta)
 {
-    return (*b)->filenum - (*a)->filenum;
-}
-
-static int _cmp_metadata_by_smallest_key(const SSTMetadata** a, const SSTMetadata** b)
-{
-    return string_cmp((*a)->smallest_key->mem, (*b)->smallest_key->mem,
-                      (*a)->smallest_key->length, (*b)->smallest_key->length);
-}
+    uint32_t level = meta->level;
+    uint32_t count = self->num_files[level];
+    SSTMetadata** files;
 
-static void _sort_files(SST* self)
-{
-    for (uint32_t level = 0; level < MAX_LEVELS; level++)
+    if (count == self->max_files[level])
     {
-        qsort(self->files[level], self->num_files[level],
-              sizeof(SSTMetadata**),
-             (int (*)(const void *, const void*))_cmp_metadata_by_smallest_key);
+        self->max_files[level] = count ? count * 2 : 8;
+        self->files[level] = realloc(self->files[level], sizeof(SSTMetadata*) * self->max_files[level]);
+        self->fences[level] = realloc(self->fences[level], sizeof(uint64_t) * self->max_files[level]);
+
+        if (!self->files[level] || !self->fences[level])
+            PANIC("Unable to allocate enough memory to hold %u files in level %u",
+                  self->max_files[level], level);
     }
 
-    _print_summary(self);
-}
+    files = self->files[level];
+    uint32_t pos = count;
 
-static int _write_manifest(SST* self)
-{
-    if (!writable_file_new(self->manifest))
+    if (level == 0)
     {
-        ERROR("Unable to open manifest file %s for writing", self->manifest->filename);
-        return 0;
+        // Flushes mostly append the newest file
+        while (pos > 0 && files[pos - 1]->filenum > meta->filenum)
+            pos--;
     }
-
-    SSTMetadata* meta;
-    Buffer* buff = buffer_new(1024);
-
-    buffer_putvarint32(buff, self->last_id);
-
-    for (uint32_t level = 0; level < MAX_LEVELS; level++)
+    else
     {
-        buffer_putvarint32(buff, self->num_files[level]);
+        uint32_t left = 0;
 
-        for (uint32_t i = 0; i < self->num_files[level]; i++)
+        while (left < pos)
         {
-            meta = *(self->files[level] + i);
-            buffer_putvarint32(buff, meta->filenum);
+            uint32_t mid = (left + pos) / 2;
 
-            buffer_putvarint32(buff, meta->smallest_key->length);
-            buffer_putnstr(buff, meta->smallest_key->mem, meta->smallest_key->length);
-
-            buffer_putvarint32(buff, meta->largest_key->length);
-            buffer_putnstr(buff, meta->largest_key->mem, meta->largest_key->length);
-
-            buffer_putvarint32(buff, meta->allowed_seeks);
+            if (comparator_variant_cmp(self->options.comparator, files[mid]->smallest_key, meta->smallest_key) <= 0)
+                left = mid + 1;
+            else
+                pos = mid;
         }
     }
 
-    file_append(self->manifest, buff);
-    file_close(self->manifest);
-    buffer_free(buff);
+    memmove(files + pos + 1, files + pos, sizeof(SSTMetadata*) * (count - pos));
+    files[pos] = meta;
 
-    return 1;
+    memmove(self->fences[level] + pos + 1, self->fences[level] + pos, sizeof(uint64_t) * (count - pos));
+    self->fences[level][pos] = comparator_prefix(self->options.comparator, meta->largest_key->mem, meta->largest_key->length);
+
+    self->num_files[level]++;
+    self->file_count++;
+
+    if (level == 0)
+        self->level0_changed = 1;
 }
 
-static int _read_manifest(SST* self)
+static void _sst_index_level0(SST* self)
 {
-    // Now let's read the manifest file containing all
-    // the information regarding all the files at various levels
-    self->manifest = file_new();
-    snprintf(self->manifest->filename, MAX_FILENAME, "%s/manifest", self->basedir);
+    uint32_t count = self->num_files[0];
 
-    if (!file_exists(self->manifest))
-    {
-        INFO("Manifest file not present");
-        return 1;
-    }
+    if (!self->level0_changed)
+        return;
 
-    if (!mmapped_file_new(self->manifest))
+    Variant** keys = malloc(sizeof(Variant*) * (2 * count + 1));
+
+    if (!keys)
+        PANIC("NULL allocation");
+
+    for (uint32_t i = 0; i < count; i++)
     {
-        ERROR("Unable to open manifest file for reading");
-        return 0;
+        keys[i] = self->files[0][i]->smallest_key;
+        keys[count + i] = self->files[0][i]->largest_key;
     }
 
-    // Let's read the manifest file
-    const char *start = self->manifest->base;
+    interval_index_build(self->level0_index, count, keys, keys + count);
+    self->level0_changed = 0;
 
-    File* file;
-    SSTMetadata* meta;
-    uint32_t curr_level = 0, curr_num = 0;
+    free(keys);
+}
 
-    start = get_varint32(start, start + 5, &self->last_id);
+/*
+ * The manifest is a log of version edits, one record appended by every
+ * commit:
+ *   MANIFEST_MAGIC
+ *   <int32 length><int32 crc32 of the edit><edit>
+ *   ...
+ * An edit is a sequence of tagged changes
+ *   EDIT_LAST_ID     <varint last_id>
+ *   EDIT_ADD_FILE    <varint level><varint filenum>
+ *                    <varint length><smallest key><varint length><largest key>
+ *   EDIT_DELETE_FILE <varint level><varint filenum>
+ *   EDIT_BLOB        <varint filenum><varint64 total><varint64 garbage>
+ *   EDIT_DELETE_BLOB <varint filenum>
+ *   EDIT_COMPARATOR  <varint length><name of the comparator>
+ * and the first record is a snapshot: the edit naming the comparator and
+ * adding all the files. A record cut short or failing its crc ends the
+ * log, the database went down while it was being written.
+ */
+#define EDIT_LAST_ID     1
+#define EDIT_ADD_FILE    2
+#define EDIT_DELETE_FILE 3
+#define EDIT_BLOB        4
+#define EDIT_DELETE_BLOB 5
+#define EDIT_COMPARATOR  6
+
+#define MANIFEST_MAGIC_SIZE (sizeof(MANIFEST_MAGIC) - 1)
+
+static void _edit_add_file(Buffer* edit, SSTMetadata* meta)
+{
+    buffer_putvarint32(edit, EDIT_ADD_FILE);
+    buffer_putvarint32(edit, meta->level);
+    buffer_putvarint32(edit, meta->filenum);
 
-    while (curr_level < MAX_LEVELS && start < self->manifest->limit)
-    {
-        start = get_varint32(start, start + 5, &self->num_files[curr_level]);
-        self->files[curr_level] = malloc(sizeof(SSTMetadata*) * self->num_files[curr_level]);
+    buffer_putvarint32(edit, meta->smallest_key->length);
+    buffer_putnstr(edit, meta->smallest_key->mem, meta->smallest_key->length);
 
-        if (!self->files[curr_level])
-            PANIC("Unable to allocate enough memory to hold %d files in level %d",
-                  self->num_files[curr_level], curr_level);
+    buffer_putvarint32(edit, meta->largest_key->length);
+    buffer_putnstr(edit, meta->largest_key->mem, meta->largest_key->length);
+}
 
-        for (uint32_t i = 0; i < self->num_files[curr_level] && start < self->manifest->limit; i++)
-        {
-            start = get_varint32(start, start + 5, &curr_num);
+static void _edit_delete_file(Buffer* edit, uint32_t level, uint32_t filenum)
+{
+    buffer_putvarint32(edit, EDIT_DELETE_FILE);
+    buffer_putvarint32(edit, level);
+    buffer_putvarint32(edit, filenum);
+}
 
-            file = file_new();
-            snprintf(file->filename, MAX_FILENAME, "%s/%d/%d.sst", self->basedir, curr_level, curr_num);
+static void _edit_blob(Buffer* edit, BlobFile* blob)
+{
+    buffer_putvarint32(edit, EDIT_BLOB);
+    buffer_putvarint32(edit, blob->filenum);
+    buffer_putvarint64(edit, blob->total_bytes);
+    buffer_putvarint64(edit, blob->garbage_bytes);
+}
 
-            meta = sst_metadata_new(curr_level, curr_num);
-            uint32_t len = 0;
+// Appends to record the record of the edit, which starts with the last id
+static void _manifest_record(SST* self, Buffer* record, Buffer* edit)
+{
+    Buffer* payload = buffer_new(edit->length + 16);
 
-            start = get_varint32(start, start + 5, &len);
-            buffer_putnstr(meta->smallest_key, start, len);
-            start += len;
+    buffer_putvarint32(payload, EDIT_LAST_ID);
+    buffer_putvarint32(payload, self->last_id);
+    buffer_putnstr(payload, edit->mem, edit->length);
 
-            start = get_varint32(start, start + 5, &len);
-            buffer_putnstr(meta->largest_key, start, len);
-            start += len;
+    buffer_putint32(record, payload->length);
+    buffer_putint32(record, crc32_extend(0, payload->mem, payload->length));
+    buffer_putnstr(record, payload->mem, payload->length);
 
-            start = get_varint32(start, start + 5, (uint32_t *)&meta->allowed_seeks);
+    buffer_free(payload);
+}
 
-            INFO("Loading SST file %s for level %d %ld bytes", file->filename, curr_level, file_size(file));
+static void _clear_dirty_blobs(SST* self)
+{
+    for (uint32_t i = 0; i < vector_count(self->dirty_blobs); i++)
+        ((BlobFile*)vector_get(self->dirty_blobs, i))->dirty = 0;
 
-            meta->loader = sst_loader_new(self->cache, file, curr_level, curr_num);
-            meta->filesize = file_size(file);
+    vector_clear(self->dirty_blobs);
+}
 
-            if (meta->allowed_seeks < 0)
-                meta->allowed_seeks = meta->filesize / 16384;
+// Replaces the manifest with a snapshot of the files, the log going on
+// from there
+static int _write_manifest(SST* self)
+{
+    File* file = file_new();
+    snprintf(file->filename, MAX_FILENAME, "%s.tmp", self->manifest->filename);
 
-            INFO("Smallest key: %.*s Largest key: %.*s seeks: %d",
-                 meta->smallest_key->length, meta->smallest_key->mem,
-                 meta->largest_key->length, meta->largest_key->mem,
-                 meta->allowed_seeks);
+    if (!writable_file_new(file))
+    {
+        ERROR("Unable to open manifest file %s for writing", file->filename);
+        file_free(file);
+        return 0;
+    }
 
+    Buffer* edit = buffer_new(1024);
+    Buffer* buff = buffer_new(1024);
 
-            if (meta->loader)
+    buffer_putvarint32(edit, EDIT_COMPARATOR);
+    buffer_putvarint32(edit, strlen(self->options.comparator->name));
+    buffer_putstr(edit, self->options.comparator->name);
+
+    for (uint32_t level = 0; level < MAX_LEVELS; level++)
+    {
+        for (uint32_t i = 0; i < self->num_files[level]; i++)
+            _edit_add_file(edit, self->files[level][i]);
+    }
+
+    for (uint32_t i = 0; i < vector_count(self->blob_files); i++)
+        _edit_blob(edit, (BlobFile*)vector_get(self->blob_files, i));
+
+    buffer_putnstr(buff, MANIFEST_MAGIC, MANIFEST_MAGIC_SIZE);
+    _manifest_record(self, buff, edit);
+
+    int ret = file_append(file, buff) && file_close(file);
+
+    if (ret && rename(file->filename, self->manifest->filename) != 0)
+    {
+        ERROR("Unable to rename %s: %s", file->filename, strerror(errno));
+        ret = 0;
+    }
+
+    if (ret)
+    {
+        // Whatever the pending edit holds is in the snapshot already
+        buffer_clear(self->edit);
+        _clear_dirty_blobs(self);
+
+        if (self->manifest->fd != -1)
+            file_close(self->manifest);
+
+        if (!appendable_file_new(self->manifest))
+        {
+            ERROR("Unable to open manifest file %s for appending", self->manifest->filename);
+            ret = 0;
+        }
+
+        self->manifest_snapshot = buff->length;
+    }
+    else
+        unlink(file->filename);
+
+    file_free(file);
+    buffer_free(edit);
+    buffer_free(buff);
+
+    _print_summary(self);
+
+    return ret;
+}
+
+// Appends the changes made since the last commit to the manifest
+static int _append_edit(SST* self)
+{
+    // The garbage of the blob files is recorded once per commit, however
+    // many references went away
+    for (uint32_t i = 0; i < vector_count(self->dirty_blobs); i++)
+    {
+        BlobFile* blob = (BlobFile*)vector_get(self->dirty_blobs, i);
+
+        if (blob->garbage_bytes < blob->total_bytes)
+            _edit_blob(self->edit, blob);
+    }
+
+    _clear_dirty_blobs(self);
+
+    for (uint32_t i = 0; i < vector_count(self->dead_blobs); i++)
+    {
+        buffer_putvarint32(self->edit, EDIT_DELETE_BLOB);
+        buffer_putvarint32(self->edit, ((BlobFile*)vector_get(self->dead_blobs, i))->filenum);
+    }
+
+    if (self->edit->length == 0)
+        return 1;
+
+    Buffer* record = buffer_new(self->edit->length + 32);
+    _manifest_record(self, record, self->edit);
+    buffer_clear(self->edit);
+
+    int ret = self->manifest->fd != -1 &&
+              file_append_sync(self->manifest, record->mem, record->length);
+
+    buffer_free(record);
+
+    // The snapshot also makes up for a record that failed to be written
+    if (!ret || (self->manifest->offset > MANIFEST_SNAPSHOT_SIZE &&
+                 self->manifest->offset > 2 * self->manifest_snapshot))
+        return _write_manifest(self);
+
+    return 1;
+}
+
+// Blob files not listed in the manifest were being written when the
+// database was closed abruptly
+static void _remove_orphan_blobs(SST* self)
+{
+    char filename[MAX_FILENAME];
+    snprintf(filename, MAX_FILENAME, "%s/blob", self->basedir);
+
+    DIR* dir = opendir(filename);
+    struct dirent* entry;
+
+    if (!dir)
+        return;
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        unsigned filenum;
+        char suffix[8];
+
+        if (sscanf(entry->d_name, "%u.%7s", &filenum, suffix) != 2 ||
+            strcmp(suffix, "blob") != 0 || sst_blob_file(self, filenum))
+            continue;
+
+        blob_file_name(filename, self->basedir, filenum);
+        INFO("Removing orphan blob file %s", filename);
+        unlink(filename);
+    }
+
+    closedir(dir);
+}
+
+typedef struct _manifest_blob {
+    uint32_t filenum;
+    uint64_t total_bytes;
+    uint64_t garbage_bytes;
+} ManifestBlob;
+
+// The files a manifest lists, before they get opened
+typedef struct _manifest_state {
+    Vector* files[MAX_LEVELS];
+    Vector* blobs;
+    Buffer* comparator; // empty in the manifests not naming it
+} ManifestState;
+
+static ManifestBlob* _manifest_blob(ManifestState* state, uint32_t filenum, uint32_t* pos)
+{
+    for (uint32_t i = 0; i < vector_count(state->blobs); i++)
+    {
+        ManifestBlob* blob = (ManifestBlob*)vector_get(state->blobs, i);
+
+        if (blob->filenum == filenum)
+        {
+            *pos = i;
+            return blob;
+        }
+    }
+
+    return NULL;
+}
+
+static const char* _read_key(const char* p, const char* limit, Variant* key)
+{
+    uint32_t len;
+
+    if (!(p = get_varint32(p, limit, &len)) || len > (size_t)(limit - p))
+        return NULL;
+
+    buffer_putnstr(key, p, len);
+    return p + len;
+}
+
+static int _apply_edit(SST* self, ManifestState* state, const char* p, const char* limit)
+{
+    while (p < limit)
+    {
+        uint32_t tag, level, filenum, pos;
+        uint64_t total_bytes, garbage_bytes;
+        ManifestBlob* blob;
+
+        if (!(p = get_varint32(p, limit, &tag)))
+            return 0;
+
+        switch (tag)
+        {
+        case EDIT_LAST_ID:
+            if (!(p = get_varint32(p, limit, &self->last_id)))
+                return 0;
+            break;
+
+        case EDIT_ADD_FILE:
+        {
+            if (!(p = get_varint32(p, limit, &level)) || level >= MAX_LEVELS ||
+                !(p = get_varint32(p, limit, &filenum)))
+                return 0;
+
+            SSTMetadata* meta = sst_metadata_new(level, filenum);
+            vector_add(state->files[level], meta);
+
+            if (!(p = _read_key(p, limit, meta->smallest_key)) ||
+                !(p = _read_key(p, limit, meta->largest_key)))
+                return 0;
+            break;
+        }
+
+        case EDIT_DELETE_FILE:
+            if (!(p = get_varint32(p, limit, &level)) || level >= MAX_LEVELS ||
+                !(p = get_varint32(p, limit, &filenum)))
+                return 0;
+
+            for (uint32_t i = 0; i < vector_count(state->files[level]); i++)
             {
-                self->files[curr_level][i] = meta;
-                self->file_count++;
+                if (((SSTMetadata*)vector_get(state->files[level], i))->filenum == filenum)
+                {
+                    sst_metadata_free((SSTMetadata*)vector_remove(state->files[level], i));
+                    break;
+                }
             }
-            else
+            break;
+
+        case EDIT_BLOB:
+            if (!(p = get_varint32(p, limit, &filenum)) ||
+                !(p = get_varint64(p, limit, &total_bytes)) ||
+                !(p = get_varint64(p, limit, &garbage_bytes)))
+                return 0;
+
+            if (!(blob = _manifest_blob(state, filenum, &pos)))
             {
-                self->num_files[curr_level]--;
-                i--;
-                sst_metadata_free(meta);
+                if (!(blob = malloc(sizeof(ManifestBlob))))
+                    PANIC("NULL allocation");
+
+                blob->filenum = filenum;
+                vector_add(state->blobs, blob);
             }
 
+            blob->total_bytes = total_bytes;
+            blob->garbage_bytes = garbage_bytes;
+            break;
+
+        case EDIT_DELETE_BLOB:
+            if (!(p = get_varint32(p, limit, &filenum)))
+                return 0;
+
+            if ((blob = _manifest_blob(state, filenum, &pos)))
+                free(vector_remove(state->blobs, pos));
+            break;
+
+        case EDIT_COMPARATOR:
+            buffer_clear(state->comparator);
+
+            if (!(p = _read_key(p, limit, state->comparator)))
+                return 0;
+            break;
+
+        default:
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void _read_edits(SST* self, ManifestState* state, const char* start, const char* limit)
+{
+    uint32_t records = 0;
+
+    while (limit - start >= 2 * sizeof(uint32_t))
+    {
+        uint32_t length = get_int32(start);
+        uint32_t crc32 = get_int32(start + sizeof(uint32_t));
+        const char* edit = start + 2 * sizeof(uint32_t);
+
+        if (length > (size_t)(limit - edit) || crc32_extend(0, edit, length) != crc32)
+            break;
+
+        if (!_apply_edit(self, state, edit, edit + length))
+        {
+            ERROR("Corrupted edit in the manifest %s", self->manifest->filename);
+            break;
+        }
+
+        start = edit + length;
+        records++;
+    }
+
+    if (start < limit)
+        ERROR("Ignoring the last %zu bytes of the manifest %s, they were being written",
+              (size_t)(limit - start), self->manifest->filename);
+
+    INFO("Manifest replayed, %u records", records);
+}
+
+// Manifests written before the log of edits are a snapshot of
+//   <varint last_id>
+//   for each level <varint count> then for each file <varint filenum>
+//   <varint length><smallest key><varint length><largest key><varint 0>
+//   <varint count> then for each blob file
+//   <varint filenum><varint64 total><varint64 garbage>
+static void _read_snapshot(SST* self, ManifestState* state, const char* start, const char* limit)
+{
+    start = get_varint32(start, start + 5, &self->last_id);
+
+    for (uint32_t level = 0; level < MAX_LEVELS && start < limit; level++)
+    {
+        uint32_t num_files = 0;
+        start = get_varint32(start, start + 5, &num_files);
+
+        for (uint32_t i = 0; i < num_files && start < limit; i++)
+        {
+            uint32_t filenum = 0, len = 0;
+            start = get_varint32(start, start + 5, &filenum);
+
+            SSTMetadata* meta = sst_metadata_new(level, filenum);
+
+            start = get_varint32(start, start + 5, &len);
+            buffer_putnstr(meta->smallest_key, start, len);
+            start += len;
+
+            start = get_varint32(start, start + 5, &len);
+            buffer_putnstr(meta->largest_key, start, len);
+            start += len;
+
+            // Used to be the allowed seeks: they are a property of the
+            // running workload and start over at every open
+            start = get_varint32(start, start + 5, &len);
+
+            vector_add(state->files[level], meta);
+        }
+    }
+
+    // Blob files along with their garbage, missing in older manifests
+    uint32_t num_blobs = 0;
+
+    if (start < limit)
+        start = get_varint32(start, start + 5, &num_blobs);
+
+    for (uint32_t i = 0; i < num_blobs && start < limit; i++)
+    {
+        ManifestBlob* blob = malloc(sizeof(ManifestBlob));
+
+        if (!blob)
+            PANIC("NULL allocation");
+
+        start = get_varint32(start, start + 5, &blob->filenum);
+        start = get_varint64(start, start + 9, &blob->total_bytes);
+        start = get_varint64(start, start + 9, &blob->garbage_bytes);
+        vector_add(state->blobs, blob);
+    }
+}
+
+// The files are sorted by the comparator they were written with, the
+// options must name the same one. The manifests not naming it are older
+// than the comparators, their keys sort as bytes.
+static void _check_comparator(SST* self, ManifestState* state)
+{
+    const char* name = self->options.comparator->name;
+
+    if (state->comparator->length == 0)
+        buffer_putstr(state->comparator, comparator_bytewise()->name);
+
+    if (state->comparator->length != strlen(name) ||
+        memcmp(state->comparator->mem, name, state->comparator->length) != 0)
+        PANIC("The database %s was created with the comparator %.*s, it cannot be opened with %s",
+              self->basedir, (int)state->comparator->length, state->comparator->mem, name);
+}
+
+// Opens the files the manifest lists
+static void _open_files(SST* self, ManifestState* state)
+{
+    for (uint32_t level = 0; level < MAX_LEVELS; level++)
+    {
+        for (uint32_t i = 0; i < vector_count(state->files[level]); i++)
+        {
+            SSTMetadata* meta = (SSTMetadata*)vector_get(state->files[level], i);
+
+            File* file = file_new();
+            snprintf(file->filename, MAX_FILENAME, "%s/%d/%d.sst", self->basedir, level, meta->filenum);
+
+            meta->filesize = file_size(file);
+            meta->allowed_seeks = _allowed_seeks_for(meta->filesize);
+
+            INFO("Loading SST file %s for level %d %ld bytes", file->filename, level, meta->filesize);
+
+            meta->loader = sst_loader_new(self->cache, self->options.comparator, file, level, meta->filenum,
+                                          self->options.pread_reads);
+
+            INFO("Smallest key: %.*s Largest key: %.*s seeks: %d",
+                 meta->smallest_key->length, meta->smallest_key->mem,
+                 meta->largest_key->length, meta->largest_key->mem,
+                 meta->allowed_seeks);
+
+            if (meta->loader)
+                _sst_file_place(self, meta);
+            else
+                sst_metadata_free(meta);
+        }
+    }
+
+    for (uint32_t i = 0; i < vector_count(state->blobs); i++)
+    {
+        ManifestBlob* entry = (ManifestBlob*)vector_get(state->blobs, i);
+        BlobFile* blob = blob_file_open(self->basedir, entry->filenum);
+
+        if (!blob)
+        {
+            ERROR("Blob file %u is missing, the values stored there are lost", entry->filenum);
+            continue;
+        }
+
+        blob->total_bytes = entry->total_bytes;
+        blob->garbage_bytes = entry->garbage_bytes;
+        sst_blob_add(self, blob);
+    }
+}
+
+static int _read_manifest(SST* self)
+{
+    // Now let's read the manifest file containing all
+    // the information regarding all the files at various levels
+    self->manifest = file_new();
+    snprintf(self->manifest->filename, MAX_FILENAME, "%s/manifest", self->basedir);
+
+    if (!file_exists(self->manifest))
+    {
+        INFO("Manifest file not present");
+    }
+    else if (!mmapped_file_new(self->manifest))
+    {
+        ERROR("Unable to open manifest file for reading");
+        return 0;
+    }
+    else
+    {
+        ManifestState state;
+        const char* start = self->manifest->base;
+        const char* limit = self->manifest->limit;
 
+        for (uint32_t level = 0; level < MAX_LEVELS; level++)
+            state.files[level] = vector_new();
+
+        state.blobs = vector_new();
+        state.comparator = buffer_new(32);
+
+        if ((size_t)(limit - start) >= MANIFEST_MAGIC_SIZE &&
+            memcmp(start, MANIFEST_MAGIC, MANIFEST_MAGIC_SIZE) == 0)
+            _read_edits(self, &state, start + MANIFEST_MAGIC_SIZE, limit);
+        else
+        {
+            INFO("Converting the manifest %s to a log of edits", self->manifest->filename);
+            _read_snapshot(self, &state, start, limit);
         }
 
-        curr_level++;
+        file_close(self->manifest);
+        _check_comparator(self, &state);
+        _open_files(self, &state);
+
+        for (uint32_t level = 0; level < MAX_LEVELS; level++)
+            vector_free(state.files[level]);
+
+        for (uint32_t i = 0; i < vector_count(state.blobs); i++)
+            free(vector_get(state.blobs, i));
+
+        vector_free(state.blobs);
+        buffer_free(state.comparator);
     }
 
-    file_close(self->manifest);
-    _sort_files(self);
+    _remove_orphan_blobs(self);
+    _sst_index_level0(self);
+
+    // The edits of this run go after a snapshot of what has been read
+    _write_manifest(self);
     _schedule_compaction(self);
 
     return 1;
 }
 
-SST* sst_new(const char* basedir, uint64_t cache_size)
+SST* sst_new(const char* basedir, const Options* options)
 {
     SST* self = (SST*)malloc(sizeof(SST));
 
+    self->options = *options;
+
+    for (uint32_t level = 0; level < MAX_LEVELS; level++)
+    {
+        if (!codec_get(self->options.compression[level]))
+        {
+            ERROR("Codec %s is not available, level %d will not be compressed",
+                  codec_name(self->options.compression[level]), level);
+            self->options.compression[level] = TYPE_NO_COMPRESSION;
+        }
+
+        if (self->options.block_size[level] < MIN_BLOCK_SIZE ||
+            self->options.restart_interval[level] == 0)
+        {
+            ERROR("Invalid block size %u or restart interval %u for level %d, using the defaults",
+                  self->options.block_size[level], self->options.restart_interval[level], level);
+            self->options.block_size[level] = BLOCK_SIZE;
+            self->options.restart_interval[level] = RESTART_INTERVAL;
+        }
+    }
+
     strncpy(self->basedir, basedir, sizeof(self->basedir));
     strncat(self->basedir, "/si", MAX_FILENAME);
     mkdirp(self->basedir);
@@ -379,24 +1249,39 @@ SST* sst_new(const char* basedir, uint64_t cache_size)
     self->last_id = 0;
     self->under_compaction = 0;
     self->targets = vector_new(); // Used to speed up the get
+    self->seek_queue = vector_new();
+    self->blob_files = vector_new();
+    self->dead_blobs = vector_new();
+    self->dirty_blobs = vector_new();
+    self->edit = buffer_new(1024);
+    self->manifest_snapshot = 0;
 
-    self->cache = lru_new(cache_size);
+    self->cache = lru_new(self->options.cache_size);
+    self->pool = (self->options.builder_threads > 0) ? thread_pool_new(self->options.builder_threads) : NULL;
 
     self->comp_level = -1;
     self->comp_score = -1;
+    self->comp_file = NULL;
 
     for (uint32_t i = 0; i < MAX_LEVELS; i++)
     {
         self->files[i] = NULL;
         self->num_files[i] = 0;
+        self->max_files[i] = 0;
+        self->fences[i] = NULL;
+        self->level_target[i] = 0;
     }
 
+    self->level0_index = interval_index_new(self->options.comparator);
+    self->level0_changed = 0;
+
 #ifdef BACKGROUND_MERGE
     self->merge_state = 0;
     self->immutable = NULL;
     self->immutable_list = NULL;
 
     pthread_mutex_init(&self->lock, NULL);
+    pthread_mutex_init(&self->seek_lock, NULL);
     pthread_mutex_init(&self->cv_lock, NULL);
     pthread_mutex_init(&self->immutable_lock, NULL);
     pthread_cond_init(&self->cv, NULL);
@@ -425,6 +1310,9 @@ void sst_free(SST* self)
 
     _write_manifest(self);
 
+    if (self->pool)
+        thread_pool_free(self->pool);
+
     if (self->manifest)
         file_free(self->manifest);
 
@@ -437,305 +1325,957 @@ void sst_free(SST* self)
             sst_metadata_free(self->files[i][j]);
 
         free(self->files[i]);
+        free(self->fences[i]);
     }
 
     vector_free(self->targets);
+    vector_free(self->seek_queue);
+
+    for (uint32_t i = 0; i < vector_count(self->blob_files); i++)
+        blob_file_free((BlobFile*)vector_get(self->blob_files, i));
+
+    vector_free(self->blob_files);
+    vector_free(self->dead_blobs);
+    vector_free(self->dirty_blobs);
+    buffer_free(self->edit);
+    interval_index_free(self->level0_index);
     lru_free(self->cache);
     free(self);
 }
 
-static void _sst_file_delete(uint32_t tlen, uint32_t len, SSTMetadata** targets, SSTMetadata** arr)
-{
-    int i = 0, dst = 0, src = 0;
+static void _sst_file_delete(uint32_t tlen, uint32_t len, SSTMetadata** targets, SSTMetadata** arr, uint64_t* fences)
+{
+    uint32_t dst = 0;
+
+    // Keep the relative order of the surviving files
+    for (uint32_t src = 0; src < len; src++)
+    {
+        uint32_t i = 0;
+
+        while (i < tlen && targets[i] != arr[src])
+            i++;
+
+        if (i == tlen)
+        {
+            fences[dst] = fences[src];
+            arr[dst++] = arr[src];
+        }
+    }
+
+    // Just to get a clean crash! Trust me I am not an engineer
+    while (dst < len)
+        arr[dst++] = NULL;
+}
+
+void sst_file_delete(SST* self, uint32_t level, uint32_t count, SSTMetadata** files)
+{
+    assert(level < MAX_LEVELS);
+
+    _sst_file_delete(count, self->num_files[level], files, self->files[level], self->fences[level]);
+
+    self->num_files[level] -= count;
+    self->file_count -= count;
+
+    if (level == 0)
+        self->level0_changed = 1;
+
+    for (int i = 0; i < count; i++)
+    {
+        SSTMetadata* meta = *(files + i);
+        _edit_delete_file(self->edit, level, meta->filenum);
+
+        INFO("Deleting %s", meta->loader->file->filename);
+        unlink(meta->loader->file->filename);
+        _unqueue_seek(self, meta);
+
+        if (meta->pins > 0)
+            meta->deleted = 1;
+        else
+            sst_metadata_free(meta);
+    }
+}
+
+static void _sst_file_insert(SST* self, SSTMetadata* meta)
+{
+    __sync_lock_test_and_set(&meta->allowed_seeks, _allowed_seeks_for(meta->filesize));
+    _edit_add_file(self->edit, meta);
+    _sst_file_place(self, meta);
+}
+
+static void _sst_purge_blobs(SST* self)
+{
+    for (uint32_t i = 0; i < vector_count(self->dead_blobs); i++)
+    {
+        BlobFile* blob = (BlobFile*)vector_get(self->dead_blobs, i);
+
+        INFO("Deleting blob file %s", blob->file->filename);
+        unlink(blob->file->filename);
+
+        if (blob->pins > 0)
+            blob->deleted = 1;
+        else
+            blob_file_free(blob);
+    }
+
+    vector_clear(self->dead_blobs);
+}
+
+static void _sst_commit(SST* self)
+{
+    _append_edit(self);
+    _sst_purge_blobs(self);
+    _sst_index_level0(self);
+
+#ifndef BACKGROUND_MERGE
+    _schedule_compaction(self);
+#endif
+}
+
+void sst_file_add(SST* self, SSTMetadata* meta)
+{
+    _sst_file_insert(self, meta);
+    _sst_commit(self);
+}
+
+void sst_file_add_many(SST* self, uint32_t count, SSTMetadata** files)
+{
+    for (uint32_t i = 0; i < count; i++)
+        _sst_file_insert(self, files[i]);
+
+    _sst_commit(self);
+}
+
+void sst_file_move(SST* self, uint32_t level, uint32_t count, SSTMetadata** files)
+{
+    assert(level + 1 < MAX_LEVELS);
+
+    _sst_file_delete(count, self->num_files[level], files, self->files[level], self->fences[level]);
+
+    self->num_files[level] -= count;
+    self->file_count -= count;
+
+    if (level == 0)
+        self->level0_changed = 1;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        SSTMetadata* meta = files[i];
+        File* file = sst_filename_new(self, level + 1, meta->filenum);
+
+        INFO("Moving %s to %s", meta->loader->file->filename, file->filename);
+        _edit_delete_file(self->edit, level, meta->filenum);
+
+        if (rename(meta->loader->file->filename, file->filename) != 0)
+            PANIC("Unable to move %s to %s: %s", meta->loader->file->filename,
+                  file->filename, strerror(errno));
+
+        // The mapping survives the rename, so the loader along with its
+        // index can be kept as is.
+        memcpy(meta->loader->file->filename, file->filename, MAX_FILENAME);
+        meta->loader->level = level + 1;
+        meta->level = level + 1;
+
+        file_free(file);
+        _sst_file_insert(self, meta);
+    }
+
+    _sst_commit(self);
+}
+
+File* sst_filename_new(SST* self, uint32_t level, uint32_t filenum)
+{
+    File* file_ = file_new();
+    snprintf(file_->filename, MAX_FILENAME, "%s/%d", self->basedir, level);
+    mkdirp(file_->filename);
+    snprintf(file_->filename, MAX_FILENAME, "%s/%d/%d.sst", self->basedir, level, filenum);
+    return file_;
+}
+
+int sst_file_new(SST* self, uint32_t level, uint64_t expected_size, File** file, SSTBuilder** builder, SSTMetadata** meta)
+{
+    uint32_t filenum = self->last_id++;
+    File* file_ = sst_filename_new(self, level, filenum);
+
+    if (!(self->options.direct_writes ? direct_file_new(file_, expected_size) : writable_file_new(file_)))
+    {
+        ERROR("Unable to open file %s for writing", file_->filename);
+
+        file_free(file_);
+        return 0;
+    }
+
+    *file = file_;
+    *builder = sst_builder_new(file_, self->pool, &self->options, level);
+    *meta = sst_metadata_new(level, filenum);
+
+    if (self->options.min_blob_size > 0)
+        (*builder)->blob = blob_writer_new(self->basedir, self->last_id++, self->options.direct_writes);
+
+    return 1;
+}
+
+// Returns the blob file written along with the sst file, if any
+static BlobFile* _sst_merge_into(SST* self, SkipNode* node, SkipNode* last, size_t count, Vector* range_dels, SSTMetadata* meta, File* file, SSTBuilder* builder)
+{
+    BlobWriter* blob = builder->blob;
+    OPT opt;
+    Variant* key = buffer_new(1024);
+    Variant* value = buffer_new(1024);
+
+    for (int i = 0; i < count/* && node != last*/; i++)
+    {
+        memtable_extract_node(node, key, value, &opt);
+        sst_builder_add(builder, key, value, opt);
+        node = node->forward[0];
+    }
+
+    for (uint32_t i = 0; i < vector_count(range_dels); i++)
+        sst_builder_add_range_del(builder, (RangeTombstone*)vector_get(range_dels, i));
+
+    buffer_free(key);
+    buffer_free(value);
+
+    sst_builder_free(builder);
+    file_close(file);
+
+    // Now we need to create an sst loader and insert it in the right place
+    // and we just reuse the file object we have
+    meta->filesize = file_size(file);
+    meta->loader = sst_loader_new(self->cache, self->options.comparator, file, meta->level, meta->filenum,
+                                  self->options.pread_reads);
+
+    return blob ? blob_writer_finish(blob) : NULL;
+}
+
+void sst_merge(SST* self, MemTable* mem)
+#ifdef BACKGROUND_MERGE
+{
+    pthread_mutex_lock(&self->cv_lock);
+
+    while (self->merge_state != 0)
+    {
+        pthread_mutex_unlock(&self->cv_lock);
+        usleep(1000);
+        pthread_mutex_lock(&self->cv_lock);
+    }
+
+    // We need to get a reference to the skiplist and to the logfile
+    pthread_mutex_lock(&self->immutable_lock);
+
+    self->immutable = mem;
+    self->immutable_list = mem->list;
+    skiplist_acquire(mem->list);
+
+    INFO("IN sst_merge the REFCOUNT IS at %d", mem->list->refcount);
+
+    pthread_mutex_unlock(&self->immutable_lock);
+
+    self->merge_state |= MERGE_STATUS_INPUT;
+
+    pthread_cond_signal(&self->cv);
+    pthread_mutex_unlock(&self->cv_lock);
+}
+
+void sst_merge_real(SST* self, SkipList* list)
+#endif
+{
+    INFO("Compacting the memtable to a SST file");
+
+    File* file;
+    SSTBuilder* builder;
+    SSTMetadata* meta;
+    uint32_t level = 0;
+
+    SkipNode* first = skiplist_first(list);
+    SkipNode* last = skiplist_last(list);
+
+    OPT opt;
+    Variant* smallest = buffer_new(1);
+    Variant* largest = buffer_new(1);
+
+    if (list->count > 0)
+    {
+        memtable_extract_node(first, smallest, NULL, &opt);
+        memtable_extract_node(last, largest, NULL, &opt);
+    }
+
+    // The bounds of the file must include the range tombstones too
+    for (uint32_t i = 0; i < vector_count(list->range_dels); i++)
+    {
+        RangeTombstone* tombstone = (RangeTombstone*)vector_get(list->range_dels, i);
+
+        if ((list->count == 0 && i == 0) || comparator_variant_cmp(self->options.comparator, tombstone->begin, smallest) < 0)
+        {
+            buffer_clear(smallest);
+            buffer_putnstr(smallest, tombstone->begin->mem, tombstone->begin->length);
+        }
+
+        if ((list->count == 0 && i == 0) || comparator_variant_cmp(self->options.comparator, tombstone->end, largest) > 0)
+        {
+            buffer_clear(largest);
+            buffer_putnstr(largest, tombstone->end->mem, tombstone->end->length);
+        }
+    }
+
+    level = sst_pick_level_for_compaction(self, smallest, largest);
+
+    // The memtable is about the size of its contents
+    if (!sst_file_new(self, level, list->allocated, &file, &builder, &meta))
+        PANIC("Unable to compact memtable");
+
+    buffer_putnstr(meta->smallest_key, smallest->mem, smallest->length);
+    buffer_putnstr(meta->largest_key, largest->mem, largest->length);
+
+    buffer_free(smallest);
+    buffer_free(largest);
+
+    INFO("Compaction of %d [%d bytes allocated] elements started", list->count, list->allocated);
+    BlobFile* blob = _sst_merge_into(self, first, list->hdr, list->count, list->range_dels, meta, file, builder);
+    INFO("Compaction of %d elements finished", list->count);
+
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_lock(&self->lock);
+#endif
+
+    if (blob)
+        sst_blob_add(self, blob);
+
+    // The lock must be held
+    sst_file_add(self, meta);
+
+    // At this point we can remove the old log since we have created the file
+    log_remove(self->immutable->log, self->immutable->lsn - 1);
+
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_unlock(&self->lock);
+#endif
+}
+
+// Looks filenum up among blobs, sorted by filenum
+static BlobFile* _blob_file_find(Vector* blobs, uint32_t filenum)
+{
+    uint32_t left = 0, right = vector_count(blobs);
+
+    while (left < right)
+    {
+        uint32_t mid = (left + right) / 2;
+        BlobFile* blob = (BlobFile*)vector_get(blobs, mid);
+
+        if (blob->filenum == filenum)
+            return blob;
+
+        if (blob->filenum < filenum)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+
+    return NULL;
+}
+
+BlobFile* sst_blob_file(SST* self, uint32_t filenum)
+{
+    return _blob_file_find(self->blob_files, filenum);
+}
+
+void sst_pin_blobs(SST* self, Vector* blobs)
+{
+    for (uint32_t i = 0; i < vector_count(self->blob_files); i++)
+    {
+        BlobFile* blob = (BlobFile*)vector_get(self->blob_files, i);
+
+        blob->pins++;
+        vector_add(blobs, blob);
+    }
+}
+
+void sst_unpin_blobs(SST* self, Vector* blobs)
+{
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_lock(&self->lock);
+#endif
+
+    for (uint32_t i = 0; i < vector_count(blobs); i++)
+    {
+        BlobFile* blob = (BlobFile*)vector_get(blobs, i);
+
+        if (--blob->pins == 0 && blob->deleted)
+            blob_file_free(blob);
+    }
+
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_unlock(&self->lock);
+#endif
+}
+
+int sst_read_pinned_blob(Vector* blobs, Variant* value)
+{
+    BlobRef ref;
+    BlobFile* blob;
+
+    if (!blob_ref_decode(value, &ref) || !(blob = _blob_file_find(blobs, ref.filenum)))
+    {
+        ERROR("Dangling blob reference of %u bytes", value->length);
+        return 0;
+    }
+
+    return blob_file_read(blob, &ref, value);
+}
+
+void sst_blob_add(SST* self, BlobFile* blob)
+{
+    uint32_t pos = vector_count(self->blob_files);
+
+    // Files are mostly added in the order they were created
+    vector_add(self->blob_files, blob);
+
+    while (pos > 0 && ((BlobFile*)vector_get(self->blob_files, pos - 1))->filenum > blob->filenum)
+    {
+        vector_set(self->blob_files, pos, vector_get(self->blob_files, pos - 1));
+        pos--;
+    }
+
+    vector_set(self->blob_files, pos, blob);
+    _edit_blob(self->edit, blob);
+}
+
+void sst_blob_garbage(SST* self, const BlobRef* ref)
+{
+    BlobFile* blob = sst_blob_file(self, ref->filenum);
+
+    if (!blob)
+        return;
+
+    blob->garbage_bytes += ref->size;
+
+    if (!blob->dirty)
+    {
+        blob->dirty = 1;
+        vector_add(self->dirty_blobs, blob);
+    }
+
+    if (blob->garbage_bytes < blob->total_bytes)
+        return;
+
+    for (uint32_t i = 0; i < vector_count(self->blob_files); i++)
+    {
+        if (vector_get(self->blob_files, i) == blob)
+        {
+            vector_remove(self->blob_files, i);
+            break;
+        }
+    }
+
+    vector_add(self->dead_blobs, blob);
+}
+
+static int _sst_read_blob(SST* self, Variant* value)
+{
+    BlobRef ref;
+    BlobFile* blob;
+
+    if (!blob_ref_decode(value, &ref) || !(blob = sst_blob_file(self, ref.filenum)))
+    {
+        ERROR("Dangling blob reference of %u bytes", value->length);
+        return 0;
+    }
+
+    return blob_file_read(blob, &ref, value);
+}
+
+int sst_read_blob(SST* self, Variant* value)
+{
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_lock(&self->lock);
+#endif
+
+    int ret = _sst_read_blob(self, value);
+
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_unlock(&self->lock);
+#endif
+
+    return ret;
+}
+
+// Fills targets with the files that may hold key, in the order they have
+// to be probed
+static void _sst_get_targets(SST* self, Variant* key)
+{
+    vector_clear(self->targets);
+
+    for (int level = 0; level < MAX_LEVELS; level++)
+    {
+        if (self->num_files[level] == 0)
+            continue;
+
+        if (level == 0)
+        {
+            const uint32_t* positions;
+            uint32_t count = interval_index_find(self->level0_index, key, &positions);
+
+            for (uint32_t i = 0; i < count; i++)
+                vector_add(self->targets, self->files[0][positions[i]]);
+        }
+        else
+        {
+            uint32_t start = sst_find_file(self, level, key);
+
+            if (start >= self->num_files[level] ||
+                comparator_variant_cmp(self->options.comparator, key, self->files[level][start]->smallest_key) < 0)
+                continue;
+
+//            DEBUG("Adding possible target %s", self->files[level][start]->loader->file->filename);
+
+            vector_add(self->targets, self->files[level][start]);
+        }
+    }
+}
+
+int sst_get(SST* self, Variant* key, Variant* value)
+{
+#ifdef BACKGROUND_MERGE
+    int ret = 0;
+    OPT mem_opt;
+
+    pthread_mutex_lock(&self->cv_lock);
+    if (self->immutable)
+    {
+        DEBUG("Serving sst_get request from immutable memtable");
+        ret = memtable_get(self->immutable_list, key, value, &mem_opt);
+    }
+    pthread_mutex_unlock(&self->cv_lock);
+
+    if (ret)
+        return mem_opt == ADD;
+
+    pthread_mutex_lock(&self->lock);
+#endif
+
+    _sst_get_targets(self, key);
 
-    while (i < tlen && src < len)
+    int found = 0, seek_compaction = 0;
+    OPT opt = DEL;
+    SSTMetadata* missed = NULL;
+
+    for (uint32_t i = 0; i < vector_count(self->targets); i++)
     {
-        SSTMetadata* target = targets[i];//*(targets + i);
-        SSTMetadata* current = arr[dst];//*(arr + dst);
+//        DEBUG("Looking for key %.*s inside %s", key->length, key->mem, ((SSTMetadata*)vector_get(self->targets, i))->loader->file->filename);
+        SSTMetadata* target = (SSTMetadata *)vector_get(self->targets, i);
+
+        // The previous file was read for nothing since we had to go on
+        if (missed)
+            seek_compaction |= _charge_seek(self, missed);
+
+        missed = target;
 
-        if (target == current)
+        if (sst_loader_get(target->loader, key, value, &opt) == 1)
         {
-            src++;
-            i++;
+            found = 1;
+            break;
         }
-        else
+
+        // The range tombstones of the file hide the key in every older file
+        if (range_del_index_covers(target->loader->range_del_index, key))
         {
-            dst++;
-            src++;
+            opt = DEL;
+            break;
         }
+    }
 
-        arr[dst] = arr[src];
+    // The value of a blob entry must be read before the blob file can be
+    // deleted by a compaction
+    if (found && opt == BLOB)
+    {
+        if (_sst_read_blob(self, value))
+            opt = ADD;
+        else
+            found = 0;
     }
 
-    while (src < len)
-        arr[dst++] = arr[src++];
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_unlock(&self->lock);
+#endif
+
+    // The merge thread takes the sst lock while holding cv_lock: it must be
+    // woken up only after the lock has been released
+    if (seek_compaction)
+        _schedule_seek_compaction(self);
 
-    // Just to get a clean crash! Trust me I am not an engineer
-    while (dst < len)
-        arr[dst++] = NULL;
+    return found && opt == ADD;
 }
 
-void sst_file_delete(SST* self, uint32_t level, uint32_t count, SSTMetadata** files)
+// State of a sst_multi_get(): found[i] and opts[i] hold what the file
+// done[i] stopped at returned, missed[i] the last file probed for nothing.
+typedef struct _multi_get {
+    Variant** keys;
+    Variant** values;
+    int* found;
+    OPT* opts;
+    uint8_t* done;
+    SSTMetadata** missed;
+
+    // The keys looked up in the same file
+    uint32_t count;
+    uint32_t* batch;
+    Variant** batch_keys;
+    Variant** batch_values;
+    OPT* batch_opts;
+    int* batch_found;
+} MultiGet;
+
+// Looks up the batch of keys in the file, returns 1 if a seek compaction
+// has to be scheduled
+static int _sst_multi_get_file(SST* self, SSTMetadata* target, MultiGet* get)
 {
-    assert(level < MAX_LEVELS);
+    int seek_compaction = 0;
 
-    _sst_file_delete(count, self->num_files[level], files, self->files[level]);
-    self->files[level] = realloc(self->files[level], sizeof(SSTMetadata*) * self->num_files[level]);
-
-    self->num_files[level] -= count;
-    self->file_count -= count;
+    if (get->count == 0)
+        return 0;
 
-    for (int i = 0; i < count; i++)
+    for (uint32_t k = 0; k < get->count; k++)
     {
-        SSTMetadata* meta = *(files + i);
-        INFO("Deleting %s", meta->loader->file->filename);
-        unlink(meta->loader->file->filename);
-        sst_metadata_free(meta);
+        get->batch_keys[k] = get->keys[get->batch[k]];
+        get->batch_values[k] = get->values[get->batch[k]];
     }
-}
 
-void sst_file_add(SST* self, SSTMetadata* meta)
-{
-    self->file_count++;
-    self->files[meta->level] = realloc(self->files[meta->level], sizeof(SSTMetadata*) * (self->num_files[meta->level] + 1));
-    *(self->files[meta->level] + self->num_files[meta->level]++) = meta;
+    sst_loader_multi_get(target->loader, get->count, get->batch_keys,
+                         get->batch_values, get->batch_opts, get->batch_found);
 
-    _write_manifest(self);
+    for (uint32_t k = 0; k < get->count; k++)
+    {
+        uint32_t i = get->batch[k];
 
-    _sort_files(self);
-#ifndef BACKGROUND_MERGE
-    _schedule_compaction(self);
-#endif
-}
+        if (get->missed[i])
+            seek_compaction |= _charge_seek(self, get->missed[i]);
 
-File* sst_filename_new(SST* self, uint32_t level, uint32_t filenum)
-{
-    File* file_ = file_new();
-    snprintf(file_->filename, MAX_FILENAME, "%s/%d", self->basedir, level);
-    mkdirp(file_->filename);
-    snprintf(file_->filename, MAX_FILENAME, "%s/%d/%d.sst", self->basedir, level, filenum);
-    return file_;
+        get->missed[i] = target;
+
+        if (get->batch_found[k])
+        {
+            get->found[i] = get->done[i] = 1;
+            get->opts[i] = get->batch_opts[k];
+        }
+        else if (range_del_index_covers(target->loader->range_del_index, get->keys[i]))
+        {
+            get->done[i] = 1;
+            get->opts[i] = DEL;
+        }
+    }
+
+    get->count = 0;
+    return seek_compaction;
 }
 
-int sst_file_new(SST* self, uint32_t level, File** file, SSTBuilder** builder, SSTMetadata** meta)
+static int _sst_multi_get_level0(SST* self, MultiGet* get, uint32_t num_keys)
 {
-    uint32_t filenum = self->last_id++;
-    File* file_ = sst_filename_new(self, level, filenum);
+    int seek_compaction = 0;
+    uint32_t num_files = self->num_files[0];
+    const uint32_t* positions;
+
+    // starts[j] is where the keys of the file j begin in by_file, in the
+    // order of the keys
+    uint32_t* starts = calloc(num_files + 1, sizeof(uint32_t));
+
+    if (!starts)
+        PANIC("NULL allocation");
 
-    if (!writable_file_new(file_))
+    for (uint32_t i = 0; i < num_keys; i++)
     {
-        ERROR("Unable to open file %s for writing", file_->filename);
+        if (get->done[i])
+            continue;
 
-        file_free(file_);
-        return 0;
+        uint32_t count = interval_index_find(self->level0_index, get->keys[i], &positions);
+
+        for (uint32_t p = 0; p < count; p++)
+            starts[positions[p] + 1]++;
     }
 
-    *file = file_;
-    *builder = sst_builder_new(file_);
-    *meta = sst_metadata_new(level, filenum);
+    for (uint32_t j = 0; j < num_files; j++)
+        starts[j + 1] += starts[j];
 
-    return 1;
-}
+    uint32_t* by_file = malloc(sizeof(uint32_t) * (starts[num_files] + 1));
+    uint32_t* fill = malloc(sizeof(uint32_t) * (num_files + 1));
 
-static void _sst_merge_into(SST* self, SkipNode* node, SkipNode* last, size_t count, SSTMetadata* meta, File* file, SSTBuilder* builder)
-{
-    OPT opt;
-    Variant* key = buffer_new(1024);
-    Variant* value = buffer_new(1024);
+    if (!by_file || !fill)
+        PANIC("NULL allocation");
 
-    for (int i = 0; i < count/* && node != last*/; i++)
-    {
-        memtable_extract_node(node, key, value, &opt);
+    memcpy(fill, starts, sizeof(uint32_t) * num_files);
 
-        if (i == 0)
-            buffer_putnstr(meta->smallest_key, key->mem, key->length);
+    for (uint32_t i = 0; i < num_keys; i++)
+    {
+        if (get->done[i])
+            continue;
 
-        if (i == count - 1)
-            buffer_putnstr(meta->largest_key, key->mem, key->length);
+        uint32_t count = interval_index_find(self->level0_index, get->keys[i], &positions);
 
-        sst_builder_add(builder, key, value, opt);
-        node = node->forward[0];
+        for (uint32_t p = 0; p < count; p++)
+            by_file[fill[positions[p]]++] = i;
     }
 
-    buffer_free(key);
-    buffer_free(value);
+    for (uint32_t j = num_files; j-- > 0;)
+    {
+        for (uint32_t k = starts[j]; k < starts[j + 1]; k++)
+        {
+            if (!get->done[by_file[k]])
+                get->batch[get->count++] = by_file[k];
+        }
 
-    sst_builder_free(builder);
-    file_close(file);
+        seek_compaction |= _sst_multi_get_file(self, self->files[0][j], get);
+    }
 
-    // Now we need to create an sst loader and insert it in the right place
-    // and we just reuse the file object we have
-    meta->filesize = file_size(file);
-    meta->loader = sst_loader_new(self->cache, file, meta->level, meta->filenum);
-    meta->allowed_seeks = (meta->filesize / 16384);
+    free(fill);
+    free(by_file);
+    free(starts);
 
-    if (meta->allowed_seeks < 100)
-        meta->allowed_seeks = 100;
+    return seek_compaction;
 }
 
-void sst_merge(SST* self, MemTable* mem)
-#ifdef BACKGROUND_MERGE
+int sst_multi_get(SST* self, uint32_t num_keys, Variant** keys, Variant** values, int* found)
 {
-    pthread_mutex_lock(&self->cv_lock);
+    MultiGet get;
+    int seek_compaction = 0;
+
+    get.keys = keys;
+    get.values = values;
+    get.found = found;
+    get.opts = malloc(sizeof(OPT) * num_keys);
+    get.done = calloc(num_keys, sizeof(uint8_t));
+    get.missed = calloc(num_keys, sizeof(SSTMetadata*));
+    get.count = 0;
+    get.batch = malloc(sizeof(uint32_t) * num_keys);
+    get.batch_keys = malloc(sizeof(Variant*) * num_keys);
+    get.batch_values = malloc(sizeof(Variant*) * num_keys);
+    get.batch_opts = malloc(sizeof(OPT) * num_keys);
+    get.batch_found = malloc(sizeof(int) * num_keys);
+
+    if (!get.opts || !get.done || !get.missed || !get.batch || !get.batch_keys ||
+        !get.batch_values || !get.batch_opts || !get.batch_found)
+        PANIC("NULL allocation");
+
+    memset(found, 0, sizeof(int) * num_keys);
 
-    while (self->merge_state != 0)
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_lock(&self->cv_lock);
+    if (self->immutable)
     {
-        pthread_mutex_unlock(&self->cv_lock);
-        usleep(1000);
-        pthread_mutex_lock(&self->cv_lock);
+        for (uint32_t i = 0; i < num_keys; i++)
+        {
+            if (memtable_get(self->immutable_list, keys[i], values[i], &get.opts[i]))
+                found[i] = get.done[i] = 1;
+        }
     }
-
-    // We need to get a reference to the skiplist and to the logfile
-    pthread_mutex_lock(&self->immutable_lock);
-
-    self->immutable = mem;
-    self->immutable_list = mem->list;
-    skiplist_acquire(mem->list);
-
-    INFO("IN sst_merge the REFCOUNT IS at %d", mem->list->refcount);
-
-    pthread_mutex_unlock(&self->immutable_lock);
-
-    self->merge_state |= MERGE_STATUS_INPUT;
-
-    pthread_cond_signal(&self->cv);
     pthread_mutex_unlock(&self->cv_lock);
-}
 
-void sst_merge_real(SST* self, SkipList* list)
+    pthread_mutex_lock(&self->lock);
 #endif
-{
-    INFO("Compacting the memtable to a SST file");
 
-    File* file;
-    SSTBuilder* builder;
-    SSTMetadata* meta;
-    uint32_t level = 0;
+    // The files of level 0 overlap: the index tells which ones hold each
+    // key, and the keys are gathered by file so that these are probed
+    // newest first with all of their keys at once
+    if (self->num_files[0] > 0)
+        seek_compaction |= _sst_multi_get_level0(self, &get, num_keys);
 
-    SkipNode* first = skiplist_first(list);
-    SkipNode* last = skiplist_last(list);
+    // The other levels are sorted like the keys: both are walked at once
+    for (int level = 1; level < MAX_LEVELS; level++)
+    {
+        uint32_t j = 0;
 
-    OPT opt;
-    Variant* smallest = buffer_new(1);
-    Variant* largest = buffer_new(1);
+        for (uint32_t i = 0; i < num_keys && j < self->num_files[level]; i++)
+        {
+            if (get.done[i])
+                continue;
 
-    memtable_extract_node(first, smallest, NULL, &opt);
-    memtable_extract_node(last, largest, NULL, &opt);
+            while (j < self->num_files[level] &&
+                   comparator_variant_cmp(self->options.comparator, keys[i], self->files[level][j]->largest_key) > 0)
+            {
+                seek_compaction |= _sst_multi_get_file(self, self->files[level][j], &get);
+                j++;
+            }
 
-    level = sst_pick_level_for_compaction(self, smallest, largest);
+            if (j < self->num_files[level] &&
+                comparator_variant_cmp(self->options.comparator, keys[i], self->files[level][j]->smallest_key) >= 0)
+                get.batch[get.count++] = i;
+        }
 
-    buffer_free(smallest);
-    buffer_free(largest);
+        if (j < self->num_files[level])
+            seek_compaction |= _sst_multi_get_file(self, self->files[level][j], &get);
+    }
 
-    if (!sst_file_new(self, level, &file, &builder, &meta))
-        PANIC("Unable to compact memtable");
+    int num_found = 0;
 
-    INFO("Compaction of %d [%d bytes allocated] elements started", list->count, list->allocated);
-    _sst_merge_into(self, first, list->hdr, list->count, meta, file, builder);
-    INFO("Compaction of %d elements finished", list->count);
+    for (uint32_t i = 0; i < num_keys; i++)
+    {
+        // As in sst_get(), the blobs are read while holding the lock
+        if (found[i] && get.opts[i] == BLOB)
+        {
+            if (_sst_read_blob(self, values[i]))
+                get.opts[i] = ADD;
+            else
+                found[i] = 0;
+        }
+
+        found[i] = found[i] && get.opts[i] == ADD;
+        num_found += found[i];
+    }
 
 #ifdef BACKGROUND_MERGE
-    pthread_mutex_lock(&self->lock);
+    pthread_mutex_unlock(&self->lock);
 #endif
 
-    // The lock must be held
-    sst_file_add(self, meta);
+    if (seek_compaction)
+        _schedule_seek_compaction(self);
 
-    // At this point we can remove the old log since we have created the file
-    log_remove(self->immutable->log, self->immutable->lsn - 1);
+    free(get.opts);
+    free(get.done);
+    free(get.missed);
+    free(get.batch);
+    free(get.batch_keys);
+    free(get.batch_values);
+    free(get.batch_opts);
+    free(get.batch_found);
 
-#ifdef BACKGROUND_MERGE
-    pthread_mutex_unlock(&self->lock);
-#endif
+    return num_found;
 }
 
-int sst_get(SST* self, Variant* key, Variant* value)
+int sst_get_pinned(SST* self, Variant* key, Variant* value, Variant* scratch, SSTPin* pin)
 {
+    memset(pin, 0, sizeof(SSTPin));
+
 #ifdef BACKGROUND_MERGE
     int ret = 0;
+    OPT mem_opt;
 
     pthread_mutex_lock(&self->cv_lock);
     if (self->immutable)
     {
-        DEBUG("Serving sst_get request from immutable memtable");
-        ret = memtable_get(self->immutable_list, key, value);
+        buffer_clear(scratch);
+        ret = memtable_get(self->immutable_list, key, scratch, &mem_opt);
     }
     pthread_mutex_unlock(&self->cv_lock);
 
     if (ret)
-        return ret;
+    {
+        value->mem = scratch->mem;
+        value->length = scratch->length;
+        return mem_opt == ADD;
+    }
 
     pthread_mutex_lock(&self->lock);
 #endif
 
-    vector_clear(self->targets);
+    _sst_get_targets(self, key);
 
-    for (int level = 0; level < MAX_LEVELS; level++)
+    int found = 0, seek_compaction = 0;
+    OPT opt = DEL;
+    SSTMetadata* missed = NULL;
+    CacheEntry* block = NULL;
+
+    for (uint32_t i = 0; i < vector_count(self->targets); i++)
     {
-        if (self->num_files[level] == 0)
-            continue;
+        SSTMetadata* target = (SSTMetadata *)vector_get(self->targets, i);
 
-        if (level == 0)
+        if (missed)
+            seek_compaction |= _charge_seek(self, missed);
+
+        missed = target;
+
+        if (sst_loader_get_pinned(target->loader, key, value, scratch, &opt, &block) == 1)
         {
-            for (uint32_t i = 0; i < self->num_files[level]; i++)
-            {
-//                INFO("Compare %.*s %.*s = %d", key->length, key->mem, self->files[level][i]->smallest_key->length, self->files[level][i]->smallest_key->mem, variant_cmp(key, self->files[level][i]->smallest_key));
-//                INFO("Compare %.*s %.*s = %d", key->length, key->mem, self->files[level][i]->largest_key->length, self->files[level][i]->largest_key->mem, variant_cmp(key, self->files[level][i]->largest_key));
+            found = 1;
+            break;
+        }
 
-                if (variant_cmp(key, self->files[level][i]->smallest_key) >= 0 &&
-                    variant_cmp(key, self->files[level][i]->largest_key) <= 0)
-                {
-//                    INFO("ADDING IT");
-                    vector_add(self->targets, self->files[level][i]);
-                }
-            }
+        if (range_del_index_covers(target->loader->range_del_index, key))
+        {
+            opt = DEL;
+            break;
+        }
+    }
+
+    if (found && opt == BLOB)
+    {
+        BlobRef ref;
+        BlobFile* blob;
 
-            qsort(vector_data(self->targets),
-                  vector_count(self->targets),
-                  sizeof(SSTMetadata**), (int(*)(const void*, const void*))_compare_by_latest);
+        if (blob_ref_decode(value, &ref) && (blob = sst_blob_file(self, ref.filenum)) &&
+            blob_file_get(blob, &ref, value))
+        {
+            blob->pins++;
+            pin->blob = blob;
+            opt = ADD;
         }
         else
         {
-            uint32_t start = sst_find_file(self, level, key);
+            ERROR("Dangling blob reference of %u bytes", value->length);
+            found = 0;
+        }
+    }
+    else if (found && opt == ADD)
+    {
+        // The blocks not in the cache are the ones read from the mapping
+        if (block)
+        {
+            lru_pin(self->cache, block);
+            pin->block = block;
+        }
+        else
+        {
+            missed->pins++;
+            pin->meta = missed;
+        }
+    }
 
-            if (start >= self->num_files[level] ||
-                variant_cmp(key, self->files[level][start]->smallest_key) < 0)
-                continue;
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_unlock(&self->lock);
+#endif
 
-//            DEBUG("Adding possible target %s", self->files[level][start]->loader->file->filename);
+    if (seek_compaction)
+        _schedule_seek_compaction(self);
 
-            vector_add(self->targets, self->files[level][start]);
-        }
-    }
+    return found && opt == ADD;
+}
+
+void sst_unpin(SST* self, SSTPin* pin)
+{
+    if (!pin->block && !pin->meta && !pin->blob)
+        return;
 
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_lock(&self->lock);
+#endif
 
-    for (uint32_t i = 0; i < vector_count(self->targets); i++)
-    {
-//        DEBUG("Looking for key %.*s inside %s", key->length, key->mem, ((SSTMetadata*)vector_get(self->targets, i))->loader->file->filename);
-        OPT opt;
-        SSTMetadata* target = (SSTMetadata *)vector_get(self->targets, i);
+    if (pin->block)
+        lru_unpin(self->cache, pin->block);
 
-        if (--target->allowed_seeks <= 0)
-        {
-            _schedule_compaction(self);
-            target->allowed_seeks = target->filesize / 16384;
-        }
+    if (pin->meta && --pin->meta->pins == 0 && pin->meta->deleted)
+        sst_metadata_free(pin->meta);
+
+    if (pin->blob && --pin->blob->pins == 0 && pin->blob->deleted)
+        blob_file_free(pin->blob);
 
-        if (sst_loader_get(target->loader, key, value, &opt) == 1)
-        {
 #ifdef BACKGROUND_MERGE
-            pthread_mutex_unlock(&self->lock);
+    pthread_mutex_unlock(&self->lock);
 #endif
 
-            return opt == ADD;
-        }
+    memset(pin, 0, sizeof(SSTPin));
+}
+
+void sst_unpin_files(SST* self, uint32_t count, SSTMetadata** files)
+{
+#ifdef BACKGROUND_MERGE
+    pthread_mutex_lock(&self->lock);
+#endif
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (--files[i]->pins == 0 && files[i]->deleted)
+            sst_metadata_free(files[i]);
     }
 
 #ifdef BACKGROUND_MERGE
     pthread_mutex_unlock(&self->lock);
 #endif
-
-    return 0;
 }
 
 SSTMetadata* sst_metadata_new(uint32_t level, uint32_t filenum)
@@ -746,7 +2286,10 @@ SSTMetadata* sst_metadata_new(uint32_t level, uint32_t filenum)
     self->smallest_key = buffer_new(1);
     self->largest_key  = buffer_new(1);
     self->loader = NULL;
-    self->allowed_seeks = 100;
+    self->allowed_seeks = MIN_ALLOWED_SEEKS;
+    self->seek_queued = 0;
+    self->pins = 0;
+    self->deleted = 0;
     return self;
 }
 
@@ -773,20 +2316,20 @@ int sst_get_overlapping_inputs(SST* self, uint32_t level, Variant* begin, Varian
     {
         SSTMetadata* target = self->files[level][i];
 
-        if (range_intersects(begin, target->smallest_key, end, target->largest_key))
+        if (range_intersects(self->options.comparator, begin, target->smallest_key, end, target->largest_key))
         {
             additions++;
             if (inputs)
                 vector_add(inputs, target);
 
-            if (string_cmp(target->smallest_key->mem, begin->mem, target->smallest_key->length, begin->length) < 0)
+            if (comparator_variant_cmp(self->options.comparator, target->smallest_key, begin) < 0)
             {
                 begin = target->smallest_key;
                 if (inputs)
                     vector_clear(inputs);
                 i = -1;
             }
-            if (string_cmp(target->largest_key->mem, end->mem, target->largest_key->length, end->length) > 0)
+            if (comparator_variant_cmp(self->options.comparator, target->largest_key, end) > 0)
             {
                 end = target->largest_key;
                 if (inputs)
@@ -832,22 +2375,44 @@ int sst_get_overlapping_inputs(SST* self, uint32_t level, Variant* begin, Varian
     return additions;
 }
 
+// Number of fences below prefix (or not above it when inclusive). The
+// comparison selects the half to go on with instead of branching on it,
+// so the search runs without mispredictions.
+static inline uint32_t _fence_bound(const uint64_t* fences, uint32_t count, uint64_t prefix, int inclusive)
+{
+    const uint64_t* base = fences;
+
+    if (count == 0)
+        return 0;
+
+    while (count > 1)
+    {
+        uint32_t half = count / 2;
+        base += (base[half] < prefix || (inclusive && base[half] == prefix)) ? half : 0;
+        count -= half;
+    }
+
+    return (base - fences) + (*base < prefix || (inclusive && *base == prefix));
+}
+
 int sst_find_file(SST* self, uint32_t level, Variant* smallest)
 {
-    uint32_t left = 0;
-    uint32_t right = self->num_files[level];
+    uint64_t prefix = comparator_prefix(self->options.comparator, smallest->mem, smallest->length);
+    uint32_t left = _fence_bound(self->fences[level], self->num_files[level], prefix, 0);
 
-//    DEBUG("Checking in level %d", level);
+    // Only the files whose largest key shares the prefix need their key
+    // compared, they usually are none or one
+    if (left == self->num_files[level] || self->fences[level][left] != prefix)
+        return left;
+
+    uint32_t right = left + _fence_bound(self->fences[level] + left, self->num_files[level] - left, prefix, 1);
 
     while (left < right)
     {
         uint32_t mid = (left + right) / 2;
         SSTMetadata* meta = *(self->files[level] + mid);
 
-//        DEBUG("left %d right %d mid %d", left, right, mid);
-//        DEBUG("Compare %.*s %.*s = %d", meta->largest_key->length, meta->largest_key->mem,  smallest->length, smallest->mem, variant_cmp(meta->largest_key, smallest));
-
-        if (variant_cmp(meta->largest_key, smallest) < 0)
+        if (comparator_variant_cmp(self->options.comparator, meta->largest_key, smallest) < 0)
             left = mid + 1;
         else
             right = mid;
@@ -865,7 +2430,7 @@ int sst_range_overlaps(SST* self, uint32_t level, Variant* start, Variant* stop)
         for (uint32_t i = 0; i < self->num_files[level]; i++)
         {
             curr = *(self->files[level] + i);
-            if (range_intersects(start, curr->smallest_key, stop, curr->largest_key))
+            if (range_intersects(self->options.comparator, start, curr->smallest_key, stop, curr->largest_key))
             {
                 DEBUG("Range [%.*s, %.*s] DOES overlap in level 0. Checking others",
                       start->length, start->mem,
@@ -887,7 +2452,7 @@ int sst_range_overlaps(SST* self, uint32_t level, Variant* start, Variant* stop)
         return 0;
 
     curr = *(self->files[level] + pos);
-    int ret = range_intersects(start, curr->smallest_key, stop, curr->largest_key);
+    int ret = range_intersects(self->options.comparator, start, curr->smallest_key, stop, curr->largest_key);
 
     DEBUG("Range [%.*s, %.*s] DOES%s overlap in level %d. Checking others",
           start->length, start->mem,
@@ -942,14 +2507,16 @@ void sst_compact(SST* self)
     if (self->comp_score >= 1)
     {
         INFO("Starting compaction. Compaction level: %d Score: %f", self->comp_level, self->comp_score);
-        comp = compaction_new(self, self->comp_level);
+        comp = self->comp_in_place ? compaction_new_in_place(self, self->comp_file) :
+                                     compaction_new(self, self->comp_level, self->comp_file);
+        self->comp_file = NULL;
+        self->comp_in_place = 0;
     }
 
     if (!comp)
         return;
 
     self->under_compaction = 1;
-    int needs_reset = 0, drop = 0;
     uint64_t count = 0;
 
     OPT opt = ADD;
@@ -966,49 +2533,47 @@ void sst_compact(SST* self)
 
         // Check to see if the actual key is a deletion mark
         if (opt == DEL && compaction_is_base_level_for(comp, key))
+            continue;
+
+        if (compaction_is_range_deleted(comp, key, merge_iterator_loader(iter)))
         {
-            drop = 1;
+            compaction_drop(comp, value, opt);
             continue;
         }
 
-        drop = 0;
+        // Expired values and the ones the user filter rejects
+        if (!(value = compaction_filter(comp, key, value, &opt)))
+            continue;
+
+        compaction_add_range_dels(comp, key);
 
-        if (!comp->builder || needs_reset)
+        // Cut the current output before the key if it starts to overlap too
+        // much with the grandparents.
+        int cut = merge_iterator_exceeds_overlap(iter, key);
+        if (!comp->builder || cut)
         {
-            needs_reset = 0;
-            compaction_new_output_file(comp);
+            if (!compaction_new_output_file(comp))
+                PANIC("Unable to create a new output file");
 
             buffer_clear(comp->meta->smallest_key);
             buffer_putnstr(comp->meta->smallest_key, key->mem, key->length);
 
             INFO("New output file for level %d: %s", comp->level, comp->file->filename);
         }
-        else if (merge_iterator_exceeds_overlap(iter, key))
-        {
-            buffer_clear(comp->meta->largest_key);
-            buffer_putnstr(comp->meta->largest_key, key->mem, key->length);
-            needs_reset = 1;
-        }
 
         count++;
         sst_builder_add(comp->builder, key, value, opt);
-    }
-
-    assert(count > 0);
 
-    INFO("Merge successfully completed with %d keys merged", count);
+        if (opt == BLOB)
+            sst_builder_add_expiration(comp->builder, comp->expiration);
 
-    if (drop && comp->builder->data_block->last_key)
-    {
-        // If we are it means that the block was ended with a dropped key
-        // You have to check out this to see if it safe
-        key = comp->builder->data_block->last_key;
-        WARN("SST file %s was ended by a dropped key.", comp->file->filename);
-        WARN("Check out the the key %.*s is actually the last key of the file", key->length, key->mem);
+        buffer_clear(comp->meta->largest_key);
+        buffer_putnstr(comp->meta->largest_key, key->mem, key->length);
     }
 
-    buffer_clear(comp->meta->largest_key);
-    buffer_putnstr(comp->meta->largest_key, key->mem, key->length);
+    compaction_add_range_dels(comp, NULL);
+
+    INFO("Merge successfully completed with %d keys merged", count);
 
     compaction_install(comp);
     merge_iterator_free(iter);
@@ -11,6 +11,9 @@
 #include "vector.h"
 #include "file.h"
 #include "lru.h"
+#include "options.h"
+#include "blob.h"
+#include "interval_index.h"
 
 /*
  * We organize the entire SST in directories. The basedir just
@@ -21,6 +24,7 @@
  *   $basedir/si/0/1.sst
  *   $basedir/si/1/2.sst
  *   $basedir/si/0.log
+ *   $basedir/si/blob/3.blob
  */
 
 typedef struct _sst_metadata {
@@ -28,11 +32,20 @@ typedef struct _sst_metadata {
     uint32_t level;
     uint64_t filesize;
 
+    // Gets that had to probe this file without finding their answer in it
+    // before the file gets compacted into the next level. Readers update it
+    // concurrently, only through the atomic builtins.
     int allowed_seeks;
+    int seek_queued;
 
     Variant* smallest_key;
     Variant* largest_key;
     SSTLoader* loader;
+
+    // Values handed out by sst_get_pinned() that point into the mapping: a
+    // deleted file is freed by the release of the last of them
+    uint32_t pins;
+    unsigned deleted:1;
 } SSTMetadata;
 
 SSTMetadata* sst_metadata_new(uint32_t level, uint32_t filenum);
@@ -41,6 +54,7 @@ void sst_metadata_free(SSTMetadata* self);
 #define MERGE_STATUS_EXIT    1
 #define MERGE_STATUS_INPUT   2
 #define MERGE_STATUS_COMPACT 4
+#define MERGE_STATUS_SEEK    8
 
 typedef struct _sst {
     char basedir[MAX_FILENAME];
@@ -49,13 +63,37 @@ typedef struct _sst {
 
     uint32_t last_id;
     uint32_t file_count;
+
+    // Log of the changes to the files, opened for appending. Edits gather
+    // the changes of the next commit, written as one record of the log
+    // that grows from a snapshot of manifest_snapshot bytes.
     File* manifest;
+    Buffer* edit;
+    uint64_t manifest_snapshot;
+
+    Options options;
 
     int comp_level;
     double comp_score;
+    SSTMetadata* comp_file; // file to start from, NULL for size compactions
+    unsigned comp_in_place:1; // comp_file is rewritten into its own level
+
+    // Size in bytes each level is allowed to reach before being compacted.
+    // Recomputed on every evaluation when dynamic_level_bytes is set.
+    double level_target[MAX_LEVELS];
 
     Vector* targets;
     LRU* cache;
+    ThreadPool* pool; // used by the sst builders, NULL without threads
+
+    // Files that ran out of allowed seeks, in the order they did
+    Vector* seek_queue;
+
+    // Blob files sorted by filenum, and the ones left with nothing but
+    // garbage: they are deleted once the manifest no longer lists them
+    Vector* blob_files;
+    Vector* dead_blobs;
+    Vector* dirty_blobs; // whose garbage the manifest is not up to date with
 
 #ifdef BACKGROUND_MERGE
     MemTable* immutable;
@@ -63,6 +101,7 @@ typedef struct _sst {
     pthread_mutex_t immutable_lock;
 
     pthread_mutex_t lock;
+    pthread_mutex_t seek_lock;
 
     int merge_state;
     pthread_mutex_t cv_lock;
@@ -72,22 +111,75 @@ typedef struct _sst {
 #endif
 
     // Files in level 0 may overlap regarding ranges, while in upper levels
-    // this is not allowed
+    // this is not allowed. Each level is kept in order as files come and
+    // go: level 0 from the oldest file to the newest one, the others by
+    // smallest key. max_files is the room the arrays have.
     uint32_t num_files[MAX_LEVELS];
+    uint32_t max_files[MAX_LEVELS];
     SSTMetadata** files[MAX_LEVELS];
+
+    // Fence pointers: comparator_prefix() of the largest key of each file, in the
+    // same order. sst_find_file() searches them before any key.
+    uint64_t* fences[MAX_LEVELS];
+
+    // Ranges of the files of level 0, whose positions the lookups get back
+    // newest first. Built again by the commits changing the level.
+    IntervalIndex* level0_index;
+    unsigned level0_changed:1;
 } SST;
 
-SST* sst_new(const char* basedir, uint64_t cache_size);
+SST* sst_new(const char* basedir, const Options* options);
 void sst_free(SST* self);
 
 void sst_merge(SST* self, MemTable* mem);
 void sst_compact(SST* self);
 File* sst_filename_new(SST *self, uint32_t level, uint32_t filenum);
-int sst_file_new(SST* self, uint32_t level, File** file, SSTBuilder** builder, SSTMetadata** meta);
+int sst_file_new(SST* self, uint32_t level, uint64_t expected_size, File** file, SSTBuilder** builder, SSTMetadata** meta);
 void sst_file_add(SST* self, SSTMetadata* meta);
+void sst_file_add_many(SST* self, uint32_t count, SSTMetadata** files);
+void sst_file_move(SST* self, uint32_t level, uint32_t count, SSTMetadata** files);
 void sst_file_delete(SST* self, uint32_t level, uint32_t count, SSTMetadata** files);
 
 int sst_get(SST* self, Variant* key, Variant* value);
+
+// What keeps the value returned by sst_get_pinned() alive
+typedef struct _sst_pin {
+    CacheEntry* block; // the cached block holding it
+    SSTMetadata* meta; // the file whose mapping holds it
+    BlobFile* blob;    // the blob file holding it
+} SSTPin;
+
+// Same as sst_get() but value is pointed at the value where it is stored
+// instead of being copied, scratch being used for the search. Unless the
+// value comes from the immutable memtable (copied into scratch), it stays
+// valid until sst_unpin() is called on pin.
+int sst_get_pinned(SST* self, Variant* key, Variant* value, Variant* scratch, SSTPin* pin);
+void sst_unpin(SST* self, SSTPin* pin);
+
+// Releases files whose pins have been taken under the lock, as the
+// iterators do for the files they go through
+void sst_unpin_files(SST* self, uint32_t count, SSTMetadata** files);
+
+// Looks up the keys, sorted in ascending order, walking every level once
+// for all of them. Sets found[i] as sst_get() would return for keys[i] and
+// returns how many have been found.
+int sst_multi_get(SST* self, uint32_t num_keys, Variant** keys, Variant** values, int* found);
+
+// Blob files. The sst lock must be held by the callers of the functions
+// changing them, while sst_read_blob() takes it: it replaces the blob
+// reference in value with the value itself.
+BlobFile* sst_blob_file(SST* self, uint32_t filenum);
+void sst_blob_add(SST* self, BlobFile* blob);
+void sst_blob_garbage(SST* self, const BlobRef* ref);
+int sst_read_blob(SST* self, Variant* value);
+
+// Pins the blob files, under the lock, as the iterators do along with the
+// files they go through: the values these refer to are read from blobs by
+// sst_read_pinned_blob() without the lock, and even once their blob file
+// has been deleted, until sst_unpin_blobs()
+void sst_pin_blobs(SST* self, Vector* blobs);
+void sst_unpin_blobs(SST* self, Vector* blobs);
+int sst_read_pinned_blob(Vector* blobs, Variant* value);
 int sst_find_file(SST* self, uint32_t level, Variant* smallest);
 uint32_t sst_pick_level_for_compaction(SST* self, Variant* start, Variant* stop);
 int sst_get_overlapping_inputs(SST* self, uint32_t level, Variant* begin, Variant* end, Vector* inputs, Variant** pbegin, Variant** pend);
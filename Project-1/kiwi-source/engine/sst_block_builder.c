@@ -2,6 +2,7 @@
 #include "sst_block_builder.h"
 #include "indexer.h"
 #include "lib/kvec.h"
+#include "hash.h"
 
 SSTBlockBuilder* sst_block_builder_new(uint32_t flags, uint32_t restart_interval)
 {
@@ -20,6 +21,7 @@ SSTBlockBuilder* sst_block_builder_new(uint32_t flags, uint32_t restart_interval
     self->buffer = buffer_new(4096);
 
     kv_init(self->restarts);
+    kv_init(self->hashes);
 
     return self;
 }
@@ -29,6 +31,7 @@ void sst_block_builder_free(SSTBlockBuilder* self)
     buffer_free(self->last_key);
     buffer_free(self->buffer);
     kv_destroy(self->restarts);
+    kv_destroy(self->hashes);
     free(self);
 }
 
@@ -55,6 +58,11 @@ void sst_block_builder_add(SSTBlockBuilder* self, Variant* key, Variant* value,
 
     const size_t non_shared = key->length - shared;
 
+    if (self->flags & FLAG_HASH_INDEX)
+        kv_push(uint64_t, self->hashes,
+                ((uint64_t)hash(key->mem, key->length, HASH_INDEX_SEED) << 32) |
+                (kv_size(self->restarts) - 1));
+
 //    DEBUG("Key: %.*s Value: %.*s shared: %d non-shared: %d",
 //          key->length, key->mem, value->length, value->mem, shared, non_shared);
 
@@ -64,7 +72,8 @@ void sst_block_builder_add(SSTBlockBuilder* self, Variant* key, Variant* value,
     // Add preamble <shared><non-shared><value-length>
     buffer_putvarint32(self->buffer, shared);
     buffer_putvarint32(self->buffer, non_shared);
-    buffer_putvarint32(self->buffer, value->length + ((opt == ADD) ? 1 : 0));
+    buffer_putvarint32(self->buffer, (opt == DEL) ? 0 :
+                       (value->length + 1) | ((opt == BLOB) ? VALUE_BLOB_BIT : 0));
 
     // Add actual value <non-shared-key><value>
     buffer_putnstr(self->buffer, key->mem + shared, non_shared);
@@ -78,11 +87,53 @@ void sst_block_builder_add(SSTBlockBuilder* self, Variant* key, Variant* value,
     self->entries++;
 }
 
+static uint32_t _num_buckets(SSTBlockBuilder* self)
+{
+    uint32_t n = (uint32_t)(self->entries / BLOCK_HASH_UTIL_RATIO) + 1;
+    return MIN(n, UINT16_MAX);
+}
+
 size_t sst_block_builder_current_size(SSTBlockBuilder* self)
 {
-    return self->buffer->length +                       // data
-            kv_size(self->restarts) * sizeof(uint32_t) + // restart array
-            sizeof(uint32_t);                            // restart array length
+    size_t size = self->buffer->length +                       // data
+                  kv_size(self->restarts) * sizeof(uint32_t) + // restart array
+                  sizeof(uint32_t);                            // restart array length
+
+    if (self->flags & FLAG_HASH_INDEX)
+        size += _num_buckets(self) + sizeof(uint16_t);
+
+    return size;
+}
+
+static int _write_hash_index(SSTBlockBuilder* self)
+{
+    if (kv_size(self->restarts) > MAX_HASH_RESTARTS || kv_size(self->hashes) == 0)
+        return 0;
+
+    const uint32_t num_buckets = _num_buckets(self);
+    const size_t off = self->buffer->length;
+
+    for (uint32_t i = 0; i < num_buckets; i++)
+        buffer_putc(self->buffer, (char)BUCKET_EMPTY);
+
+    uint8_t* buckets = (uint8_t*)self->buffer->mem + off;
+
+    for (size_t i = 0; i < kv_size(self->hashes); i++)
+    {
+        uint64_t h = kv_A(self->hashes, i);
+        uint8_t restart = (uint8_t)(h & 0xff);
+        uint8_t* bucket = &buckets[(uint32_t)(h >> 32) % num_buckets];
+
+        if (*bucket == BUCKET_EMPTY)
+            *bucket = restart;
+        else if (*bucket != restart)
+            *bucket = BUCKET_COLLISION;
+    }
+
+    // Read back as an unsigned 16 bits count, see _num_buckets()
+    assert(num_buckets <= UINT16_MAX);
+    buffer_putuint16(self->buffer, (uint16_t)num_buckets);
+    return 1;
 }
 
 void sst_block_builder_flush(SSTBlockBuilder* self)
@@ -96,7 +147,12 @@ void sst_block_builder_flush(SSTBlockBuilder* self)
             buffer_putint32(self->buffer, (uint32_t)kv_A(self->restarts, i));
         }
 
-        buffer_putint32(self->buffer, (uint32_t)kv_size(self->restarts));
+        uint32_t num_restarts = (uint32_t)kv_size(self->restarts);
+
+        if ((self->flags & FLAG_HASH_INDEX) && _write_hash_index(self))
+            num_restarts |= HASH_INDEX_BIT;
+
+        buffer_putint32(self->buffer, num_restarts);
     }
 
     self->flags |= FLAG_FINISHED;
@@ -107,6 +163,7 @@ void sst_block_builder_reset(SSTBlockBuilder* self)
     buffer_clear(self->buffer);
     buffer_clear(self->last_key);
     kv_reset(self->restarts);
+    kv_reset(self->hashes);
 
     self->counter = 0;
     self->entries = 0;
@@ -26,6 +26,37 @@ We don't need bloom filters for the moment.
 #define FLAG_COMPRESS   1
 #define FLAG_INDEX      2
 #define FLAG_FINISHED   4
+#define FLAG_HASH_INDEX 8
+
+/* Data blocks end with their restart array:
+
+   [entries][restart offsets, int32 each][num_restarts int32]
+
+   With FLAG_HASH_INDEX a hash index is stored between the restart array
+   and its length, whose top bit (HASH_INDEX_BIT) is then set:
+
+   [entries][restart offsets][buckets, 1 byte each][num_buckets int16][num_restarts int32]
+
+   Every bucket holds the restart point of the keys hashed into it, or
+   BUCKET_EMPTY / BUCKET_COLLISION when no key or keys from different
+   restart points fall in it. Blocks with more than MAX_HASH_RESTARTS
+   restart points are written without hash index.
+ */
+
+/* Entries are stored as
+   <shared><non-shared><value-length><non-shared key><value>
+   where value-length is 0 for a deletion and the length of the value plus
+   one otherwise, with VALUE_BLOB_BIT set when the value is a reference to
+   a blob file.
+ */
+
+#define VALUE_BLOB_BIT    0x80000000u
+
+#define HASH_INDEX_BIT    0x80000000u
+#define BUCKET_EMPTY      255
+#define BUCKET_COLLISION  254
+#define MAX_HASH_RESTARTS 253
+#define HASH_INDEX_SEED   0x4b2a6f91
 
 // This object is responsible for building, reading an elementary block
 // which can be optionally compressed if specified
@@ -43,6 +74,9 @@ typedef struct _sst_block_builder {
     Variant* last_key;
     kvec_t(size_t) restarts;
 
+    // <hash of the key> << 32 | <restart point>, for the hash index
+    kvec_t(uint64_t) hashes;
+
     Buffer* buffer;
 } SSTBlockBuilder;
 
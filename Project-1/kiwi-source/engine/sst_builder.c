@@ -1,8 +1,6 @@
 #include "sst_builder.h"
 #include "crc32.h"
-#ifdef WITH_SNAPPY
-#include <snappy-c.h>
-#endif
+#include "ttl.h"
 
 static void shortest_separator(Variant *last_key, Variant *new_key)
 {
@@ -36,54 +34,37 @@ static void shortest_separator(Variant *last_key, Variant *new_key)
 //    DEBUG("Shortest separator result: %.*s", last_key->length, last_key->mem);
 }
 
-static void _write_block(SSTBuilder* self, SSTBlockBuilder* block, int skip_comp)
+// Compresses the block with the codec of the given type if it is worth
+// it, then appends the trailer <type><crc32>. Returns the buffer holding
+// the result: either compressed or the block buffer itself.
+static Buffer* _compress_block(SSTBlockBuilder* block, uint32_t type, const CodecDict* dict, Buffer* compressed)
 {
-    // Write the contents of the block to the file
     sst_block_builder_flush(block);
 
     uint32_t crc32;
-    int type = TYPE_NO_COMPRESSION;
-    size_t output_length = 0;
-    char* output = NULL;
-    Buffer *output_buffer, st_buffer;
+    Buffer* output_buffer = block->buffer;
+    const Codec* codec = codec_get(type);
 
-#ifdef WITH_SNAPPY
-    if (!skip_comp)
-    {
-        output_length = snappy_max_compressed_length(block->buffer->length);
-        output = (char *)malloc(output_length + sizeof(uint32_t) * 2);
-
-        if (snappy_compress(block->buffer->mem, block->buffer->length, output, &output_length) != SNAPPY_OK
-            || ((float)output_length / (float)block->buffer->length) > 0.8)
-        {
-            free(output);
-            output = NULL;
-            output_length = 0;
-        }
-        else
-        {
-            type = TYPE_SNAPPY_COMPRESSION;
-
-            st_buffer.mem = output;
-            st_buffer.length = output_length;
-            st_buffer.allocated = output_length + sizeof(uint32_t) * 2;
-            output_buffer = &st_buffer;
-        }
-    }
-#endif
-
-    if (type == TYPE_NO_COMPRESSION)
-    {
-        output = block->buffer->mem;
-        output_length = block->buffer->length;
-        output_buffer = block->buffer;
-    }
+    if (codec && codec->compress &&
+        codec->compress(block->buffer->mem, block->buffer->length, compressed, dict) &&
+        ((float)compressed->length / (float)block->buffer->length) <= COMPRESSION_RATIO_LIMIT)
+        output_buffer = compressed;
+    else
+        type = TYPE_NO_COMPRESSION;
 
     crc32 = crc32_extend(0, output_buffer->mem, output_buffer->length);
 
     buffer_putint32(output_buffer, type);
     buffer_putint32(output_buffer, crc32);
 
+    return output_buffer;
+}
+
+static void _write_block(SSTBuilder* self, SSTBlockBuilder* block, uint32_t type)
+{
+    // Write the contents of the block to the file
+    Buffer* output_buffer = _compress_block(block, type, self->dict, self->compressed);
+
     file_append(self->file, output_buffer);
 
     // The value of the index is the offset in the file pointing to the
@@ -91,31 +72,218 @@ static void _write_block(SSTBuilder* self, SSTBlockBuilder* block, int skip_comp
     buffer_clear(self->last_block_offset);
     buffer_putvarint64(self->last_block_offset, self->offset);
 
-//    DEBUG("Block @ offset: 0x%X crc32: %u", self->offset, crc32);
+    self->offset += output_buffer->length;
+    buffer_putvarint64(self->last_block_offset, output_buffer->length);
+}
+
+// Writes the current index partition among the data blocks and points the
+// top level index at it
+static void _sst_builder_cut_partition(SSTBuilder* self)
+{
+    // The flat index built so far is not needed anymore
+    if (self->metadata_index_partitions == 0)
+        sst_block_builder_reset(self->index_block);
+
+    _write_block(self, self->index_partition, self->compression);
+    buffer_putvarint64(self->last_block_offset, self->partition_first_block);
+
+    sst_block_builder_add(self->index_block, self->partition_key, self->last_block_offset, ADD);
+    sst_block_builder_reset(self->index_partition);
+
+    self->partition_first_block = self->indexed_blocks;
+    self->metadata_index_partitions++;
+}
+
+// Indexes the data block just written, whose handle is in last_block_offset
+static void _sst_builder_add_index(SSTBuilder* self, Variant* separator)
+{
+    self->indexed_blocks++;
+
+    if (self->metadata_index_partitions == 0)
+        sst_block_builder_add(self->index_block, separator, self->last_block_offset, ADD);
+
+    if (!self->index_partition)
+        return;
+
+    sst_block_builder_add(self->index_partition, separator, self->last_block_offset, ADD);
+
+    buffer_clear(self->partition_key);
+    buffer_putnstr(self->partition_key, separator->mem, separator->length);
+
+    if (sst_block_builder_current_size(self->index_partition) >= self->index_partition_size)
+        _sst_builder_cut_partition(self);
+}
+
+// Everything that can be done on a data block without knowing where it
+// will be placed in the file
+static void _sst_block_job_run(void* data)
+{
+    SSTBlockJob* job = (SSTBlockJob*)data;
+
+    job->output = _compress_block(job->block, job->type, job->dict, job->compressed);
 
 #ifdef WITH_BLOOM_FILTER
-    if (block == self->data_block)
-        bloom_builder_generate(self->bloom, self->offset, self->data_block);
+    bloom_builder_create_filter(BITS_PER_KEY, job->block, job->filter);
 #endif
+}
 
-    self->offset += output_buffer->length;
-    buffer_putvarint64(self->last_block_offset, output_buffer->length);
+static SSTBlockJob* _sst_block_job_new(SSTBuilder* builder)
+{
+    SSTBlockJob* job = calloc(1, sizeof(SSTBlockJob));
 
-    if (type != TYPE_NO_COMPRESSION)
-        free(output);
+    if (!job)
+        PANIC("NULL allocation");
+
+    job->block = sst_block_builder_new(builder->block_flags, builder->restart_interval);
+    job->compressed = buffer_new(builder->block_size);
+    job->filter = buffer_new(64);
+    job->separator = buffer_new(64);
+
+    job->task.run = _sst_block_job_run;
+    job->task.arg = job;
+
+    return job;
 }
 
-static void _sst_builder_flush(SSTBuilder* self)
+static void _sst_block_job_free(SSTBlockJob* job)
+{
+    sst_block_builder_free(job->block);
+    buffer_free(job->compressed);
+    buffer_free(job->filter);
+    buffer_free(job->separator);
+    free(job);
+}
+
+// Appends the completed blocks to the file, in order, along with their
+// index entry and filter. With wait set all of them are written, otherwise
+// it stops at the first one still being processed.
+static void _sst_builder_write_jobs(SSTBuilder* self, int wait)
+{
+    while (vector_count(self->pending) > 0)
+    {
+        SSTBlockJob* job = (SSTBlockJob*)vector_get(self->pending, 0);
+
+        // The index entry needs the first key of the next block
+        if (!job->has_separator || !job->submitted)
+            break;
+
+        if (self->pool)
+        {
+            if (wait)
+                thread_pool_wait(self->pool, &job->task);
+            else if (!thread_pool_is_done(self->pool, &job->task))
+                break;
+        }
+
+        file_append(self->file, job->output);
+
+        buffer_clear(self->last_block_offset);
+        buffer_putvarint64(self->last_block_offset, self->offset);
+        buffer_putvarint64(self->last_block_offset, job->output->length);
+
+        self->offset += job->output->length;
+
+        _sst_builder_add_index(self, job->separator);
+
+#ifdef WITH_BLOOM_FILTER
+        bloom_builder_add_filter(self->bloom, job->filter);
+#endif
+
+        vector_remove(self->pending, 0);
+        vector_add(self->spare, job);
+    }
+}
+
+static void _sst_builder_submit(SSTBuilder* self, SSTBlockJob* job)
 {
-    if (!self->block_written)
+    job->type = self->compression;
+    job->dict = self->dict;
+    job->submitted = 1;
+
+    if (self->pool)
+        thread_pool_submit(self->pool, &job->task);
+    else
+        _sst_block_job_run(job);
+}
+
+// Trains the dictionary on the blocks held so far, then lets them go
+static void _sst_builder_train_dict(SSTBuilder* self)
+{
+    uint32_t count = vector_count(self->pending);
+    size_t* sizes = malloc(sizeof(size_t) * (count + 1));
+    Buffer* samples = buffer_new(self->dict_samples + 1);
+
+    for (uint32_t i = 0; i < count; i++)
     {
-        _write_block(self, self->data_block, 0);
-        self->metadata_num_blocks++;
+        Buffer* block = ((SSTBlockJob*)vector_get(self->pending, i))->block->buffer;
+
+        buffer_putnstr(samples, block->mem, block->length);
+        sizes[i] = block->length;
     }
 
-    self->block_written = 1;
+    self->dict = codec_dict_train(samples->mem, sizes, count, self->dict_size);
+    self->dict_pending = 0;
+
+    DEBUG("Dictionary of %zu bytes trained on %u blocks",
+          self->dict ? self->dict->raw->length : 0, count);
+
+    free(sizes);
+    buffer_free(samples);
+
+    for (uint32_t i = 0; i < count; i++)
+        _sst_builder_submit(self, (SSTBlockJob*)vector_get(self->pending, i));
+}
+
+// Hands the current data block over to a job and starts a fresh one
+static void _sst_builder_flush(SSTBuilder* self)
+{
+    SSTBlockJob* job;
+
+    if (vector_count(self->spare) > 0)
+        job = (SSTBlockJob*)vector_remove(self->spare, vector_count(self->spare) - 1);
+    else
+        job = _sst_block_job_new(self);
+
+    SSTBlockBuilder* block = job->block;
+
+    job->block = self->data_block;
+    job->has_separator = 0;
+    job->submitted = 0;
+    self->data_block = block;
+
+    sst_block_builder_reset(self->data_block);
+
+    vector_add(self->pending, job);
+    self->metadata_num_blocks++;
     self->pending_index = 1;
-    self->needs_reset = 1;
+
+    if (!self->dict_pending)
+    {
+        _sst_builder_submit(self, job);
+        return;
+    }
+
+    // Hold the blocks until there are enough samples for the dictionary
+    self->dict_samples += job->block->buffer->length;
+
+    if (self->dict_samples >= ZSTD_DICT_SAMPLES_SIZE)
+        _sst_builder_train_dict(self);
+}
+
+static void _sst_builder_set_separator(SSTBuilder* self, Variant* key)
+{
+    SSTBlockJob* job = (SSTBlockJob*)vector_get(self->pending, vector_count(self->pending) - 1);
+    Variant* last_key = job->block->last_key;
+
+    buffer_clear(job->separator);
+    buffer_putnstr(job->separator, last_key->mem, last_key->length);
+
+    // Extract the shortest separator that indexes the block >= all keys
+    if (key && self->short_separators)
+        shortest_separator(job->separator, key);
+
+    job->has_separator = 1;
+    self->pending_index = 0;
 }
 
 static void _write_footer(SSTBuilder* self)
@@ -134,9 +302,6 @@ static void _write_footer(SSTBuilder* self)
     self->metadata_filter_size = self->bloom->buff->length;
 #endif
 
-    // Here just save as indexing term the last key and then we save the index block
-    sst_block_builder_add(self->index_block, self->data_block->last_key, self->last_block_offset, ADD);
-
     // Write the actual metadata
     buffer_clear(self->last_key);
     buffer_putint64(self->last_key, self->metadata_data_size);
@@ -152,6 +317,30 @@ static void _write_footer(SSTBuilder* self)
     buffer_putint64(self->last_key, bloom_size);
 #endif
 
+    // Deletion statistics and range tombstones. Files written before these
+    // were introduced simply have a shorter meta block.
+    buffer_putint64(self->last_key, self->metadata_num_deletions);
+    buffer_putint64(self->last_key, self->metadata_num_range_dels);
+    buffer_putnstr(self->last_key, self->range_dels->mem, self->range_dels->length);
+
+    // Compression dictionary, if any
+    buffer_putint64(self->last_key, self->dict ? self->dict->raw->length : 0);
+
+    if (self->dict)
+        buffer_putnstr(self->last_key, self->dict->raw->mem, self->dict->raw->length);
+
+    // Format version and the options the file has been built with
+    buffer_putint64(self->last_key, SST_FORMAT_VERSION);
+    buffer_putint64(self->last_key, self->block_size);
+    buffer_putint64(self->last_key, self->restart_interval);
+
+    // Number of index partitions, 0 for a flat index
+    buffer_putint64(self->last_key, self->metadata_index_partitions);
+
+    // When the first of the values expires, so the file can be compacted
+    // to drop them
+    buffer_putint64(self->last_key, self->metadata_min_expiration);
+
     size_t meta_off = self->offset;
     size_t meta_size = self->last_key->length;
 
@@ -159,7 +348,7 @@ static void _write_footer(SSTBuilder* self)
     self->offset += meta_size;
 
     size_t index_off = self->offset;
-    _write_block(self, self->index_block, 1);
+    _write_block(self, self->index_block, TYPE_NO_COMPRESSION);
 
     size_t index_size = self->index_block->buffer->length;
     self->metadata_index_size = index_size;
@@ -182,7 +371,20 @@ static void _write_footer(SSTBuilder* self)
 
 static void _sst_builder_finish(SSTBuilder* self)
 {
-    _sst_builder_flush(self);
+    // Files always hold at least a data block, even an empty one
+    if (self->data_block->entries > 0 || self->metadata_num_blocks == 0)
+        _sst_builder_flush(self);
+
+    if (self->dict_pending)
+        _sst_builder_train_dict(self);
+
+    // The last block is indexed by its last key
+    _sst_builder_set_separator(self, NULL);
+    _sst_builder_write_jobs(self, 1);
+
+    if (self->metadata_index_partitions > 0 && self->index_partition->entries > 0)
+        _sst_builder_cut_partition(self);
+
     _write_footer(self);
 
     buffer_putnstr(self->last_key, MAGIC_STR, 8);
@@ -191,7 +393,7 @@ static void _sst_builder_finish(SSTBuilder* self)
     file_close(self->file);
 }
 
-SSTBuilder* sst_builder_new(File* file)
+SSTBuilder* sst_builder_new(File* file, ThreadPool* pool, const Options* options, uint32_t level)
 {
     SSTBuilder* self = malloc(sizeof(SSTBuilder));
 
@@ -199,8 +401,24 @@ SSTBuilder* sst_builder_new(File* file)
         PANIC("NULL allocation");
 
     self->file = file;
+    self->pool = pool;
+
+    self->block_size = options->block_size[level];
+    self->restart_interval = options->restart_interval[level];
+    self->block_flags = FLAG_COMPRESS | (options->block_hash_index ? FLAG_HASH_INDEX : 0);
+    self->short_separators = comparator_is_bytewise(options->comparator);
+
+    self->blob = NULL;
+    self->min_blob_size = options->min_blob_size;
+    self->with_ttl = options->with_ttl;
+    self->blob_ref = buffer_new(16);
+
+    self->compression = options->compression[level];
+    self->dict_size = (self->compression == TYPE_ZSTD_COMPRESSION) ? options->zstd_dict_size : 0;
+    self->dict_pending = (self->dict_size > 0);
+    self->dict_samples = 0;
+    self->dict = NULL;
     self->pending_index = 0;
-    self->needs_reset = 0;
     self->offset = 0;
 
     self->metadata_data_size = 0;
@@ -209,6 +427,12 @@ SSTBuilder* sst_builder_new(File* file)
     self->metadata_num_blocks = 0;
     self->metadata_num_entries = 0;
     self->metadata_value_size = 0;
+    self->metadata_num_deletions = 0;
+    self->metadata_num_range_dels = 0;
+    self->metadata_index_partitions = 0;
+    self->metadata_min_expiration = TTL_NEVER;
+    self->indexed_blocks = 0;
+    self->partition_first_block = 0;
 
 #ifdef WITH_BLOOM_FILTER
     self->metadata_filter_size= 0;
@@ -218,9 +442,24 @@ SSTBuilder* sst_builder_new(File* file)
     self->last_key = buffer_new(1024);
     // Just 5 bytes are sufficient to store a file offset as a varint32
     self->last_block_offset = buffer_new(5);
+    self->range_dels = buffer_new(1);
+    self->compressed = buffer_new(self->block_size);
+    self->pending = vector_new();
+    self->spare = vector_new();
     self->index_block = sst_block_builder_new(FLAG_NOCOMPRESS | FLAG_INDEX, 1);
 
-    self->data_block = sst_block_builder_new(FLAG_COMPRESS, RESTART_INTERVAL);
+    // Partitions keep a restart point per entry to be searched in place
+    self->index_partition_size = options->index_partition_size;
+    self->index_partition = NULL;
+    self->partition_key = NULL;
+
+    if (self->index_partition_size > 0)
+    {
+        self->index_partition = sst_block_builder_new(FLAG_NOCOMPRESS, 1);
+        self->partition_key = buffer_new(64);
+    }
+
+    self->data_block = sst_block_builder_new(self->block_flags, self->restart_interval);
 
     return self;
 }
@@ -232,8 +471,26 @@ void sst_builder_free(SSTBuilder* self)
     sst_block_builder_free(self->data_block);
     sst_block_builder_free(self->index_block);
 
+    if (self->index_partition)
+    {
+        sst_block_builder_free(self->index_partition);
+        buffer_free(self->partition_key);
+    }
+
     buffer_free(self->last_key);
     buffer_free(self->last_block_offset);
+    buffer_free(self->range_dels);
+    buffer_free(self->blob_ref);
+    buffer_free(self->compressed);
+
+    if (self->dict)
+        codec_dict_free(self->dict);
+
+    for (uint32_t i = 0; i < vector_count(self->spare); i++)
+        _sst_block_job_free((SSTBlockJob*)vector_get(self->spare, i));
+
+    vector_free(self->pending);
+    vector_free(self->spare);
 
 #ifdef WITH_BLOOM_FILTER
     bloom_builder_free(self->bloom);
@@ -246,20 +503,28 @@ void sst_builder_add(SSTBuilder* self, Variant* key, Variant* value, OPT opt)
 {
 //    DEBUG("ADD: %.*s %.*s %d %d", key->length, key->mem, value->length, value->mem, opt, self->pending_index);
 
-    self->block_written = 0;
-
-    if (self->needs_reset)
+    if (self->pending_index)
     {
-        sst_block_builder_reset(self->data_block);
-        self->needs_reset = 0;
+        _sst_builder_set_separator(self, key);
+
+        // Write whatever the workers have completed in the meanwhile, or
+        // wait for them if too many blocks are kept in memory
+        _sst_builder_write_jobs(self, vector_count(self->pending) > MAX_PENDING_BLOCKS);
     }
 
-    if (self->pending_index)
+    if (opt == ADD && self->with_ttl)
+        sst_builder_add_expiration(self, ttl_value_expiration(value));
+
+    // Large values go to the blob file, the entry keeps their reference
+    if (opt == ADD && self->blob && value->length >= self->min_blob_size)
     {
-        // Extract the shortest separator that indexes the block >= all keys
-        shortest_separator(self->last_key, key);
-        sst_block_builder_add(self->index_block, self->last_key, self->last_block_offset, ADD);
-        self->pending_index = 0;
+        buffer_clear(self->blob_ref);
+
+        if (blob_writer_add(self->blob, key, value, self->blob_ref))
+        {
+            value = self->blob_ref;
+            opt = BLOB;
+        }
     }
 
     sst_block_builder_add(self->data_block, key, value, opt);
@@ -268,13 +533,22 @@ void sst_builder_add(SSTBuilder* self, Variant* key, Variant* value, OPT opt)
     self->metadata_key_size += key->length;
     self->metadata_value_size += value->length;
 
-    if (sst_block_builder_current_size(self->data_block) >= BLOCK_SIZE)
-    {
-        // Get the last key which is part of the just written data block
-        buffer_clear(self->last_key);
-        buffer_putnstr(self->last_key, key->mem, key->length);
+    if (opt == DEL)
+        self->metadata_num_deletions++;
 
-        // The offset of the block will be updated inside this call
+    if (sst_block_builder_current_size(self->data_block) >= self->block_size)
         _sst_builder_flush(self);
-    }
+}
+
+void sst_builder_add_range_del(SSTBuilder* self, RangeTombstone* tombstone)
+{
+    range_tombstone_encode(tombstone, self->range_dels);
+    self->metadata_num_range_dels++;
+}
+
+void sst_builder_add_expiration(SSTBuilder* self, uint32_t expiration)
+{
+    if (expiration != TTL_NEVER &&
+        (self->metadata_min_expiration == TTL_NEVER || expiration < self->metadata_min_expiration))
+        self->metadata_min_expiration = expiration;
 }
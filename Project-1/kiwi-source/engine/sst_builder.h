@@ -4,18 +4,74 @@
 #include "indexer.h"
 #include "file.h"
 #include "sst_block_builder.h"
+#include "range_del.h"
+#include "thread_pool.h"
+#include "codec.h"
+#include "blob.h"
+#include "options.h"
+#include "vector.h"
 #include "lib/kvec.h"
 #ifdef WITH_BLOOM_FILTER
 #include "bloom_builder.h"
 #endif
 
+// A full data block on its way to the file. Compression, checksum and
+// bloom filter only depend on the block contents, so they may run on a
+// worker thread; the builder then appends the blocks in order since their
+// offsets (and so the index) depend on the size of the previous ones.
+typedef struct _sst_block_job {
+    ThreadPoolTask task;
+
+    SSTBlockBuilder* block;
+    uint32_t type;         // codec to use
+    const CodecDict* dict;
+    unsigned submitted:1;  // held back while the dictionary is not ready
+
+    Buffer* compressed;
+    Buffer* output;     // either compressed or the block buffer, with trailer
+    Buffer* filter;
+
+    Variant* separator; // index key, known once the next block is started
+    unsigned has_separator:1;
+} SSTBlockJob;
+
 typedef struct _sst_builder {
     File* file;
     size_t offset;
 
+    ThreadPool* pool; // NULL to process the blocks inline
+    Vector* pending;  // SSTBlockJob* not written yet, in file order
+    Vector* spare;    // SSTBlockJob* ready to be reused
+
     unsigned pending_index:1;
-    unsigned needs_reset:1;
-    unsigned block_written:1;
+
+    // Size a data block is cut at and number of keys between the restart
+    // points, chosen per level
+    uint32_t block_size;
+    uint32_t restart_interval;
+    uint32_t block_flags;
+
+    // The index keys are shortened only when the keys sort as bytes
+    unsigned short_separators:1;
+
+    // Writer of the blob file of the sst file, set by the owner of the
+    // builder which also finishes it: values of at least min_blob_size
+    // bytes are stored there
+    BlobWriter* blob;
+    uint32_t min_blob_size;
+    Buffer* blob_ref;
+
+    // The values carry their expiration, see ttl.h
+    unsigned with_ttl:1;
+
+    // Block codec for the level of the file. A zstd dictionary is trained
+    // on the first dict_samples bytes of data, the blocks being held until
+    // then (dict_pending).
+    uint32_t compression;
+    size_t dict_size;
+    size_t dict_samples;
+    unsigned dict_pending:1;
+    CodecDict* dict;
 
     uint64_t metadata_num_entries; // number of kv
     uint64_t metadata_num_blocks;  // number of data blocks
@@ -23,6 +79,10 @@ typedef struct _sst_builder {
     uint64_t metadata_data_size;   // size in bytes of all data blocks
     uint64_t metadata_key_size;    // size in bytes of all keys (uncompressed)
     uint64_t metadata_value_size;  // size in bytes of all values (uncompressed)
+    uint64_t metadata_num_deletions;  // number of point tombstones
+    uint64_t metadata_num_range_dels; // number of range tombstones
+    uint64_t metadata_index_partitions; // 0 while the index is flat
+    uint64_t metadata_min_expiration;   // of the values, TTL_NEVER if none expires
 #ifdef WITH_BLOOM_FILTER
     uint64_t metadata_filter_size; // size in bytes of the filters
     BloomBuilder* bloom;
@@ -30,13 +90,30 @@ typedef struct _sst_builder {
 
     Variant* last_key;
     Variant* last_block_offset;
+    Buffer* range_dels; // encoded range tombstones, stored in the meta block
+    Buffer* compressed; // scratch space for the index block
+
+    // Partitioned index: the entries of the data blocks are also collected
+    // in partitions of about index_partition_size bytes, written among the
+    // data blocks, and once the first one is cut the index block only
+    // points at the partitions. Small files keep the flat index.
+    uint32_t index_partition_size;
+    SSTBlockBuilder* index_partition;
+    Variant* partition_key;         // index key of the last entry of the partition
+    uint64_t partition_first_block; // number of the first data block it indexes
+    uint64_t indexed_blocks;
 
     SSTBlockBuilder* data_block;
     SSTBlockBuilder* index_block;
 } SSTBuilder;
 
-SSTBuilder* sst_builder_new(File* output);
+SSTBuilder* sst_builder_new(File* output, ThreadPool* pool, const Options* options, uint32_t level);
 void sst_builder_free(SSTBuilder* self);
 void sst_builder_add(SSTBuilder* self, Variant* key, Variant* value, OPT opt);
+void sst_builder_add_range_del(SSTBuilder* self, RangeTombstone* tombstone);
+
+// Accounts for the expiration of a value added as a blob reference, which
+// the builder cannot read
+void sst_builder_add_expiration(SSTBuilder* self, uint32_t expiration);
 
 #endif
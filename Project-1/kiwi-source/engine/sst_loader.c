@@ -4,16 +4,60 @@
 #include "sst_loader.h"
 #include "utils.h"
 #include "crc32.h"
-
-#ifdef WITH_BLOOM_FILTER
+#include "range_del.h"
+#include "ttl.h"
+#include "codec.h"
 #include "hash.h"
-#endif
+#include "sst_block_builder.h"
 
-#ifdef WITH_SNAPPY
-#include <snappy-c.h>
-#endif
+// Returns size bytes of the file at offset: a pointer into the mapping, or
+// a buffer read with pread() to be released with _release_raw()
+static char* _read_raw(SSTLoader* self, uint64_t offset, uint64_t size)
+{
+    if (!self->use_pread)
+        return self->file->base + offset;
+
+    char* data = malloc(size);
+
+    if (!data)
+        PANIC("NULL allocation");
 
-static int _read_block(SSTLoader* self, uint64_t offset, uint64_t size, char **alloced, char **begin, char **end, int must_cache)
+    if (!file_read_at(self->file, offset, size, data))
+    {
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+static void _release_raw(SSTLoader* self, char* data)
+{
+    if (self->use_pread)
+        free(data);
+}
+
+static CacheEntry* _cache_block(SSTLoader* self, uint64_t offset, char* start, char* stop)
+{
+    CacheEntry* lru_value = malloc(sizeof(CacheEntry));
+
+    if (!lru_value)
+        PANIC("NULL allocation");
+
+    lru_value->key.filenum = self->filenum;
+    lru_value->key.offset = offset;
+    lru_value->start = start;
+    lru_value->stop = stop;
+    lru_value->pins = 0;
+    lru_value->evicted = 0;
+
+    lru_set(self->cache, lru_value);
+    return lru_value;
+}
+
+// When cached is given it is set to the entry of the block in the cache,
+// or to NULL if the block points into the file mapping
+static int _read_block(SSTLoader* self, uint64_t offset, uint64_t size, char **alloced, char **begin, char **end, int must_cache, CacheEntry** cached)
 {
     // If must_cache is set to 0 we are iterating over the keyspace. Skip caching but remember
     // to also free allocated strings
@@ -32,12 +76,19 @@ static int _read_block(SSTLoader* self, uint64_t offset, uint64_t size, char **a
             *begin = lru_value->start;
             *end = lru_value->stop;
 
+            if (cached)
+                *cached = lru_value;
+
             return 1;
         }
     }
 
     // get from lru(self->filenum, offset, &start, &stop)
-    char* start = self->file->base + offset;
+    char* start = _read_raw(self, offset, size);
+
+    if (!start)
+        return 0;
+
     char* stop = start + size - sizeof(uint32_t) * 2;
 
     uint32_t block_type = get_int32(stop);
@@ -50,25 +101,30 @@ static int _read_block(SSTLoader* self, uint64_t offset, uint64_t size, char **a
     {
         ERROR("Data block seems to be corrupted. Data CRC: %X Block CRC: %X",
               actual_crc32, block_crc32);
+        _release_raw(self, start);
         return 0;
     }
 #endif
 
-#ifdef WITH_SNAPPY
-    if (block_type == TYPE_SNAPPY_COMPRESSION)
+    if (block_type != TYPE_NO_COMPRESSION)
     {
+        const Codec* codec = codec_get(block_type);
         size_t output_length;
+        char* output;
 
-        if (snappy_uncompressed_length(start, stop - start, &output_length) != SNAPPY_OK)
+        if (!codec)
+        {
+            ERROR("Block of %s uses the %s codec, which is not available",
+                  self->file->filename, codec_name(block_type));
+            _release_raw(self, start);
             return 0;
+        }
 
-        char* output = (char*)malloc(output_length);
+        int ret = codec->uncompress(start, stop - start, &output, &output_length, self->dict);
+        _release_raw(self, start);
 
-        if (snappy_uncompress(start, stop - start, output, &output_length) != SNAPPY_OK)
-        {
-            free(output);
+        if (!ret)
             return 0;
-        }
 
         if (alloced)
             *alloced = output;
@@ -77,22 +133,32 @@ static int _read_block(SSTLoader* self, uint64_t offset, uint64_t size, char **a
 
         if (must_cache)
         {
-            lru_value = malloc(sizeof(CacheEntry));
-
-            lru_value->key.filenum = self->filenum;
-            lru_value->key.offset = offset;
-            lru_value->start = output;
-            lru_value->stop = output + output_length;
+            CacheEntry* lru_value = _cache_block(self, offset, output, output + output_length);
 
-            lru_set(self->cache, lru_value);
+            if (cached)
+                *cached = lru_value;
         }
 
         return 1;
     }
-#endif
+
     *begin = start;
     *end = stop;
 
+    // A block read with pread() is owned like an uncompressed one
+    if (self->use_pread)
+    {
+        if (must_cache)
+        {
+            CacheEntry* lru_value = _cache_block(self, offset, start, stop);
+
+            if (cached)
+                *cached = lru_value;
+        }
+        else if (alloced)
+            *alloced = start;
+    }
+
 #if 0
     // Apparently there's some sort of race condition here
     start = malloc(*end - *begin);
@@ -113,11 +179,41 @@ static int _read_block(SSTLoader* self, uint64_t offset, uint64_t size, char **a
     return 1;
 }
 
+// Parses the trailer of a data block (see sst_block_builder.h): moves stop
+// to the beginning of the restart array and returns the number of restart
+// points, setting buckets to the hash index of the block if it has one.
+static uint32_t _block_restarts(char** stop, const uint8_t** buckets, uint32_t* num_buckets)
+{
+    uint32_t num_restarts = get_int32(*stop - sizeof(uint32_t));
+    *stop -= sizeof(uint32_t);
+
+    *buckets = NULL;
+    *num_buckets = 0;
+
+    if (num_restarts & HASH_INDEX_BIT)
+    {
+        num_restarts &= ~HASH_INDEX_BIT;
+
+        const uint8_t* p = (const uint8_t*)*stop - sizeof(uint16_t);
+        *num_buckets = p[0] | ((uint32_t)p[1] << 8);
+        *buckets = p - *num_buckets;
+        *stop = (char*)*buckets;
+    }
+
+    *stop -= sizeof(uint32_t) * num_restarts;
+    return num_restarts;
+}
+
 static int _load_index(SSTLoader* self, uint64_t offset, uint64_t size)
 {
     assert(size > 0);
 
-    const char* start = self->file->base + offset;
+    char* data = _read_raw(self, offset, size);
+
+    if (!data)
+        return 0;
+
+    const char* start = data;
     const char* stop = start + size - sizeof(uint32_t) * 2;
 
     assert(stop > start);
@@ -132,6 +228,7 @@ static int _load_index(SSTLoader* self, uint64_t offset, uint64_t size)
     {
         ERROR("Index block seems to be corrupted. Data CRC: %X Block CRC: %X",
               actual_crc32, block_crc32);
+        _release_raw(self, data);
         return 0;
     }
 
@@ -149,11 +246,15 @@ static int _load_index(SSTLoader* self, uint64_t offset, uint64_t size)
 
         entry->key = malloc(sizeof(char) * entry->klen);
         memcpy(entry->key, start, entry->klen);
+        entry->prefix = comparator_prefix(self->comparator, entry->key, entry->klen);
 
         start += entry->klen;
         start = get_varint64(start, start + 9, &entry->offset);
         start = get_varint64(start, start + 9, &entry->size);
 
+        if (self->index_partitions > 0)
+            start = get_varint64(start, start + 9, &entry->first_block);
+
 //        DEBUG("Key <= %.*s are at offset %" PRIu64 " size: %" PRIu64,
 //              entry->klen, entry->key, entry->offset, entry->size);
 //        DEBUG("Start: %p Stop: %p", start, stop);
@@ -161,30 +262,12 @@ static int _load_index(SSTLoader* self, uint64_t offset, uint64_t size)
         kv_push(IndexEntry*, self->index, entry);
     }
 
+    _release_raw(self, data);
     return 1;
 }
 
-static int _read_footer(SSTLoader* self)
+static int _read_meta(SSTLoader* self, const char* start, const char* meta_stop)
 {
-    if (memcmp(self->file->limit - 8, MAGIC_STR, 8) != 0)
-        ERROR("The file %s does not seem to be a sst file", self->file->filename);
-
-    uint64_t index_off = 0, index_sz = 0;
-    uint64_t meta_off = 0, meta_sz = 0;
-
-    const char* start = self->file->limit - FOOTER_SIZE;
-
-    index_off = get_int64(start);
-    index_sz = get_int64(start + sizeof(uint64_t));
-
-    meta_off = get_int64(start + sizeof(uint64_t) * 2);
-    meta_sz = get_int64(start + sizeof(uint64_t) * 3);
-
-    DEBUG("Index @ offset: %" PRIu64 " size: %" PRIu64, index_off, index_sz);
-    DEBUG("Meta Block @ offset: %" PRIu64 " size: %" PRIu64, meta_off, meta_sz);
-
-    start = self->file->base + meta_off;
-
     self->data_size = get_int64(start); start+=8;
     self->index_size = get_int64(start); start+=8;
     self->key_size = get_int64(start); start+=8;
@@ -198,6 +281,75 @@ static int _read_footer(SSTLoader* self)
     self->bloom_size = get_int64(start); start+=8;
 #endif
 
+    if (start < meta_stop)
+    {
+        self->num_deletions = get_int64(start); start+=8;
+        self->num_range_dels = get_int64(start); start+=8;
+
+        for (uint64_t i = 0; i < self->num_range_dels; i++)
+        {
+            RangeTombstone* tombstone = NULL;
+            start = range_tombstone_decode(start, meta_stop, &tombstone);
+
+            if (!start)
+            {
+                ERROR("Corrupted range tombstones in %s", self->file->filename);
+                return 0;
+            }
+
+            vector_add(self->range_dels, tombstone);
+            range_del_index_add(self->range_del_index, tombstone);
+        }
+    }
+
+    if (start + sizeof(uint64_t) <= meta_stop)
+    {
+        uint64_t dict_size = get_int64(start); start+=8;
+
+        if (start + dict_size > meta_stop)
+        {
+            ERROR("Corrupted compression dictionary in %s", self->file->filename);
+            return 0;
+        }
+
+        if (dict_size > 0)
+            self->dict = codec_dict_new(start, dict_size);
+
+        start += dict_size;
+    }
+
+    self->format_version = 0;
+    self->block_size = BLOCK_SIZE;
+    self->restart_interval = RESTART_INTERVAL;
+
+    if (start + sizeof(uint64_t) * 3 <= meta_stop)
+    {
+        self->format_version = get_int64(start); start+=8;
+        self->block_size = get_int64(start); start+=8;
+        self->restart_interval = get_int64(start); start+=8;
+    }
+
+    self->index_partitions = 0;
+
+    if (start + sizeof(uint64_t) <= meta_stop)
+    {
+        self->index_partitions = get_int64(start); start+=8;
+    }
+
+    self->min_expiration = TTL_NEVER;
+
+    if (start + sizeof(uint64_t) <= meta_stop)
+    {
+        self->min_expiration = get_int64(start); start+=8;
+    }
+
+    if (self->format_version > SST_FORMAT_VERSION)
+    {
+        ERROR("The file %s has format version %" PRIu64 ", newer than the supported %d",
+              self->file->filename, self->format_version, SST_FORMAT_VERSION);
+        return 0;
+    }
+
     INFO("Data size:        %" PRIu64, self->data_size);
 
     INFO("Index size:       %" PRIu64, self->index_size);
@@ -205,12 +357,65 @@ static int _read_footer(SSTLoader* self)
     INFO("Num blocks size:  %" PRIu64, self->num_blocks);
     INFO("Num entries size: %" PRIu64, self->num_entries);
     INFO("Value size:       %" PRIu64, self->value_size);
+    INFO("Deletions:        %" PRIu64 " (%" PRIu64 " ranges)", self->num_deletions, self->num_range_dels);
+    INFO("Format version:   %" PRIu64 " (blocks of %" PRIu64 " bytes, restart interval %" PRIu64 ")",
+         self->format_version, self->block_size, self->restart_interval);
+    INFO("Index partitions: %" PRIu64, self->index_partitions);
 
 #ifdef WITH_BLOOM_FILTER
     INFO("Filter size:      %" PRIu64, self->filter_size);
     INFO("Bloom offset %" PRIu64 " size: %" PRIu64, self->bloom_off, self->bloom_size);
 #endif
 
+    return 1;
+}
+
+static int _read_footer(SSTLoader* self)
+{
+    if (self->file->map_size < FOOTER_SIZE)
+    {
+        ERROR("The file %s is too small to be a sst file", self->file->filename);
+        return 0;
+    }
+
+    char* footer = _read_raw(self, self->file->map_size - FOOTER_SIZE, FOOTER_SIZE);
+
+    if (!footer)
+        return 0;
+
+    if (memcmp(footer + FOOTER_SIZE - 8, MAGIC_STR, 8) != 0)
+        ERROR("The file %s does not seem to be a sst file", self->file->filename);
+
+    uint64_t index_off = 0, index_sz = 0;
+    uint64_t meta_off = 0, meta_sz = 0;
+
+    index_off = get_int64(footer);
+    index_sz = get_int64(footer + sizeof(uint64_t));
+
+    meta_off = get_int64(footer + sizeof(uint64_t) * 2);
+    meta_sz = get_int64(footer + sizeof(uint64_t) * 3);
+
+    _release_raw(self, footer);
+
+    DEBUG("Index @ offset: %" PRIu64 " size: %" PRIu64, index_off, index_sz);
+    DEBUG("Meta Block @ offset: %" PRIu64 " size: %" PRIu64, meta_off, meta_sz);
+
+    char* meta = _read_raw(self, meta_off, meta_sz);
+
+    if (!meta)
+        return 0;
+
+    int ret = _read_meta(self, meta, meta + meta_sz);
+    _release_raw(self, meta);
+
+    if (!ret)
+        return 0;
+
+#ifdef WITH_BLOOM_FILTER
+    if (self->bloom_size > 0 && !(self->bloom = _read_raw(self, self->bloom_off, self->bloom_size)))
+        return 0;
+#endif
+
     // TODO: probably here we should load the first string from the file
     // in order to know the (start, stop) interval the file ranges
 
@@ -220,7 +425,7 @@ static int _read_footer(SSTLoader* self)
     return 1;
 }
 
-SSTLoader* sst_loader_new(LRU* cache, File* file, uint32_t level, uint32_t filenum)
+SSTLoader* sst_loader_new(LRU* cache, const Comparator* comparator, File* file, uint32_t level, uint32_t filenum, int use_pread)
 {
     SSTLoader* self = calloc(1, sizeof(SSTLoader));
 
@@ -231,12 +436,16 @@ SSTLoader* sst_loader_new(LRU* cache, File* file, uint32_t level, uint32_t filen
     self->level = level;
     self->filenum = filenum;
     self->cache = cache;
+    self->comparator = comparator;
+    self->use_pread = use_pread;
 
     kv_init(self->index);
+    self->range_dels = vector_new();
+    self->range_del_index = range_del_index_new(comparator);
 
-    if (!mmapped_file_new(self->file))
+    if (!(use_pread ? sequential_file_new(self->file) : mmapped_file_new(self->file)))
     {
-        ERROR("Unable to mmap the file %s", self->file->filename);
+        ERROR("Unable to open the file %s", self->file->filename);
         goto err;
     }
 
@@ -263,23 +472,80 @@ void sst_loader_free(SSTLoader* self)
     }
 
     kv_destroy(self->index);
+    range_del_free(self->range_dels);
+    range_del_index_free(self->range_del_index);
+
+    if (self->dict)
+        codec_dict_free(self->dict);
+
+    if (self->bloom)
+        _release_raw(self, self->bloom);
+
     file_free(self->file);
     free(self);
 }
 
-IndexEntry* _get_index_entry(SSTLoader* self, Variant* key, int *block)
+// Decodes the entry at the restart point pos of an index partition. The
+// key points into the partition.
+static void _partition_entry(const char* start, const char* restarts, uint32_t pos, IndexEntry* entry)
+{
+    uint32_t klen, vlen;
+
+    // Skip the first character which is 0 since every entry is a restart point
+    const char* p = start + get_int32(restarts + sizeof(uint32_t) * pos) + 1;
+    p = get_varint32(p, p + 5, &klen);
+    p = get_varint32(p, p + 5, &vlen);
+
+    entry->klen = klen;
+    entry->key = (char*)p;
+
+    p += klen;
+    p = get_varint64(p, p + 9, &entry->offset);
+    get_varint64(p, p + 9, &entry->size);
+}
+
+// Reads an index partition, through the cache when it is compressed
+// Splits the <value-length> of an entry into the length of its value plus
+// one and the kind of the entry, see sst_block_builder.h
+static inline OPT _entry_kind(uint32_t* vlen)
+{
+    if (*vlen & VALUE_BLOB_BIT)
+    {
+        *vlen &= ~VALUE_BLOB_BIT;
+        return BLOB;
+    }
+
+    return (*vlen == 0) ? DEL : ADD;
+}
+
+static uint32_t _read_partition(SSTLoader* self, IndexEntry* top, char** start, char** restarts)
+{
+    const uint8_t* buckets;
+    uint32_t num_buckets;
+
+    if (!_read_block(self, top->offset, top->size, NULL, start, restarts, 1, NULL))
+        return 0;
+
+    return _block_restarts(restarts, &buckets, &num_buckets);
+}
+
+// Finds the first data block whose index key is not smaller than key, the
+// only one that may hold it. Returns its number, or -1 if the index
+// partition cannot be read.
+static int _find_block(SSTLoader* self, Variant* key, IndexEntry* entry)
 {
     int ret;
-    IndexEntry* entry;
+    IndexEntry* top;
     uint32_t left = 0, right = kv_size(self->index) - 1;
+    uint64_t prefix = comparator_prefix(self->comparator, key->mem, key->length);
 
     while (left < right)
     {
         uint32_t mid = (left + right) / 2;
-        entry = kv_A(self->index, mid);
+        top = kv_A(self->index, mid);
 
-        ret = string_cmp(entry->key, key->mem, entry->klen, key->length);
-//        DEBUG("[1 of 3] L: %d R: %d M: %d Comparing: %.*s %.*s = %d", left, right, mid, entry->klen, entry->key, key->length, key->mem, ret);
+        ret = comparator_prefix_cmp(self->comparator, top->prefix, top->key, top->klen, prefix, key->mem, key->length);
+//        DEBUG("[1 of 3] L: %d R: %d M: %d Comparing: %.*s %.*s = %d", left, right, mid, top->klen, top->key, key->length, key->mem, ret);
 
         if (ret < 0) // block < key
             left = mid + 1;
@@ -287,10 +553,91 @@ IndexEntry* _get_index_entry(SSTLoader* self, Variant* key, int *block)
             right = mid;
     }
 
+    top = kv_A(self->index, left);
+
+    if (self->index_partitions == 0)
+    {
+        *entry = *top;
+        return left;
+    }
+
+    // Same search in the partition
+    char *start, *restarts;
+    uint32_t num_entries = _read_partition(self, top, &start, &restarts);
+
+    if (num_entries == 0)
+        return -1;
+
+    uint32_t first_block = top->first_block;
+    left = 0;
+    right = num_entries - 1;
+
+    while (left < right)
+    {
+        uint32_t mid = (left + right) / 2;
+        _partition_entry(start, restarts, mid, entry);
+
+        if (comparator_cmp(self->comparator, entry->key, entry->klen, key->mem, key->length) < 0)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+
+    _partition_entry(start, restarts, left, entry);
+    return first_block + left;
+}
+
+// Looks up the index entry of a data block by its number
+static int _get_block(SSTLoader* self, int block, IndexEntry* entry)
+{
+    if (self->index_partitions == 0)
+    {
+        if (block >= kv_size(self->index))
+            return 0;
+
+        *entry = *kv_A(self->index, block);
+        return 1;
+    }
+
+    if (block >= self->num_blocks)
+        return 0;
+
+    // The last partition starting at or before the block
+    uint32_t left = 0, right = kv_size(self->index) - 1;
+
+    while (left < right)
+    {
+        uint32_t mid = (left + right + 1) / 2;
+
+        if (kv_A(self->index, mid)->first_block <= (uint64_t)block)
+            left = mid;
+        else
+            right = mid - 1;
+    }
+
+    IndexEntry* top = kv_A(self->index, left);
+    char *start, *restarts;
+    uint32_t num_entries = _read_partition(self, top, &start, &restarts);
+
+    if (block - top->first_block >= num_entries)
+        return 0;
+
+    _partition_entry(start, restarts, block - top->first_block, entry);
+    return 1;
+}
+
+// Returns entry filled with the index entry of the data block that may
+// hold key, or NULL if the key is surely not in the file
+static IndexEntry* _get_index_entry(SSTLoader* self, Variant* key, int *block, IndexEntry* entry)
+{
+    int left = _find_block(self, key, entry);
+
+    if (left < 0)
+        return NULL;
+
     if (block)
         *block = left;
 
-    entry = kv_A(self->index, left);
 //    DEBUG("[1 of 3] Key %.*s is contained in block <= %.*s", key->length, key->mem, entry->klen, entry->key);
 
 #ifdef WITH_BLOOM_FILTER
@@ -300,8 +647,7 @@ IndexEntry* _get_index_entry(SSTLoader* self, Variant* key, int *block)
 
     // Check the bloom filter and see if the key is not inside this block
 
-    char *position = self->file->base +
-            self->bloom_off + self->bloom_size -
+    char *position = self->bloom + self->bloom_size -
             sizeof(uint32_t) - // Remove count
             (sizeof(uint32_t) * self->num_blocks) +
             (sizeof(uint32_t) * left);
@@ -314,7 +660,7 @@ IndexEntry* _get_index_entry(SSTLoader* self, Variant* key, int *block)
 
 //    DEBUG("Bloom filter for block %d left starts at off + %d (%d bytes)", left, offset, next_offset - offset);
 
-    char* array = self->file->base + self->bloom_off + offset;
+    char* array = self->bloom + offset;
     size_t bits = (next_offset - offset) * 8;// -1) ?
 
     uint32_t h = hash(key->mem, key->length, 0xbc9f1d34);
@@ -337,25 +683,56 @@ IndexEntry* _get_index_entry(SSTLoader* self, Variant* key, int *block)
     return entry;
 }
 
-int sst_loader_get(SSTLoader* self, Variant* key, Variant* value, OPT* opt)
+void sst_loader_prefetch(SSTLoader* self, Variant* key)
 {
-    IndexEntry* entry = _get_index_entry(self, key, NULL);
+    if (self->num_entries == 0)
+        return;
+
+    IndexEntry index_entry;
+    IndexEntry* entry = _get_index_entry(self, key, NULL, &index_entry);
 
     if (!entry)
-        return 0;
+        return;
+
+    LookupKey lru_key;
+    lru_key.filenum = self->filenum;
+    lru_key.offset = entry->offset;
+
+    if (!lru_get(self->cache, &lru_key))
+        file_prefetch(self->file, entry->offset, entry->size);
+}
 
+// Looks up key in the data block [start, stop), setting found and length
+// to its value inside the block. The keys are rebuilt into scratch.
+static int _block_find(const Comparator* comparator, char* start, char* stop, Variant* key, Variant* scratch,
+                       const char** found, uint32_t* length, OPT* opt)
+{
     int ret = -2;
-    char *start = NULL, *stop = NULL, *iter;
-    _read_block(self, entry->offset, entry->size, NULL, &start, &stop, 1);
+    char *iter;
 
-    uint32_t num_restarts = get_int32(stop - sizeof(uint32_t));
-    stop -= sizeof(uint32_t) * (num_restarts + 1);
+    const uint8_t* buckets;
+    uint32_t num_buckets;
+    uint32_t num_restarts = _block_restarts(&stop, &buckets, &num_buckets);
 //    INFO("There are %d restart points in this data block", num_restarts);
 
     // [start - stop] points to the actual data, not the restarts array
     uint32_t left = 0;
     uint32_t right = num_restarts - 1;
     uint32_t plen = 0, klen = 0, vlen = 0;
+    OPT kind = ADD;
+
+    // The hash index either rules the key out or gives its restart point
+    // right away, only collisions fall back to the binary search
+    if (buckets)
+    {
+        uint8_t bucket = buckets[hash(key->mem, key->length, HASH_INDEX_SEED) % num_buckets];
+
+        if (bucket == BUCKET_EMPTY)
+            return 0;
+
+        if (bucket != BUCKET_COLLISION)
+            left = right = bucket;
+    }
 
     while (left < right)
     {
@@ -366,8 +743,9 @@ int sst_loader_get(SSTLoader* self, Variant* key, Variant* value, OPT* opt)
         iter = start + get_int32(stop + (sizeof(uint32_t) * mid)) + 1;
         iter = (char *)get_varint32(iter, iter + 5, &klen);
         iter = (char *)get_varint32(iter, iter + 5, &vlen);
+        kind = _entry_kind(&vlen);
 
-        ret = string_cmp(iter, key->mem, klen, key->length);
+        ret = comparator_cmp(comparator, iter, klen, key->mem, key->length);
 //        DEBUG("[2 of 3] Comparing: L: %d R: %d M: %d %.*s %.*s = %d", left, right, mid, klen, iter, key->length, key->mem, ret);
 
         if (ret <= 0) // restart < key => might be ok
@@ -377,20 +755,18 @@ int sst_loader_get(SSTLoader* self, Variant* key, Variant* value, OPT* opt)
     }
 
 //    DEBUG("Left is %d Right is %d VLEN is %d RET is %d", left, right, vlen, ret);
-    buffer_clear(value);
+    buffer_clear(scratch);
 
     if (ret == 0)
     {
-        if (vlen > 1)
-            buffer_putnstr(value, iter + klen, vlen - 1);
-
-        *opt = (vlen == 0) ? DEL : ADD;
+        *found = iter + klen;
+        *length = (vlen > 1) ? vlen - 1 : 0;
+        *opt = kind;
 
         //_release_block(self, entry->offset, entry->size);
         return 1;
     }
 
-    // From here we temporarly use use the value as storage buffer
     iter = start + get_int32(stop + (sizeof(uint32_t) * left));
 
     do {
@@ -398,27 +774,28 @@ int sst_loader_get(SSTLoader* self, Variant* key, Variant* value, OPT* opt)
         iter = (char *)get_varint32(iter, iter + 5, &plen);
         iter = (char *)get_varint32(iter, iter + 5, &klen);
         iter = (char *)get_varint32(iter, iter + 5, &vlen);
+        kind = _entry_kind(&vlen);
 
 //        DEBUG("plen: %d vlen: %d", plen, vlen);
 
-        value->length = plen;
-        buffer_putnstr(value, iter, klen);
+        scratch->length = plen;
+        buffer_putnstr(scratch, iter, klen);
 
-        ret = string_cmp(value->mem, key->mem, value->length, key->length);
+        ret = comparator_cmp(comparator, scratch->mem, scratch->length, key->mem, key->length);
 
-        iter += klen + MAX(0, vlen - 1);
+        // vlen is unsigned: a deletion (vlen == 0) has no value to skip
+        iter += klen + ((vlen > 1) ? vlen - 1 : 0);
 
-//        DEBUG("Comparing %.*s with %.*s = %d", key->length, key->mem, value->length, value->mem, ret);
+//        DEBUG("Comparing %.*s with %.*s = %d", key->length, key->mem, scratch->length, scratch->mem, ret);
     } while (ret < 0 && iter < stop);
 
-    buffer_clear(value);
+    buffer_clear(scratch);
 
     if (ret == 0)
     {
-        if (vlen > 1)
-            buffer_putnstr(value, iter - (vlen - 1), vlen - 1);
-
-        *opt = (vlen == 0) ? DEL : ADD;
+        *length = (vlen > 1) ? vlen - 1 : 0;
+        *found = iter - *length;
+        *opt = kind;
 
         //_release_block(self, entry->offset, entry->size);
         return 1;
@@ -428,147 +805,367 @@ int sst_loader_get(SSTLoader* self, Variant* key, Variant* value, OPT* opt)
     return 0;
 }
 
-static uint32_t _sst_loader_read_block(SSTLoaderIterator* iter, IndexEntry* entry)
+// Same as _block_find() but copies the value, using it as scratch buffer
+static int _block_get(const Comparator* comparator, char* start, char* stop, Variant* key, Variant* value, OPT* opt)
 {
-    // NOTE: The current keep track of the beginning of the block and it is used
-    // to release the string allocated in _read_block when must_cache is set to 0
-    iter->current = NULL;
-    _read_block(iter->loader, entry->offset, entry->size, &iter->current, &iter->start, &iter->stop, 0);
+    const char* found;
+    uint32_t length;
 
-    // We need to skip restart pointer since we are just iterating over the structure
-    // at least for now
-    uint32_t num_restarts = get_int32(iter->stop - sizeof(uint32_t));
-    iter->stop -= sizeof(uint32_t) * (num_restarts + 1);
+    if (!_block_find(comparator, start, stop, key, value, &found, &length, opt))
+    {
+        buffer_clear(value);
+        return 0;
+    }
 
-    return num_restarts;
+    buffer_putnstr(value, found, length);
+    return 1;
 }
 
-static void _sst_loader_iterator_next_block(SSTLoaderIterator* iter)
+int sst_loader_get(SSTLoader* self, Variant* key, Variant* value, OPT* opt)
 {
-    iter->block++;
-    iter->prev_block++;
+    // A file may hold just range tombstones
+    if (self->num_entries == 0)
+        return 0;
+
+    IndexEntry index_entry;
+    IndexEntry* entry = _get_index_entry(self, key, NULL, &index_entry);
+
+    if (!entry)
+        return 0;
+
+    char *start = NULL, *stop = NULL;
+
+    if (!_read_block(self, entry->offset, entry->size, NULL, &start, &stop, 1, NULL))
+        return 0;
+
+    return _block_get(self->comparator, start, stop, key, value, opt);
+}
+
+int sst_loader_get_pinned(SSTLoader* self, Variant* key, Variant* value, Variant* scratch, OPT* opt, CacheEntry** block)
+{
+    *block = NULL;
+
+    if (self->num_entries == 0)
+        return 0;
+
+    IndexEntry index_entry;
+    IndexEntry* entry = _get_index_entry(self, key, NULL, &index_entry);
+
+    if (!entry)
+        return 0;
+
+    char *start = NULL, *stop = NULL;
+    const char* found;
+    uint32_t length;
 
-    if (iter->prev_block >= 0)
+    if (!_read_block(self, entry->offset, entry->size, NULL, &start, &stop, 1, block) ||
+        !_block_find(self->comparator, start, stop, key, scratch, &found, &length, opt))
     {
-        //IndexEntry* entry = kv_A(iter->loader->index, iter->prev_block);
-        free(iter->current);
-        //_release_block(iter->loader, entry->offset, entry->size, 0);
+        *block = NULL;
+        return 0;
+    }
+
+    value->mem = (char*)found;
+    value->length = length;
+    return 1;
+}
+
+void sst_loader_multi_get(SSTLoader* self, uint32_t num_keys, Variant** keys, Variant** values, OPT* opts, int* found)
+{
+    memset(found, 0, sizeof(int) * num_keys);
+
+    if (self->num_entries == 0)
+        return;
+
+    IndexEntry* entries = malloc(sizeof(IndexEntry) * num_keys);
+    uint64_t last_offset = UINT64_MAX;
+    LookupKey lru_key;
+
+    if (!entries)
+        PANIC("NULL allocation");
+
+    lru_key.filenum = self->filenum;
+
+    // Look up all the blocks first and start reading the ones not cached,
+    // so that they are fetched together rather than one after the other
+    for (uint32_t i = 0; i < num_keys; i++)
+    {
+        if (!_get_index_entry(self, keys[i], NULL, &entries[i]))
+        {
+            entries[i].size = 0;
+            continue;
+        }
+
+        if (entries[i].offset == last_offset)
+            continue;
+
+        last_offset = lru_key.offset = entries[i].offset;
+
+        if (num_keys > 1 && !lru_get(self->cache, &lru_key))
+            file_prefetch(self->file, entries[i].offset, entries[i].size);
     }
 
-    if (iter->block >= kv_size(iter->loader->index))
+    // The keys are sorted: the ones sharing a block are next to each other
+    // and the block is decoded just once for all of them
+    char *start = NULL, *stop = NULL;
+    last_offset = UINT64_MAX;
+
+    for (uint32_t i = 0; i < num_keys; i++)
     {
-        iter->block = iter->prev_block = -1;
-        iter->valid = 0;
+        if (entries[i].size == 0)
+            continue;
+
+        if (entries[i].offset != last_offset)
+        {
+            last_offset = entries[i].offset;
+
+            if (!_read_block(self, entries[i].offset, entries[i].size, NULL, &start, &stop, 1, NULL))
+                start = NULL;
+        }
+
+        if (start)
+            found[i] = _block_get(self->comparator, start, stop, keys[i], values[i], &opts[i]);
+    }
+
+    free(entries);
+}
+
+// Keeps the blocks following entry, or preceding it going backwards, being
+// read in the background while the iterator goes through the file block
+// after block
+static void _sst_loader_iterator_readahead(SSTLoaderIterator* iter, IndexEntry* entry, int reverse)
+{
+    uint64_t begin = entry->offset;
+    uint64_t end = entry->offset + entry->size;
+    uint64_t file_size = iter->loader->file->map_size;
+
+    if (iter->reverse != reverse)
+    {
+        iter->reverse = reverse;
+        iter->sequential = 0;
+        iter->readahead_end = reverse ? begin : end;
+        iter->readahead_size = ITER_READAHEAD_MIN;
+    }
+
+    if (++iter->sequential < ITER_READAHEAD_TRIGGER)
         return;
+
+    uint64_t start, stop;
+
+    if (!reverse)
+    {
+        // Still enough of the window ahead
+        if (iter->readahead_end >= end + iter->readahead_size / 2)
+            return;
+
+        start = (iter->readahead_end > end) ? iter->readahead_end : end;
+        stop = start + iter->readahead_size;
+
+        if (stop > file_size)
+            stop = file_size;
+
+        iter->readahead_end = stop;
     }
+    else
+    {
+        if (iter->readahead_end + iter->readahead_size / 2 <= begin)
+            return;
 
-    _sst_loader_read_block(iter, kv_A(iter->loader->index, iter->block));
-    sst_loader_iterator_next(iter);
+        stop = (iter->readahead_end < begin) ? iter->readahead_end : begin;
+        start = (stop > iter->readahead_size) ? stop - iter->readahead_size : 0;
+
+        iter->readahead_end = start;
+    }
+
+    if (stop > start)
+        file_prefetch(iter->loader->file, start, stop - start);
+
+    if (iter->readahead_size < ITER_READAHEAD_MAX)
+        iter->readahead_size *= 2;
 }
 
-static void _sst_loader_iterator_find(SSTLoaderIterator* iter, Variant* key)
+// Releases the block of the iterator and reads the given one, positioning
+// the iterator before its first entry. Past the first or the last block
+// the iterator is left invalid.
+static int _sst_loader_iterator_load(SSTLoaderIterator* iter, int block, int reverse)
 {
-    IndexEntry* entry = _get_index_entry(iter->loader, key, &iter->block);
-    assert(entry != NULL);
+    // NOTE: The current keep track of the beginning of the block and it is used
+    // to release the string allocated in _read_block when must_cache is set to 0
+    // The keys of the blocks following the current one are all larger than
+    // its index key
+    int past_bound = (!reverse && iter->has_block_key && block == iter->block + 1 &&
+                      comparator_variant_cmp(iter->loader->comparator, iter->block_key, iter->upper_bound) >= 0);
 
-    int ret = -2;
-    uint32_t num_restarts = _sst_loader_read_block(iter, entry);
+    free(iter->current);
+    iter->current = NULL;
+    iter->has_block_key = 0;
 
-    uint32_t left = 0;
-    uint32_t right = num_restarts - 1;
-    uint32_t plen = 0, klen = 0, vlen = 0;
+    kv_reset(iter->prev_entries);
+    iter->base = iter->entry = iter->start = iter->stop = NULL;
+    iter->num_restarts = 0;
+    iter->block = block;
+    iter->valid = 0;
 
-    char *ptr = iter->start;
+    IndexEntry entry;
 
-    while (left < right)
+    if (past_bound || block < 0 || !_get_block(iter->loader, block, &entry))
+        return 0;
+
+    if (reverse && iter->lower_bound &&
+        comparator_cmp(iter->loader->comparator, entry.key, entry.klen, iter->lower_bound->mem, iter->lower_bound->length) < 0)
+        return 0;
+
+    if (iter->upper_bound)
     {
-        uint32_t mid = (left + right + 1) / 2;
+        if (!iter->block_key)
+            iter->block_key = buffer_new(16);
 
-        ptr = iter->start + get_int32(iter->stop + (sizeof(uint32_t) * mid)) + 1;
-        ptr = (char *)get_varint32(ptr, ptr + 5, &klen);
-        ptr = (char *)get_varint32(ptr, ptr + 5, &vlen);
+        buffer_clear(iter->block_key);
+        buffer_putnstr(iter->block_key, entry.key, entry.klen);
+        iter->has_block_key = 1;
+    }
 
-        ret = string_cmp(ptr, key->mem, klen, key->length);
+    _sst_loader_iterator_readahead(iter, &entry, reverse);
 
-        if (ret <= 0) // restart < key => might be ok
-            left = mid;
-        else // key < restart
-            right = mid - 1;
+    if (!_read_block(iter->loader, entry.offset, entry.size, &iter->current, &iter->start, &iter->stop, 0, NULL))
+    {
+        iter->start = iter->stop = NULL;
+        return 0;
     }
 
-    assert(ptr != NULL);
+    // The restart array is only used to go backwards
+    const uint8_t* buckets;
+    uint32_t num_buckets;
 
-    buffer_clear(iter->key);
+    iter->num_restarts = _block_restarts(&iter->stop, &buckets, &num_buckets);
+    iter->base = iter->entry = iter->start;
+
+    return 1;
+}
+
+// Decodes the key of the entry at p into iter->key, which holds the key of
+// the entry before it unless p is a restart point. Returns its value.
+static char* _sst_loader_iterator_decode_key(SSTLoaderIterator* iter, char* p, uint32_t* vlen)
+{
+    uint32_t plen = 0, klen = 0;
+
+    p = (char *)get_varint32(p, p + 5, &plen);
+    p = (char *)get_varint32(p, p + 5, &klen);
+    p = (char *)get_varint32(p, p + 5, vlen);
+    iter->opt = _entry_kind(vlen);
+
+    assert(plen <= iter->key->length);
+
+    iter->key->length = plen;
+    buffer_putnstr(iter->key, p, klen);
+
+    return p + klen;
+}
+
+// Copies the value at p, returns the end of the entry
+static char* _sst_loader_iterator_decode_value(SSTLoaderIterator* iter, char* p, uint32_t vlen)
+{
     buffer_clear(iter->value);
 
-    if (ret == 0)
+    if (vlen > 1)
     {
-        iter->valid = 1;
-        buffer_putnstr(iter->key, key->mem, key->length);
+        buffer_putnstr(iter->value, p, vlen - 1);
+        p += vlen - 1;
+    }
 
-        if (vlen > 1)
-            buffer_putnstr(iter->value, ptr + klen, vlen - 1);
+    return p;
+}
 
-        iter->opt = (vlen == 0) ? DEL : ADD;
-        iter->start = ptr + klen;
+static inline uint32_t _restart_point(SSTLoaderIterator* iter, uint32_t index)
+{
+    return get_int32(iter->stop + sizeof(uint32_t) * index);
+}
 
-        if (vlen > 1)
-            iter->start += vlen - 1;
+static void _sst_loader_iterator_find(SSTLoaderIterator* iter, Variant* key)
+{
+    if (iter->loader->num_entries == 0)
+        return;
+
+    IndexEntry index_entry;
+    int block;
 
+    if (!_get_index_entry(iter->loader, key, &block, &index_entry))
         return;
-    }
 
-    // From here we temporarly use use the value as storage buffer
-    ptr = iter->start + get_int32(iter->stop + (sizeof(uint32_t) * left));
+    if (!_sst_loader_iterator_load(iter, block, 0) || iter->num_restarts == 0)
+        return;
 
-    do {
-        ptr = (char *)get_varint32(ptr, ptr + 5, &plen);
+    uint32_t left = 0;
+    uint32_t right = iter->num_restarts - 1;
+    uint32_t klen = 0, vlen = 0;
+
+    // The last restart point <= key
+    while (left < right)
+    {
+        uint32_t mid = (left + right + 1) / 2;
+
+        // Skip the first character which is 0 since this is a restart position
+        char* ptr = iter->base + _restart_point(iter, mid) + 1;
         ptr = (char *)get_varint32(ptr, ptr + 5, &klen);
         ptr = (char *)get_varint32(ptr, ptr + 5, &vlen);
 
-        assert(plen <= iter->key->length);
+        if (comparator_cmp(iter->loader->comparator, ptr, klen, key->mem, key->length) <= 0) // restart < key => might be ok
+            left = mid;
+        else // key < restart
+            right = mid - 1;
+    }
 
-        iter->key->length = plen;
-        buffer_putnstr(iter->key, ptr, klen);
+    char* ptr = iter->base + _restart_point(iter, left);
+    buffer_clear(iter->key);
 
-        ret = string_cmp(iter->key->mem, key->mem, iter->key->length, key->length);
+    while (ptr < iter->stop)
+    {
+        iter->entry = ptr;
+        ptr = _sst_loader_iterator_decode_key(iter, ptr, &vlen);
 
-        ptr += klen;
+        if (comparator_variant_cmp(iter->loader->comparator, iter->key, key) >= 0)
+        {
+            iter->start = _sst_loader_iterator_decode_value(iter, ptr, vlen);
+            iter->valid = 1;
+            return;
+        }
 
         if (vlen > 1)
             ptr += vlen - 1;
-
-    } while (ret < 0 && ptr < iter->stop);
-
-    if (ptr >= iter->stop)
-    {
-        iter->valid = 0;
-        iter->start = iter->stop;
     }
 
-    if (vlen > 1)
-        buffer_putnstr(iter->value, ptr - (vlen - 1), vlen - 1);
-
-    iter->opt = (vlen == 0) ? DEL : ADD;
-    iter->start = ptr;
-    iter->valid = 1;
+    // Every key of the block is smaller
+    iter->entry = iter->start = iter->stop;
+    sst_loader_iterator_next(iter);
 }
 
-SSTLoaderIterator* sst_loader_iterator_seek(SSTLoader* self, Variant* key)
+static SSTLoaderIterator* _sst_loader_iterator_new(SSTLoader* self)
 {
-    SSTLoaderIterator* iter = malloc(sizeof(SSTLoaderIterator));
+    SSTLoaderIterator* iter = calloc(1, sizeof(SSTLoaderIterator));
+
+    if (!iter)
+        PANIC("NULL allocation");
 
-    iter->prev_block = -2;
     iter->block = -1;
     iter->loader = self;
+    iter->readahead_size = ITER_READAHEAD_MIN;
 
     iter->key = buffer_new(32);
     iter->value = buffer_new(32);
-    iter->valid = 0;
+    iter->prev_keys = buffer_new(32);
     iter->opt = ADD;
 
+    kv_init(iter->prev_entries);
+
+    return iter;
+}
+
+SSTLoaderIterator* sst_loader_iterator_seek(SSTLoader* self, Variant* key)
+{
+    SSTLoaderIterator* iter = _sst_loader_iterator_new(self);
+
     if (!key)
-        _sst_loader_iterator_next_block(iter);
+        sst_loader_iterator_next(iter);
     else
         _sst_loader_iterator_find(iter, key);
 
@@ -580,11 +1177,48 @@ SSTLoaderIterator* sst_loader_iterator(SSTLoader* self)
     return sst_loader_iterator_seek(self, NULL);
 }
 
+SSTLoaderIterator* sst_loader_iterator_seek_to_last(SSTLoader* self)
+{
+    SSTLoaderIterator* iter = _sst_loader_iterator_new(self);
+
+    if (self->num_entries > 0 && _sst_loader_iterator_load(iter, self->num_blocks - 1, 1))
+    {
+        iter->entry = iter->start = iter->stop;
+        sst_loader_iterator_prev(iter);
+    }
+
+    return iter;
+}
+
+SSTLoaderIterator* sst_loader_iterator_seek_for_prev(SSTLoader* self, Variant* key)
+{
+    if (!key)
+        return sst_loader_iterator_seek_to_last(self);
+
+    SSTLoaderIterator* iter = sst_loader_iterator_seek(self, key);
+
+    if (!iter->valid)
+    {
+        // Every key of the file is smaller
+        sst_loader_iterator_free(iter);
+        return sst_loader_iterator_seek_to_last(self);
+    }
+
+    if (comparator_variant_cmp(self->comparator, iter->key, key) > 0)
+        sst_loader_iterator_prev(iter);
+
+    return iter;
+}
+
 void sst_loader_iterator_free(SSTLoaderIterator *iter)
 {
-    if (iter->prev_block >= 0)
-        free(iter->current);
+    free(iter->current);
+
+    kv_destroy(iter->prev_entries);
+    buffer_free(iter->prev_keys);
 
+    if (iter->block_key)
+        buffer_free(iter->block_key);
     buffer_free(iter->key);
     buffer_free(iter->value);
     free(iter);
@@ -592,32 +1226,93 @@ void sst_loader_iterator_free(SSTLoaderIterator *iter)
 
 void sst_loader_iterator_next(SSTLoaderIterator* iter)
 {
-    if (iter->start >= iter->stop)
+    kv_reset(iter->prev_entries);
+
+    while (iter->start >= iter->stop)
     {
-        _sst_loader_iterator_next_block(iter);
-        return;
+        if (!_sst_loader_iterator_load(iter, iter->block + 1, 0))
+            return;
     }
 
-    uint32_t plen = 0, klen = 0, vlen = 0;
-    iter->start = (char *)get_varint32(iter->start, iter->start + 5, &plen);
-    iter->start = (char *)get_varint32(iter->start, iter->start + 5, &klen);
-    iter->start = (char *)get_varint32(iter->start, iter->start + 5, &vlen);
+    uint32_t vlen = 0;
 
-    assert(plen <= iter->key->length);
+    iter->entry = iter->start;
+    char* value = _sst_loader_iterator_decode_key(iter, iter->start, &vlen);
+    iter->start = _sst_loader_iterator_decode_value(iter, value, vlen);
+    iter->valid = 1;
+}
 
-    iter->key->length = plen;
-    buffer_putnstr(iter->key, iter->start, klen);
-    iter->start += klen;
+// Decodes the restart interval holding the entries right before the
+// current one, from its restart point on
+static void _sst_loader_iterator_decode_interval(SSTLoaderIterator* iter)
+{
+    uint32_t target = iter->entry - iter->base;
+    uint32_t left = 0, right = iter->num_restarts - 1;
 
-    buffer_clear(iter->value);
+    while (left < right)
+    {
+        uint32_t mid = (left + right + 1) / 2;
 
-    if (vlen > 1)
+        if (_restart_point(iter, mid) < target)
+            left = mid;
+        else
+            right = mid - 1;
+    }
+
+    char* ptr = iter->base + _restart_point(iter, left);
+
+    buffer_clear(iter->key);
+    buffer_clear(iter->prev_keys);
+
+    while (ptr < iter->entry)
+    {
+        PrevEntry entry;
+        uint32_t vlen = 0;
+
+        entry.offset = ptr - iter->base;
+        ptr = _sst_loader_iterator_decode_key(iter, ptr, &vlen);
+
+        if (vlen > 1)
+            ptr += vlen - 1;
+
+        entry.key = iter->prev_keys->length;
+        entry.klen = iter->key->length;
+        buffer_putnstr(iter->prev_keys, iter->key->mem, iter->key->length);
+
+        kv_push(PrevEntry, iter->prev_entries, entry);
+    }
+}
+
+void sst_loader_iterator_prev(SSTLoaderIterator* iter)
+{
+    while (kv_size(iter->prev_entries) == 0)
     {
-        buffer_putnstr(iter->value, iter->start, vlen - 1);
-        iter->start += vlen - 1;
+        if (iter->entry > iter->base)
+        {
+            _sst_loader_iterator_decode_interval(iter);
+            break;
+        }
+
+        // Going on from the end of the previous block
+        if (!_sst_loader_iterator_load(iter, iter->block - 1, 1))
+            return;
+
+        iter->entry = iter->start = iter->stop;
     }
 
-    iter->opt = (vlen == 0) ? DEL : ADD;
+    PrevEntry entry = kv_pop(iter->prev_entries);
+    uint32_t plen = 0, klen = 0, vlen = 0;
+
+    char* ptr = iter->entry = iter->base + entry.offset;
+    ptr = (char *)get_varint32(ptr, ptr + 5, &plen);
+    ptr = (char *)get_varint32(ptr, ptr + 5, &klen);
+    ptr = (char *)get_varint32(ptr, ptr + 5, &vlen);
+    iter->opt = _entry_kind(&vlen);
+
+    buffer_clear(iter->key);
+    buffer_putnstr(iter->key, iter->prev_keys->mem + entry.key, entry.klen);
+
+    iter->start = _sst_loader_iterator_decode_value(iter, ptr + klen, vlen);
     iter->valid = 1;
 }
 
@@ -630,7 +1325,7 @@ int sst_loader_iterator_compare(SSTLoaderIterator* a, SSTLoaderIterator* b)
 {
     if (a->valid && b->valid)
     {
-        return string_cmp(a->key->mem, b->key->mem, a->key->length, b->key->length);
+        return comparator_variant_cmp(a->loader->comparator, a->key, b->key);
     }
 
     if (!a->valid && !b->valid)
@@ -8,40 +8,107 @@
 #include "file.h"
 #include "variant.h"
 #include "lru.h"
+#include "vector.h"
+#include "codec.h"
+#include "comparator.h"
+#include "range_del.h"
 
 typedef struct _index_entry {
-    size_t klen; // Length of the index key
-    char *key;   // Actual pointer to the index key
+    size_t klen;     // Length of the index key
+    char *key;       // Actual pointer to the index key
+    uint64_t prefix; // comparator_prefix() of the key, in the top level index only
 
     uint64_t offset; // Position of the block in the sst file
     uint64_t size;   // Size of the block
+
+    uint64_t first_block; // First data block indexed by a partition
 } IndexEntry;
 
 typedef struct _sst_loader {
     LRU* cache;
+    const Comparator* comparator;
     uint32_t level;
     uint32_t filenum;
 
     uint64_t bloom_off, bloom_size;
     uint64_t data_size, filter_size, index_size, key_size, num_blocks, num_entries, value_size;
+    uint64_t num_deletions, num_range_dels;
+    uint64_t format_version, block_size, restart_interval;
+    uint64_t index_partitions;
+    uint64_t min_expiration; // TTL_NEVER when unknown or none of the values expires
+
+    // Blocks are read with pread() into buffers instead of the file being
+    // mapped, the uncompressed ones then going through the cache as well
+    unsigned use_pread:1;
+
+    Vector* range_dels; // RangeTombstone*
+    RangeDelIndex* range_del_index;
+    CodecDict* dict;    // zstd dictionary of the blocks, if any
+
+    char* bloom; // The filters of the blocks, bloom_size bytes
 
+    // Every data block of the file, or the top level of a partitioned
+    // index: its partitions are read on demand through the cache
     File* file;
     kvec_t(IndexEntry*) index;
 } SSTLoader;
 
-SSTLoader* sst_loader_new(LRU *cache, File* file, uint32_t level, uint32_t filenum);
+SSTLoader* sst_loader_new(LRU *cache, const Comparator* comparator, File* file, uint32_t level, uint32_t filenum, int use_pread);
 void sst_loader_free(SSTLoader* self);
 int sst_loader_get(SSTLoader* self, Variant* key, Variant* value, OPT *opt);
 
+// Starts reading in the background the block that may hold key, so that
+// reads of several blocks overlap before sst_loader_get() is called on them
+void sst_loader_prefetch(SSTLoader* self, Variant* key);
+
+// Same as sst_loader_get() but points value into the block instead of
+// copying it. block is set to the cache entry of the block, to be pinned
+// by the caller, or to NULL if the block is read from the file mapping.
+int sst_loader_get_pinned(SSTLoader* self, Variant* key, Variant* value, Variant* scratch, OPT* opt, CacheEntry** block);
+
+// Looks up the sorted keys at once, reading every block they fall in just
+// once. found[i] is set as sst_loader_get() would return for keys[i].
+void sst_loader_multi_get(SSTLoader* self, uint32_t num_keys, Variant** keys, Variant** values, OPT* opts, int* found);
+
+// An entry decoded ahead by sst_loader_iterator_prev()
+typedef struct _prev_entry {
+    uint32_t offset; // of the entry in the block
+    uint32_t key;    // offset of its key in prev_keys
+    uint32_t klen;
+} PrevEntry;
+
 typedef struct _sst_loader_iterator {
-    int prev_block;
     int block; // This is an integer indexing the index of SSTLoader
     unsigned valid:1;
 
-    char *current;
-    char *start, *stop;
+    // Readahead of sequential scans: blocks read in a row, end of the
+    // range already prefetched (its beginning when going backwards) and
+    // size of the next prefetch
+    unsigned reverse:1;
+    uint32_t sequential;
+    uint64_t readahead_end;
+    uint64_t readahead_size;
+
+    char *current; // the block, when it has been allocated for the iterator
+    char *base;    // first entry of the block
+    char *entry;   // the current entry
+    char *start;   // the entry following it
+    char *stop;    // the restart array, num_restarts offsets
+    uint32_t num_restarts;
     SSTLoader* loader;
 
+    // Going backwards a restart interval is decoded at once: these are its
+    // entries before the current one, the last one on top
+    kvec_t(PrevEntry) prev_entries;
+    Buffer* prev_keys;
+
+    // Set by the owner of the iterator, NULL when unbounded: no block
+    // whose keys are all outside of them is read
+    Variant* lower_bound;
+    Variant* upper_bound;
+    Buffer* block_key; // index key of the block, with an upper bound
+    unsigned has_block_key:1;
+
     OPT opt;
     Variant* key;
     Variant* value;
@@ -49,8 +116,14 @@ typedef struct _sst_loader_iterator {
 
 SSTLoaderIterator* sst_loader_iterator(SSTLoader* self);
 SSTLoaderIterator* sst_loader_iterator_seek(SSTLoader* self, Variant* key);
+
+// Positions on the last key <= key, or on the last key of the file
+SSTLoaderIterator* sst_loader_iterator_seek_for_prev(SSTLoader* self, Variant* key);
+SSTLoaderIterator* sst_loader_iterator_seek_to_last(SSTLoader* self);
+
 void sst_loader_iterator_free(SSTLoaderIterator* iter);
 void sst_loader_iterator_next(SSTLoaderIterator* iter);
+void sst_loader_iterator_prev(SSTLoaderIterator* iter);
 int sst_loader_iterator_valid(SSTLoaderIterator* iter);
 int sst_loader_iterator_compare(SSTLoaderIterator* a, SSTLoaderIterator* b);
 
@@ -0,0 +1,79 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "interval_index.h"
+#include "utils.h"
+
+#define NUM_RANGES 64
+#define NUM_KEYS 1000
+
+static Variant* _key(int i)
+{
+    char buff[32];
+    Variant* key = buffer_new(16);
+
+    snprintf(buff, sizeof(buff), "key-%08d", i);
+    buffer_putstr(key, buff);
+
+    return key;
+}
+
+// The ranges found for every key are the ones holding it, from the last
+// one to the first
+int main(int argc, char *argv[])
+{
+    Variant* smallest[NUM_RANGES];
+    Variant* largest[NUM_RANGES];
+    int bounds[NUM_RANGES][2];
+
+    srand(1);
+
+    for (int r = 0; r < NUM_RANGES; r++)
+    {
+        bounds[r][0] = rand() % NUM_KEYS;
+        bounds[r][1] = bounds[r][0] + rand() % (NUM_KEYS / 8);
+
+        smallest[r] = _key(bounds[r][0]);
+        largest[r] = _key(bounds[r][1]);
+    }
+
+    IntervalIndex* index = interval_index_new(comparator_bytewise());
+
+    // Built again with more ranges each time, as level 0 grows
+    for (int count = 0; count <= NUM_RANGES; count += 16)
+    {
+        interval_index_build(index, count, smallest, largest);
+
+        for (int i = 0; i < NUM_KEYS + NUM_KEYS / 8; i++)
+        {
+            Variant* key = _key(i);
+            const uint32_t* positions;
+            uint32_t found = interval_index_find(index, key, &positions);
+            uint32_t p = 0;
+
+            for (int r = count - 1; r >= 0; r--)
+            {
+                if (i >= bounds[r][0] && i <= bounds[r][1])
+                {
+                    assert(p < found && positions[p] == (uint32_t)r);
+                    p++;
+                }
+            }
+
+            assert(p == found);
+            buffer_free(key);
+        }
+    }
+
+    interval_index_free(index);
+
+    for (int r = 0; r < NUM_RANGES; r++)
+    {
+        buffer_free(smallest[r]);
+        buffer_free(largest[r]);
+    }
+
+    printf("interval_index_test: OK\n");
+    return 0;
+}
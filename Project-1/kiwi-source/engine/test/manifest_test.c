@@ -0,0 +1,92 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "db.h"
+
+#define TEST_DB "testdb_manifest"
+#define NUM_KEYS 50000
+
+static Variant _key(char* buff, int i)
+{
+    Variant key;
+
+    snprintf(buff, 32, "key-%08d", i);
+    key.mem = buff;
+    key.length = strlen(buff);
+
+    return key;
+}
+
+static void _add(DB* db, int from, int to)
+{
+    char k[32];
+    char v[128];
+
+    for (int i = from; i < to; i++)
+    {
+        Variant key = _key(k, i);
+        Variant value;
+
+        snprintf(v, sizeof(v), "value-%d-%080d", i, 0);
+        value.mem = v;
+        value.length = strlen(v);
+
+        db_add(db, &key, &value);
+    }
+}
+
+static void _check(DB* db, int count)
+{
+    char k[32];
+    Variant* value = buffer_new(128);
+
+    for (int i = 0; i < count; i++)
+    {
+        Variant key = _key(k, i);
+
+        buffer_clear(value);
+        assert(db_get(db, &key, value) == 1);
+        assert(atoi(value->mem + 6) == i);
+    }
+
+    buffer_free(value);
+}
+
+// Appends the beginning of a record to the manifest, as a crash while it
+// was written would leave it
+static void _tear_manifest(void)
+{
+    FILE* manifest = fopen(TEST_DB "/si/manifest", "ab");
+
+    assert(manifest);
+    fwrite("\x30\x00\x00\x00garbage", 1, 11, manifest);
+    fclose(manifest);
+}
+
+// The edits before a torn record are replayed, and the ones written after
+// reopening are not lost behind it
+int main(int argc, char *argv[])
+{
+    system("rm -rf " TEST_DB);
+
+    DB* db = db_open(TEST_DB);
+    _add(db, 0, NUM_KEYS);
+    db_close(db);
+
+    _tear_manifest();
+
+    db = db_open(TEST_DB);
+    _check(db, NUM_KEYS);
+    _add(db, NUM_KEYS, 2 * NUM_KEYS);
+    db_close(db);
+
+    db = db_open(TEST_DB);
+    _check(db, 2 * NUM_KEYS);
+    db_close(db);
+
+    system("rm -rf " TEST_DB);
+
+    printf("manifest_test: OK\n");
+    return 0;
+}
@@ -0,0 +1,242 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "db.h"
+#include "range_del.h"
+#include "sst_loader.h"
+
+#define TEST_DB "testdb_range_del"
+#define NUM_KEYS 20000
+
+static Variant _key(char* buff, int i)
+{
+    Variant key;
+
+    snprintf(buff, 32, "key-%08d", i);
+    key.mem = buff;
+    key.length = strlen(buff);
+
+    return key;
+}
+
+static RangeTombstone* _tombstone(int begin, int end)
+{
+    char b[32], e[32];
+    Variant vb = _key(b, begin);
+    Variant ve = _key(e, end);
+
+    return range_tombstone_new(&vb, &ve);
+}
+
+// The index merges the overlapping tombstones and finds the keys covered
+static void test_index(void)
+{
+    char k[32];
+    Vector* tombstones = vector_new();
+    RangeDelIndex* index = range_del_index_new(comparator_bytewise());
+
+    vector_add(tombstones, _tombstone(10, 20));
+    vector_add(tombstones, _tombstone(40, 50));
+    vector_add(tombstones, _tombstone(15, 30));
+    vector_add(tombstones, _tombstone(60, 60));
+    vector_add(tombstones, _tombstone(5, 12));
+
+    for (uint32_t i = 0; i < vector_count(tombstones); i++)
+        range_del_index_add(index, (RangeTombstone*)vector_get(tombstones, i));
+
+    assert(index->count == 3);
+
+    for (int i = 0; i < 70; i++)
+    {
+        Variant key = _key(k, i);
+        int covered = (i >= 5 && i <= 30) || (i >= 40 && i <= 50) || i == 60;
+
+        assert(range_del_index_covers(index, &key) == covered);
+    }
+
+    range_del_index_free(index);
+    range_del_free(tombstones);
+}
+
+// Checks that exactly the keys outside of [begin, end] are found
+static void _check(DB* db, int begin, int end)
+{
+    char k[32];
+    Variant* value = buffer_new(16);
+
+    for (int i = 0; i < NUM_KEYS; i++)
+    {
+        Variant key = _key(k, i);
+
+        buffer_clear(value);
+        assert(db_get(db, &key, value) == (i < begin || i > end));
+    }
+
+    int count = 0;
+    DBIterator* iter = db_iterator_new(db);
+
+    for (db_iterator_seek_to_first(iter); db_iterator_valid(iter); db_iterator_next(iter))
+    {
+        int i = atoi(db_iterator_key(iter)->mem + 4);
+
+        assert(i < begin || i > end);
+        count++;
+    }
+
+    db_iterator_free(iter);
+    buffer_free(value);
+
+    assert(count == NUM_KEYS - (end - begin + 1));
+}
+
+// A range deletion hides the keys of the memtable and of the files, and
+// survives a restart
+static void test_db(void)
+{
+    char k[32], v[32];
+
+    system("rm -rf " TEST_DB);
+    DB* db = db_open(TEST_DB);
+
+    for (int i = 0; i < NUM_KEYS; i++)
+    {
+        Variant key = _key(k, i);
+        Variant value = _key(v, i);
+
+        db_add(db, &key, &value);
+    }
+
+    char b[32], e[32];
+    Variant begin = _key(b, 1000);
+    Variant end = _key(e, 4999);
+
+    db_delete_range(db, &begin, &end);
+    _check(db, 1000, 4999);
+
+    db_close(db);
+    db = db_open(TEST_DB);
+    _check(db, 1000, 4999);
+
+    db_close(db);
+    system("rm -rf " TEST_DB);
+}
+
+// Every memtable merged gives the merge thread an idle round, where the
+// tombstones are looked at: fills a few with keys after those of _key()
+static void _fill(DB* db, int first)
+{
+    char k[32];
+    char big[4096];
+
+    memset(big, 'x', sizeof(big));
+
+    for (int i = first; i < first + 8 * 1024; i++)
+    {
+        Variant key = _key(k, i);
+        Variant value = {.mem = big, .length = sizeof(big)};
+
+        key.mem[0] = 'z';
+        db_add(db, &key, &value);
+    }
+}
+
+// The level of the files holding range tombstones, -1 if there is none
+static int _range_del_level(SST* sst)
+{
+    for (int level = 0; level < MAX_LEVELS; level++)
+        for (uint32_t i = 0; i < sst->num_files[level]; i++)
+            if (sst->files[level][i]->loader->num_range_dels > 0)
+                return level;
+
+    return -1;
+}
+
+// A range deletion of a handful of keys is not worth a compaction, one
+// covering whole files of the level below is. The levels have fixed
+// targets so that only the tombstones move the files.
+static void test_compaction(void)
+{
+    char k[32], v[32], b[32], e[32];
+    Options* options = options_new();
+
+    options->dynamic_level_bytes = 0;
+
+    system("rm -rf " TEST_DB);
+    DB* db = db_open_options(TEST_DB, options);
+
+    for (int i = 0; i < NUM_KEYS; i++)
+    {
+        Variant key = _key(k, i);
+        Variant value = _key(v, i);
+
+        db_add(db, &key, &value);
+    }
+
+    db_close(db);
+    db = db_open_options(TEST_DB, options);
+
+    int level = -1;
+
+    for (int i = MAX_LEVELS - 1; i >= 0 && level < 0; i--)
+        if (db->sst->num_files[i] > 0)
+            level = i;
+
+    assert(level > 0 && db->sst->num_files[level] == 1);
+    uint32_t filenum = db->sst->files[level][0]->filenum;
+
+    Variant begin = _key(b, 100);
+    Variant end = _key(e, 109);
+
+    db_delete_range(db, &begin, &end);
+
+    // The deletion is flushed on its own, right above the keys
+    db_close(db);
+    db = db_open_options(TEST_DB, options);
+    _fill(db, 0);
+    db_close(db);
+    db = db_open_options(TEST_DB, options);
+
+    assert(_range_del_level(db->sst) == level - 1);
+    assert(db->sst->files[level][0]->filenum == filenum);
+
+    begin = _key(b, 0);
+    end = _key(e, NUM_KEYS - 1);
+
+    db_delete_range(db, &begin, &end);
+
+    db_close(db);
+    db = db_open_options(TEST_DB, options);
+    _fill(db, 8 * 1024);
+    db_close(db);
+    db = db_open_options(TEST_DB, options);
+
+    // Nothing is left below to hide, the keys and the tombstones are gone
+    assert(_range_del_level(db->sst) == -1);
+    assert(db->sst->files[level][0]->filenum != filenum);
+
+    Variant* value = buffer_new(16);
+
+    for (int i = 0; i < NUM_KEYS; i++)
+    {
+        Variant key = _key(k, i);
+
+        assert(db_get(db, &key, value) == 0);
+    }
+
+    buffer_free(value);
+
+    db_close(db);
+    options_free(options);
+    system("rm -rf " TEST_DB);
+}
+
+int main(int argc, char *argv[])
+{
+    test_index();
+    test_db();
+    test_compaction();
+
+    printf("range_del_test: OK\n");
+    return 0;
+}
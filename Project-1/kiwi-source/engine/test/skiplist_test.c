@@ -1,13 +1,35 @@
+#include <stdlib.h>
+#include <string.h>
 #include "skiplist.h"
+#include "utils.h"
+
+// Encodes the key with an empty value as the list stores it, the list
+// owning the copy
+static void _insert(SkipList* sl, const char* key)
+{
+  size_t klen = strlen(key);
+  char* data = malloc(varint_length(klen) + klen + 1);
+  char* encoded_key = encode_varint32(data, klen);
+
+  memcpy(encoded_key, key, klen);
+  encode_varint32(encoded_key + klen, 1);
+
+  skiplist_insert(sl, encoded_key, klen, ADD, data);
+}
 
 int main(int argc, char *argv[])
 {
-  SkipList* sl = skiplist_new(10);
-  skiplist_insert(sl, "miao", 4, 22, ADD);
-  skiplist_insert(sl, "dioe", 4, 22, ADD);
-  skiplist_insert(sl, "asdd", 4, 22, ADD);
-  skiplist_insert(sl, "miaa", 4, 22, ADD);
-  skiplist_insert(sl, "miao", 4, 22, ADD);
-  skiplist_insert(sl, "msaa", 4, 22, ADD);
-  skiplist_insert(sl, "mwao", 4, 22, ADD);
+  SkipList* sl = skiplist_new(10, comparator_bytewise());
+  _insert(sl, "miao");
+  _insert(sl, "dioe");
+  _insert(sl, "asdd");
+  _insert(sl, "miaa");
+  _insert(sl, "miao");
+  _insert(sl, "msaa");
+  _insert(sl, "mwao");
+
+  if (sl->count != 6 || !skiplist_lookup(sl, "msaa", 4) || skiplist_lookup(sl, "mxxx", 4))
+    return 1;
+
+  return 0;
 }
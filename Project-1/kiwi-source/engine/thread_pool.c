@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include "thread_pool.h"
+#include "indexer.h"
+
+static void* _thread_pool_worker(void* data)
+{
+    ThreadPool* self = (ThreadPool*)data;
+
+    pthread_mutex_lock(&self->lock);
+
+    while (1)
+    {
+        while (!self->head && !self->exit)
+            pthread_cond_wait(&self->work_cv, &self->lock);
+
+        // Pending tasks are completed before leaving
+        if (!self->head)
+            break;
+
+        ThreadPoolTask* task = self->head;
+        self->head = task->next;
+
+        if (!self->head)
+            self->tail = NULL;
+
+        pthread_mutex_unlock(&self->lock);
+        task->run(task->arg);
+        pthread_mutex_lock(&self->lock);
+
+        task->done = 1;
+        pthread_cond_broadcast(&self->done_cv);
+    }
+
+    pthread_mutex_unlock(&self->lock);
+    return NULL;
+}
+
+ThreadPool* thread_pool_new(int num_threads)
+{
+    ThreadPool* self = calloc(1, sizeof(ThreadPool));
+
+    if (!self)
+        PANIC("NULL allocation");
+
+    self->threads = malloc(sizeof(pthread_t) * num_threads);
+
+    if (!self->threads)
+        PANIC("NULL allocation");
+
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->work_cv, NULL);
+    pthread_cond_init(&self->done_cv, NULL);
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        if (pthread_create(&self->threads[i], NULL, _thread_pool_worker, self) != 0)
+            PANIC("Unable to create the worker thread %d", i);
+    }
+
+    self->num_threads = num_threads;
+    return self;
+}
+
+void thread_pool_free(ThreadPool* self)
+{
+    pthread_mutex_lock(&self->lock);
+    self->exit = 1;
+    pthread_cond_broadcast(&self->work_cv);
+    pthread_mutex_unlock(&self->lock);
+
+    for (int i = 0; i < self->num_threads; i++)
+        pthread_join(self->threads[i], NULL);
+
+    pthread_mutex_destroy(&self->lock);
+    pthread_cond_destroy(&self->work_cv);
+    pthread_cond_destroy(&self->done_cv);
+
+    free(self->threads);
+    free(self);
+}
+
+void thread_pool_submit(ThreadPool* self, ThreadPoolTask* task)
+{
+    task->done = 0;
+    task->next = NULL;
+
+    pthread_mutex_lock(&self->lock);
+
+    if (self->tail)
+        self->tail->next = task;
+    else
+        self->head = task;
+
+    self->tail = task;
+
+    pthread_cond_signal(&self->work_cv);
+    pthread_mutex_unlock(&self->lock);
+}
+
+int thread_pool_is_done(ThreadPool* self, ThreadPoolTask* task)
+{
+    pthread_mutex_lock(&self->lock);
+    int done = task->done;
+    pthread_mutex_unlock(&self->lock);
+
+    return done;
+}
+
+void thread_pool_wait(ThreadPool* self, ThreadPoolTask* task)
+{
+    pthread_mutex_lock(&self->lock);
+
+    while (!task->done)
+        pthread_cond_wait(&self->done_cv, &self->lock);
+
+    pthread_mutex_unlock(&self->lock);
+}
@@ -0,0 +1,38 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <pthread.h>
+
+// A fixed set of worker threads running tasks in FIFO order. Tasks are
+// owned by the caller (usually embedded in a bigger job structure) and must
+// stay alive until thread_pool_wait() returns for them.
+
+typedef struct _thread_pool_task {
+    void (*run)(void* arg);
+    void* arg;
+    int done;
+
+    struct _thread_pool_task* next;
+} ThreadPoolTask;
+
+typedef struct _thread_pool {
+    int num_threads;
+    pthread_t* threads;
+
+    ThreadPoolTask* head;
+    ThreadPoolTask* tail;
+    int exit;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv; // signalled when a task is queued
+    pthread_cond_t done_cv; // signalled when a task is completed
+} ThreadPool;
+
+ThreadPool* thread_pool_new(int num_threads);
+void thread_pool_free(ThreadPool* self);
+
+void thread_pool_submit(ThreadPool* self, ThreadPoolTask* task);
+int thread_pool_is_done(ThreadPool* self, ThreadPoolTask* task);
+void thread_pool_wait(ThreadPool* self, ThreadPoolTask* task);
+
+#endif
@@ -0,0 +1,29 @@
+#include "ttl.h"
+#include "utils.h"
+
+void ttl_value_encode(Buffer* out, const Variant* value, uint32_t expiration)
+{
+    buffer_putnstr(out, value->mem, value->length);
+    buffer_putint32(out, expiration);
+}
+
+uint32_t ttl_value_expiration(const Variant* value)
+{
+    // Written by someone else than the database, let it live
+    if (value->length < TTL_SUFFIX_SIZE)
+        return TTL_NEVER;
+
+    return get_int32(value->mem + value->length - TTL_SUFFIX_SIZE);
+}
+
+int ttl_value_expired(const Variant* value, uint32_t now)
+{
+    uint32_t expiration = ttl_value_expiration(value);
+
+    return expiration != TTL_NEVER && expiration <= now;
+}
+
+size_t ttl_value_length(const Variant* value)
+{
+    return (value->length < TTL_SUFFIX_SIZE) ? value->length : value->length - TTL_SUFFIX_SIZE;
+}
@@ -0,0 +1,28 @@
+#ifndef __TTL_H__
+#define __TTL_H__
+
+#include <stdint.h>
+#include "variant.h"
+
+/*
+ * When a database is opened with the with_ttl option every value is stored
+ * with a 4 bytes suffix holding the time (seconds since the epoch) the
+ * value expires at, 0 meaning never:
+ *   <user value><expiration:int32>
+ *
+ * The suffix is hidden from db_get() and the iterators, which also skip the
+ * expired values, while compactions drop them for good. A database must
+ * always be opened with the same with_ttl setting.
+ */
+
+#define TTL_SUFFIX_SIZE 4
+#define TTL_NEVER 0
+
+void ttl_value_encode(Buffer* out, const Variant* value, uint32_t expiration);
+uint32_t ttl_value_expiration(const Variant* value);
+int ttl_value_expired(const Variant* value, uint32_t now);
+
+// Length of the user part of the value
+size_t ttl_value_length(const Variant* value);
+
+#endif
@@ -157,37 +157,3 @@ void int3(void)
 {
     raise(SIGTRAP);
 }
-
-
-inline int string_cmp(const char *s1, const char *s2, size_t ln, size_t lm)
-{
-    int ret = memcmp(s1, s2, MIN(ln, lm));
-
-    if (ln == lm || ret != 0)
-        return ret;
-
-    return (ln < lm) ? -1 : 1;
-}
-
-int variant_cmp(const Variant* a, const Variant* b)
-{
-    return string_cmp(a->mem, b->mem, a->length, b->length);
-}
-
-int range_intersects(Variant* astart, Variant* bstart, Variant* astop, Variant* bstop)
-{
-    return
-      /*int ret = */
-           !((string_cmp(bstop->mem, astart->mem, bstop->length, astart->length) < 0) ||
-             (string_cmp(bstart->mem, astop->mem, bstart->length, astop->length) > 0));
-    /*
-    DEBUG("RANGE CHECK [%.*s, %.*s] vs [%.*s, %.*s] = %d %d = %d",
-          astart->length, astart->mem,
-          astop->length, astop->mem,
-          bstart->length, bstart->mem,
-          bstop->length, bstop->mem,
-          string_cmp(bstop->mem, astart->mem, bstop->length, astart->length),
-          string_cmp(bstart->mem, astop->mem, bstart->length, astop->length), ret);
-    return ret;
-    */
-}
@@ -3,6 +3,11 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "config.h"
 #include "variant.h"
 
 size_t varint_length(uint64_t v);
@@ -18,8 +23,144 @@ uint64_t get_int64(const char* ptr);
 long long get_ustime_sec(void);
 void int3(void);
 
-int string_cmp(const char *s1, const char *s2, size_t ln, size_t lm);
-int variant_cmp(const Variant* a, const Variant* b);
-int range_intersects(Variant* astart, Variant* bstart, Variant* astop, Variant* bstop);
+// First 8 bytes of the key as a big-endian integer, padded with zeroes.
+// Keys with different prefixes compare like them, equal prefixes tell
+// nothing.
+static inline uint64_t key_prefix(const char* key, size_t length)
+{
+    uint64_t prefix = 0;
+
+    if (length >= 8)
+    {
+        memcpy(&prefix, key, 8);
+#if IS_LITTLE_ENDIAN
+        prefix = __builtin_bswap64(prefix);
+#endif
+        return prefix;
+    }
+
+    for (size_t i = 0; i < length; i++)
+        prefix |= (uint64_t)(unsigned char)key[i] << (56 - 8 * i);
+
+    return prefix;
+}
+
+// Order of two different words loaded from the keys: that of their first
+// byte that differs, as memcmp() returns it
+static inline int word_cmp(uint64_t a, uint64_t b)
+{
+#if IS_LITTLE_ENDIAN
+    int shift = __builtin_ctzll(a ^ b) & ~7;
+
+    return (int)((a >> shift) & 0xff) - (int)((b >> shift) & 0xff);
+#else
+    return (a < b) ? -1 : 1;
+#endif
+}
+
+static inline int byte_cmp(const char* s1, const char* s2, size_t i)
+{
+    return (int)(unsigned char)s1[i] - (int)(unsigned char)s2[i];
+}
+
+#ifdef __SSE2__
+// Bit i is set when the i-th bytes of the sixteen at a and b differ
+static inline unsigned int diff_mask16(const char* a, const char* b)
+{
+    __m128i x = _mm_loadu_si128((const __m128i*)a);
+    __m128i y = _mm_loadu_si128((const __m128i*)b);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xffff;
+}
+#endif
+
+// The comparison of the keys, on every lookup path: it is inlined by the
+// callers. Most keys differ within their first eight bytes, compared as a
+// single word. The keys sharing them go on through the SSE2 registers,
+// 32 bytes per branch, which find the first byte that differs without a
+// call to memcmp().
+static inline int string_cmp(const char *s1, const char *s2, size_t ln, size_t lm)
+{
+    size_t n = (ln < lm) ? ln : lm;
+    size_t i = 0;
+    uint64_t a, b;
+
+    if (n >= 8)
+    {
+        memcpy(&a, s1, 8);
+        memcpy(&b, s2, 8);
+
+        if (a != b)
+            return word_cmp(a, b);
+
+        i = 8;
+    }
+
+#ifdef __SSE2__
+    for (; i + 32 <= n; i += 32)
+    {
+        unsigned int mask = diff_mask16(s1 + i, s2 + i) |
+                            (diff_mask16(s1 + i + 16, s2 + i + 16) << 16);
+
+        if (mask)
+            return byte_cmp(s1, s2, i + __builtin_ctz(mask));
+    }
+
+    if (i + 16 <= n)
+    {
+        unsigned int mask = diff_mask16(s1 + i, s2 + i);
+
+        if (mask)
+            return byte_cmp(s1, s2, i + __builtin_ctz(mask));
+
+        i += 16;
+    }
+
+    if (i + 8 <= n)
+#else
+    while (i + 8 <= n)
+#endif
+    {
+        memcpy(&a, s1 + i, 8);
+        memcpy(&b, s2 + i, 8);
+
+        if (a != b)
+            return word_cmp(a, b);
+
+        i += 8;
+    }
+
+    if (i < n)
+    {
+        a = key_prefix(s1 + i, n - i);
+        b = key_prefix(s2 + i, n - i);
+
+        if (a != b)
+            return (a < b) ? -1 : 1;
+    }
+
+    if (ln == lm)
+        return 0;
+
+    return (ln < lm) ? -1 : 1;
+}
+
+static inline int variant_cmp(const Variant* a, const Variant* b)
+{
+    return string_cmp(a->mem, b->mem, a->length, b->length);
+}
+
+// Same as string_cmp() for keys whose key_prefix() is known: only keys
+// with the same prefix are compared, past the bytes it holds
+static inline int prefix_cmp(uint64_t pa, const char* a, size_t la, uint64_t pb, const char* b, size_t lb)
+{
+    if (pa != pb)
+        return (pa < pb) ? -1 : 1;
+
+    if (la >= 8 && lb >= 8)
+        return string_cmp(a + 8, b + 8, la - 8, lb - 8);
+
+    return string_cmp(a, b, la, lb);
+}
 
 #endif
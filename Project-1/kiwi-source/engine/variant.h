@@ -3,7 +3,9 @@
 
 #include "buffer.h"
 
-typedef enum {ADD,DEL} OPT;
+// BLOB entries only exist in the sst files: their value is a reference to
+// a blob file, see blob.h
+typedef enum {ADD,DEL,BLOB} OPT;
 typedef Buffer Variant;
 
 #endif
@@ -1,3 +1,4 @@
+#include <string.h>
 #include "vector.h"
 
 Vector* vector_new(void)
@@ -69,3 +70,17 @@ void *vector_release(Vector *self)
     self->count = 0;
     return ptr;
 }
+
+void* vector_remove(Vector* self, uint32_t pos)
+{
+    if (pos >= self->count)
+        return NULL;
+
+    void* data = self->data[pos];
+
+    // Keep the order of the remaining elements
+    memmove(self->data + pos, self->data + pos + 1, sizeof(void*) * (self->count - pos - 1));
+    self->count--;
+
+    return data;
+}
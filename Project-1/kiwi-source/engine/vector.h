@@ -19,5 +19,6 @@ void** vector_data(Vector* self);
 void vector_add(Vector* self, void* data);
 void *vector_get(Vector* self, uint32_t pos);
 void vector_set(Vector* self, uint32_t pos, void* data);
+void* vector_remove(Vector* self, uint32_t pos);
 
 #endif